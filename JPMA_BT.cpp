@@ -3,16 +3,160 @@
 #include <random>
 #include <string.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <tuple>
 #include <cassert>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
 
 #include "defines.hpp"
 #include "JPMA_BT.hpp"
 #include "diymalloc.h"
 
+#if Search_type > 0 || Bitmap_engine == 2 || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
+/*
+    Number of keys among key[0..count-1] smaller than or equal to search_key, which is the index of the child to follow.
+    Keys in a node are sorted, so a compare over the whole key array and a popcount replaces the backward scan. The vector
+    versions read the key array in whole vectors, which BPlusTree pads for them, and mask out the unused keys. 32-bit
+    keys compare twice as many keys per vector. Other key types take the scalar scan
+ */
+template<int Degree, typename Key>
+static inline int childPosition(const Key *key, int count, Key search_key){
+#if Search_type == 2
+    if constexpr(is_same<Key, int64_t>::value){
+        __m256i skey = _mm256_set1_epi64x(search_key);
+        uint32_t greater = 0;
+        for(int i = 0; i < Degree-1; i += 4){
+            __m256i k = _mm256_loadu_si256((const __m256i *)(key + i));
+            greater |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, skey))) << i;
+        }
+        return __builtin_popcount(~greater & ((1u << count) - 1));
+    }else if constexpr(is_same<Key, int32_t>::value){
+        __m256i skey = _mm256_set1_epi32(search_key);
+        uint32_t greater = 0;
+        for(int i = 0; i < Degree-1; i += 8){
+            __m256i k = _mm256_loadu_si256((const __m256i *)(key + i));
+            greater |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, skey))) << i;
+        }
+        return __builtin_popcount(~greater & ((1u << count) - 1));
+    }
+#elif Search_type == 1
+    if constexpr(is_same<Key, int64_t>::value){
+        __m128i skey = _mm_set1_epi64x(search_key);
+        uint32_t greater = 0;
+        for(int i = 0; i < Degree-1; i += 2){
+            __m128i k = _mm_loadu_si128((const __m128i *)(key + i));
+            greater |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, skey))) << i;
+        }
+        return __builtin_popcount(~greater & ((1u << count) - 1));
+    }else if constexpr(is_same<Key, int32_t>::value){
+        __m128i skey = _mm_set1_epi32(search_key);
+        uint32_t greater = 0;
+        for(int i = 0; i < Degree-1; i += 4){
+            __m128i k = _mm_loadu_si128((const __m128i *)(key + i));
+            greater |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, skey))) << i;
+        }
+        return __builtin_popcount(~greater & ((1u << count) - 1));
+    }
+#endif
+    int smallest;
+    for(smallest = count; smallest > 0; smallest--){
+        if(key[smallest-1] <= search_key) break;
+    }
+    return smallest;
+}
+
+//Key and value types the masked block kernel of range_sum loads into 64-bit lanes
+template<typename T>
+static constexpr bool laneType(){
+    return is_integral<T>::value && (sizeof(T) == 8 || sizeof(T) == 4);
+}
+
+#if defined(__AVX512F__)
+//Eight keys or values widened to 64-bit lanes
+template<typename T>
+static inline __m512i loadLanes8(const T *p){
+    if constexpr(sizeof(T) == 8) return _mm512_loadu_si512((const void *)p);
+    else if constexpr(is_signed<T>::value) return _mm512_maskz_cvtepi32_epi64(0xFF, _mm256_loadu_si256((const __m256i *)p));
+    else return _mm512_maskz_cvtepu32_epi64(0xFF, _mm256_loadu_si256((const __m256i *)p));
+}
+
+//Spelled out with zero-masked extracts, gcc warns on the undefined upper halves behind _mm512_reduce_add_epi64
+static inline int64_t horizontalSum(__m512i v){
+    __m256i half = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xF, v, 0), _mm512_maskz_extracti64x4_epi64(0xF, v, 1));
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(half), _mm256_extracti128_si256(half, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+#elif defined(__AVX2__)
+//Four keys or values widened to 64-bit lanes
+template<typename T>
+static inline __m256i loadLanes4(const T *p){
+    if constexpr(sizeof(T) == 8) return _mm256_loadu_si256((const __m256i *)p);
+    else if constexpr(is_signed<T>::value) return _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)p));
+    else return _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)p));
+}
+
+static inline int64_t horizontalSum(__m256i v){
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+#endif
+
+/*
+    Occupied slots of a block whose tested field passes the predicate. bits holds the occupancy of the JacobsonIndexSize
+    slots from tested on. Groups of lanes without an occupied slot are skipped
+ */
+template<typename T>
+static inline u_int matchBlock(const T *tested, u_int bits, const ValuePredicate &predicate){
+#if defined(__AVX512F__)
+    if constexpr(laneType<T>()){
+        u_int match = 0;
+        for(int lane = 0; lane < JacobsonIndexSize; lane += 8){
+            __mmask8 occupied = (__mmask8)(bits >> lane);
+            if(occupied == 0) continue;
+            __m512i v = loadLanes8(tested + lane);
+            __mmask8 pass = 0;
+            if(predicate.member.empty()) pass = _mm512_mask_cmpge_epi64_mask(occupied, v, _mm512_set1_epi64(predicate.low)) & _mm512_mask_cmple_epi64_mask(occupied, v, _mm512_set1_epi64(predicate.high));
+            else for(int64_t m : predicate.member) pass |= _mm512_mask_cmpeq_epi64_mask(occupied, v, _mm512_set1_epi64(m));
+            match |= (u_int)pass << lane;
+        }
+        return match;
+    }
+#elif defined(__AVX2__)
+    if constexpr(laneType<T>()){
+        u_int match = 0;
+        for(int lane = 0; lane < JacobsonIndexSize; lane += 4){
+            if(((bits >> lane) & 0xF) == 0) continue;
+            __m256i v = loadLanes4(tested + lane);
+            if(predicate.member.empty()){
+                __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(_mm256_set1_epi64x(predicate.low), v), _mm256_cmpgt_epi64(v, _mm256_set1_epi64x(predicate.high)));
+                match |= (u_int)(~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xF) << lane;
+            }else{
+                __m256i pass = _mm256_setzero_si256();
+                for(int64_t m : predicate.member) pass = _mm256_or_si256(pass, _mm256_cmpeq_epi64(v, _mm256_set1_epi64x(m)));
+                match |= (u_int)_mm256_movemask_pd(_mm256_castsi256_pd(pass)) << lane;
+            }
+        }
+        return match & bits;
+    }
+#endif
+    u_int match = 0;
+    for(u_int b = bits; b; b &= b - 1) if(predicate.test((int64_t)tested[__builtin_ctz(b)])) match |= 1u << __builtin_ctz(b);
+    return match;
+}
+
 //uint64_t totalRebalance = 0;
 //uint64_t totalShiftingInsert = 0;
 //uint64_t totalShiftingReb = 0;
@@ -20,42 +164,100 @@ using namespace std;
 //uint64_t totalInserts = 0;
 //int maxheight = 0;
 
-PMA::PMA(type_t totalInsert){
-    elementsInSegment = SEGMENT_SIZE/sizeof(type_t);
+/*
+    Worker threads kept across the parallel scans. run hands the tasks 0..tasks-1 out to the workers and to the calling
+    thread, which counts as worker 0, one at a time as they finish, and returns once all of them are done
+ */
+class WorkerPool{
+public:
+    WorkerPool(int threads){
+        for(int worker = 1; worker < threads; worker++) workers.emplace_back(&WorkerPool::work, this, worker);
+    }
+    ~WorkerPool(){
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        wake.notify_all();
+        for(thread &t : workers) t.join();
+    }
+    int size() const { return (int)workers.size() + 1; }
+    void run(int tasks, const function<void(int task, int worker)> &f){
+        {
+            lock_guard<mutex> lock(m);
+            job = &f;
+            taskCount = tasks;
+            nextTask = 0;
+            busy = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain(0);
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this]{ return busy == 0; });
+    }
+private:
+    vector<thread> workers;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int, int)> *job = NULL;
+    atomic<int> nextTask{0};
+    int taskCount = 0;
+    int busy = 0;              //Workers still on the current job
+    uint64_t generation = 0;   //Jobs handed out so far
+    bool stop = false;
+
+    void drain(int worker){
+        for(int task = nextTask++; task < taskCount; task = nextTask++) (*job)(task, worker);
+    }
+    void work(int worker){
+        uint64_t seen = 0;
+        while(true){
+            {
+                unique_lock<mutex> lock(m);
+                wake.wait(lock, [&]{ return stop || generation != seen; });
+                if(stop) return;
+                seen = generation;
+            }
+            drain(worker);
+            lock_guard<mutex> lock(m);
+            if(--busy == 0) done.notify_one();
+        }
+    }
+};
+
+PMA_TEMPLATE
+PMA<PMA_ARGS>::PMA(int64_t totalInsert){
+    elementsInSegment = SegmentBytes/sizeof(Key);
     int estSegment = (int)( totalInsert/(elementsInSegment * 0.75));
-    smallest.reserve(estSegment);
-    cardinality.reserve(estSegment);
-    lastElementPos.reserve(estSegment);
-    key_chunks.reserve(estSegment);
-    value_chunks.reserve(estSegment);
     freeSegID.reserve(estSegment);
     segCount = -1;
-    smallest.push_back(1);                                   //First segment has smallest element 1
-    cardinality.push_back(0);                                //First segment contains 0 elements
-    totalSegments = 1;                                       //One segment deployed at the start
-    lastElementPos.push_back(0);                             //Position of last element in the segment
+    totalSegments = 0;                                       //Counted by getSegment, one segment deployed at the start
     lastValidPos = elementsInSegment - 1;
     blocksInSegment = elementsInSegment / JacobsonIndexSize;
     freeSegmentCount = 0;
     int CurSegemnt = getSegment();
     
-    tree = new BPlusTree(this);
+    tree = new tree_t(this);
     tree->insertInTree(CurSegemnt, 0, this); //(segment no, dummy key, current JPMA object)
 
     //Create jacobson Index
-    preCalculateJacobson();
+    if(Bitmap_engine == 1) preCalculateJacobson();
 }
 
-PMA::~PMA(){
-    u_int size = cleanSegments.size();
-    for(u_int i = 0; i<size; i++){
-        type_t * temp = cleanSegments.back();
-        cleanSegments.pop_back();
-        delete temp;
+PMA_TEMPLATE
+PMA<PMA_ARGS>::~PMA(){
+    delete pool;
+    for(size_t i = 0; i<cleanSegments.size(); i++){
+        size_t chunkSize = isSet || i % 2 == 0 ? CHUNK_SIZE : valueChunkSize;
+        if(Allocation_type == 1) munmap(cleanSegments[i], chunkSize);
+        else free(cleanSegments[i]);
     }
 }
 
-void PMA::preCalculateJacobson(){
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::preCalculateJacobson(){
+#if Bitmap_engine == 1
     for(int i = 0; i<JacobsonIndexCount; i++){
         int j, k = 1, idx = 0;
         u_char count = 0;
@@ -70,208 +272,561 @@ void PMA::preCalculateJacobson(){
             k = k<<1;
         }
     }
+#endif
+}
+
+/*
+    Bitmap engine. A bitmap block holds the occupancy of JacobsonIndexSize slots. The Jacobson engine reads the number
+    of occupied slots and their positions from the NonZeroEntries table. The bit engine computes them with popcnt, tzcnt
+    and pdep, and scans a segment 64 slots at a time, leaving the cache to the segment data.
+ */
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::blockCount(u_short block){
+#if Bitmap_engine == 1
+    return NonZeroEntries[block][0];
+#else
+    return __builtin_popcount(block);
+#endif
+}
+
+//First occupied slot of a non-empty block
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::blockFirst(u_short block){
+#if Bitmap_engine == 1
+    return NonZeroEntries[block][1];
+#else
+    return __builtin_ctz(block);
+#endif
+}
+
+//Last occupied slot of a non-empty block
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::blockLast(u_short block){
+#if Bitmap_engine == 1
+    return NonZeroEntries[block][NonZeroEntries[block][0]];
+#else
+    return 31 - __builtin_clz(block);
+#endif
+}
+
+//k-th (starting from 1) occupied slot of a block with at least k occupied slots
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::blockSelect(u_short block, int k){
+#if Bitmap_engine == 1
+    return NonZeroEntries[block][k];
+#elif defined(__BMI2__)
+    return __builtin_ctz(_pdep_u32(1u << (k-1), block));
+#else
+    u_int bits = block;
+    while(--k) bits &= bits - 1;
+    return __builtin_ctz(bits);
+#endif
+}
+
+//Number of occupied slots followed by their positions, in the format of a NonZeroEntries row
+PMA_TEMPLATE
+u_char * PMA<PMA_ARGS>::blockSlots(u_short block, u_char *slots){
+#if Bitmap_engine == 1
+    return NonZeroEntries[block];
+#else
+    int count = 0;
+    for(u_int bits = block; bits; bits &= bits - 1) slots[++count] = __builtin_ctz(bits);
+    slots[0] = count;
+    return slots;
+#endif
+}
+
+//Occupancy of slots [64 * word, 64 * word + 63] of a segment
+PMA_TEMPLATE
+uint64_t PMA<PMA_ARGS>::bitmapWord(int targetSegment, int64_t word){
+    const int64_t blocksInWord = 64 / JacobsonIndexSize;
+    uint64_t bits = 0;
+    if(LIKELY((word + 1) * blocksInWord <= blocksInSegment)){
+        memcpy(&bits, header[targetSegment].bitmap + word * blocksInWord, sizeof(uint64_t));
+    }else{
+        memcpy(&bits, header[targetSegment].bitmap + word * blocksInWord, (blocksInSegment - word * blocksInWord) * sizeof(u_short));
+    }
+    return bits;
+}
+
+//Value slots of a segment. A set has none: reads give a NoValue and writes are dropped
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::value_t PMA<PMA_ARGS>::valueAt(int targetSegment, int64_t position){
+    if constexpr(isSet) return value_t();
+    else return *(value_chunks[targetSegment] + position);
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::setValue(int targetSegment, int64_t position, value_t value){
+    if constexpr(!isSet) *(value_chunks[targetSegment] + position) = value;
+}
+
+//Values of a pair array from offset on. A set passes no values
+PMA_TEMPLATE
+const typename PMA<PMA_ARGS>::value_t * PMA<PMA_ARGS>::valuesFrom(const value_t *values, int64_t offset){
+    if constexpr(isSet) return NULL;
+    else return values + offset;
+}
+
+//A value as it adds into the value sums. A set adds nothing
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::summand(value_t value){
+    if constexpr(isSet) return 0;
+    else return value;
+}
+
+//Slots to leave between two keys, at most MaxGap. The difference is unsigned, so keys far apart cannot overflow it
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::keyGap(Key smaller, Key larger){
+    typedef typename make_unsigned<Key>::type ukey_t;
+    return (int64_t)min((ukey_t)((ukey_t)larger - (ukey_t)smaller), (ukey_t)MaxGap);
+}
+
+//First occupied slot at or after position in the segment, -1 if there is none
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::nextOccupied(int targetSegment, int64_t position){
+    if(UNLIKELY(position > lastValidPos)) return -1;
+#if Bitmap_engine == 1
+    int64_t blockNo = position / JacobsonIndexSize;
+    u_short block = header[targetSegment].bitmap[blockNo] & (0xFFFF << (position % JacobsonIndexSize));
+    while(NonZeroEntries[block][0] == 0){
+        if(++blockNo == blocksInSegment) return -1;
+        block = header[targetSegment].bitmap[blockNo];
+    }
+    return blockNo * JacobsonIndexSize + NonZeroEntries[block][1];
+#else
+    int64_t words = (elementsInSegment + 63) / 64, word = position / 64;
+    uint64_t bits = bitmapWord(targetSegment, word) & (~0ULL << (position % 64));
+    while(bits == 0){
+        if(++word == words) return -1;
+        bits = bitmapWord(targetSegment, word);
+    }
+    return word * 64 + __builtin_ctzll(bits);
+#endif
+}
+
+//Last occupied slot at or before position in the segment, -1 if there is none
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::prevOccupied(int targetSegment, int64_t position){
+    if(UNLIKELY(position < 0)) return -1;
+#if Bitmap_engine == 1
+    int64_t blockNo = position / JacobsonIndexSize;
+    u_short block = header[targetSegment].bitmap[blockNo] & (0xFFFF >> (JacobsonIndexSize - 1 - position % JacobsonIndexSize));
+    while(NonZeroEntries[block][0] == 0){
+        if(--blockNo < 0) return -1;
+        block = header[targetSegment].bitmap[blockNo];
+    }
+    return blockNo * JacobsonIndexSize + NonZeroEntries[block][NonZeroEntries[block][0]];
+#else
+    int64_t word = position / 64;
+    uint64_t bits = bitmapWord(targetSegment, word) & (~0ULL >> (63 - position % 64));
+    while(bits == 0){
+        if(--word < 0) return -1;
+        bits = bitmapWord(targetSegment, word);
+    }
+    return word * 64 + 63 - __builtin_clzll(bits);
+#endif
 }
 
-int PMA::searchSegment(type_t key){
+//First vacant slot at or after position in the segment, -1 if there is none
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::nextVacant(int targetSegment, int64_t position){
+    if(UNLIKELY(position > lastValidPos)) return -1;
+#if Bitmap_engine == 1
+    int64_t blockNo = position / JacobsonIndexSize;
+    u_short block = ~header[targetSegment].bitmap[blockNo] & (0xFFFF << (position % JacobsonIndexSize));
+    while(NonZeroEntries[block][0] == 0){
+        if(++blockNo == blocksInSegment) return -1;
+        block = ~header[targetSegment].bitmap[blockNo];
+    }
+    return blockNo * JacobsonIndexSize + NonZeroEntries[block][1];
+#else
+    int64_t words = (elementsInSegment + 63) / 64, word = position / 64;
+    uint64_t bits = ~bitmapWord(targetSegment, word) & (~0ULL << (position % 64));
+    while(bits == 0){
+        if(++word == words) return -1;
+        bits = ~bitmapWord(targetSegment, word);
+    }
+    int64_t vacant = word * 64 + __builtin_ctzll(bits);
+    return vacant > lastValidPos ? -1 : vacant;
+#endif
+}
+
+//Last vacant slot at or before position in the segment, -1 if there is none
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::prevVacant(int targetSegment, int64_t position){
+    if(UNLIKELY(position < 0)) return -1;
+#if Bitmap_engine == 1
+    int64_t blockNo = position / JacobsonIndexSize;
+    u_short block = ~header[targetSegment].bitmap[blockNo] & (0xFFFF >> (JacobsonIndexSize - 1 - position % JacobsonIndexSize));
+    while(NonZeroEntries[block][0] == 0){
+        if(--blockNo < 0) return -1;
+        block = ~header[targetSegment].bitmap[blockNo];
+    }
+    return blockNo * JacobsonIndexSize + NonZeroEntries[block][NonZeroEntries[block][0]];
+#else
+    int64_t word = position / 64;
+    uint64_t bits = ~bitmapWord(targetSegment, word) & (~0ULL >> (63 - position % 64));
+    while(bits == 0){
+        if(--word < 0) return -1;
+        bits = ~bitmapWord(targetSegment, word);
+    }
+    return word * 64 + 63 - __builtin_clzll(bits);
+#endif
+}
+
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::searchSegment(Key key){
     return tree->searchSegment(key);
 }
 
-int PMA::getSegment(){
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::getSegment(){
+    unique_lock<mutex> lock;
+    if(UNLIKELY(allocationLatch != NULL)) lock = unique_lock<mutex>(*allocationLatch);
     //Get a segment from the pool of free segment IDs in freeSegID vector. If the pool is empty, create a bunch of free segments
     if(UNLIKELY(freeSegmentCount < 1)){
-        type_t *new_key_chunk, *new_value_chunk;
+        Key *new_key_chunk;
+        value_t *new_value_chunk = NULL;
         if(Allocation_type == 1){
-            new_key_chunk = (type_t *) mmap(ADDR, CHUNK_SIZE, PROTECTION, FLAGS, -1, 0);
+            new_key_chunk = (Key *) mmap(ADDR, CHUNK_SIZE, PROTECTION, FLAGS, -1, 0);
             if(new_key_chunk == MAP_FAILED){ 
                 cout<<"Cannot allocate the virtual memory: " << CHUNK_SIZE << " bytes. mmap error: " << strerror(errno) << "(" << errno << ")"; 
                 exit(0);
             }
-            new_value_chunk = (type_t *) mmap(ADDR, CHUNK_SIZE, PROTECTION, FLAGS, -1, 0);    
+            if(!isSet) new_value_chunk = (value_t *) mmap(ADDR, valueChunkSize, PROTECTION, FLAGS, -1, 0);    
             if(new_value_chunk == MAP_FAILED){ 
-                cout<<"Cannot allocate the virtual memory: " << CHUNK_SIZE*16 << " bytes. mmap error: " << strerror(errno) << "(" << errno << ")"; 
+                cout<<"Cannot allocate the virtual memory: " << valueChunkSize << " bytes. mmap error: " << strerror(errno) << "(" << errno << ")"; 
                 exit(0);
             }
         }
         else{
-            new_key_chunk = (type_t *) malloc (CHUNK_SIZE);
-            new_value_chunk = (type_t *) malloc (CHUNK_SIZE);    
+            new_key_chunk = (Key *) malloc (CHUNK_SIZE);
+            if(!isSet) new_value_chunk = (value_t *) malloc (valueChunkSize);    
         }
         cleanSegments.push_back(new_key_chunk);
-        cleanSegments.push_back(new_value_chunk);
+        if(!isSet) cleanSegments.push_back(new_value_chunk);
 
-        freeSegmentCount = CHUNK_SIZE / SEGMENT_SIZE;
-        vector<u_short> musks (blocksInSegment, 0);
+        freeSegmentCount = CHUNK_SIZE / SegmentBytes;
         segCount += freeSegmentCount;
+        //A page more in each directory, and in the segment latches of a ConcurrentPMA before a segment of it is
+        //reachable. Headers, chunk pointers and latches already handed out stay where they are
+        header.resize(segCount + 1);
+        if(segmentLatches != NULL) segmentLatches->resize(segCount + 1);
+        if(writeBuffer) buffers.resize(segCount + 1);
         for(int i = 0; i < freeSegmentCount; i++){
             freeSegID.push_back(segCount-i);
             key_chunks.push_back(new_key_chunk + i * elementsInSegment);
-            value_chunks.push_back(new_value_chunk + i * elementsInSegment);
-            smallest.push_back(0);
-            lastElementPos.push_back(0);
-            cardinality.push_back(0);
-            bitmap.push_back(musks);
+            if(!isSet) value_chunks.push_back(new_value_chunk + i * elementsInSegment);
         }
     }
     freeSegmentCount--;
+    totalSegments++;
     int curSegNo = freeSegID.back();
     freeSegID.pop_back();
 
-    smallest[curSegNo] = 0; lastElementPos[curSegNo] = 0; cardinality[curSegNo] = 0;
-    for(int i=0; i<blocksInSegment; i++) bitmap[curSegNo][i] = 0;
-    memset(key_chunks[curSegNo], 0, sizeof(int64_t)*elementsInSegment);
+    header[curSegNo] = segment();
+    memset(key_chunks[curSegNo], 0, sizeof(Key)*elementsInSegment);
 
     return curSegNo;
 }
 
-bool PMA::insert(type_t key, type_t value){
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::insert(Key key, value_t value){
+    return insertOrAssign(key, value, false);
+}
+
+//Insert the pair, or set the value of a present key in place. Returns true if the key was inserted
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::upsert(Key key, value_t value){
+    return insertOrAssign(key, value, true);
+}
+
+/*
+    Insert shared by insert and upsert, with one descent and one search of the segment. A present key is left alone, or
+    takes the new value when assign is set. Returns true if the key was inserted
+ */
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::insertOrAssign(Key key, value_t value, bool assign){
+    leaf_t *leaf = tree->findLeaf(key);
+    int targetSegment = leaf->segNo[tree->findInLeaf(leaf, key)];
+    if(writeBuffer){
+        int inserted = bufferInsert(leaf, targetSegment, key, value, assign);
+        if(inserted >= 0) return inserted;
+        //redistributeInsert merges the neighbours it spreads over
+        settleBuffer(targetSegment);
+    }
+    if(!placeInSegment(leaf, targetSegment, key, value, assign)) return false;
+    if(header[targetSegment].cardinality > tree->maxLevel[0]) redistributeInsert(targetSegment, header[targetSegment].smallest);
+    return true;
+}
+
+/*
+    Insert into targetSegment of leaf, the segment key routes to, without rebalancing it. Only the segment and the tree
+    aggregates change. Returns true if the key was inserted
+ */
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::placeInSegment(leaf_t *leaf, int targetSegment, Key key, value_t value, bool assign){
     //Find the location using Binary Search.
-    int targetSegment = tree->searchSegment(key);
-    type_t position = findLocation1(key, targetSegment);
+    int64_t position = findLocation1(key, targetSegment);
+    //Keys below the smallest can arrive after deletes. A present key never is, so this is safe before the duplicate check
+    if(key < header[targetSegment].smallest || header[targetSegment].cardinality == 0) header[targetSegment].smallest = key;
 
     int blockNo = position/JacobsonIndexSize;
     int bitPosition = position % JacobsonIndexSize;
     u_short mask =  1 << bitPosition;
 
-    if((bitmap[targetSegment][blockNo] & mask) == 0){
+    if((header[targetSegment].bitmap[blockNo] & mask) == 0){
         insertInPosition(position, targetSegment, key, value);
-        if(cardinality[targetSegment] > tree->maxLevel[0]) redistributeInsert(targetSegment, smallest[targetSegment]);
+        account(leaf, targetSegment, key, value, 1);
         return true;
     }
 
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t foundKey = *(segmentOffset + position);
-    if(foundKey == key) return false;
+    Key * segmentOffset = key_chunks[targetSegment];
+    Key foundKey = *(segmentOffset + position);
+    if(foundKey == key){
+        if(assign) assignAt(leaf, targetSegment, position, value);
+        return false;
+    }
 
     //check if need traversing from backside
-    if(position >= lastElementPos[targetSegment]){
+    if(position >= header[targetSegment].lastElementPos){
         if(!insertAfterLast(position, key, value, targetSegment, foundKey)) return false;
-        if(cardinality[targetSegment] > tree->maxLevel[0]) redistributeInsert(targetSegment, smallest[targetSegment]);
+        account(leaf, targetSegment, key, value, 1);
         return true;
     }
 
 
-    //Insert among other inserted elements 
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    //type_t * segmentKeyOffset = key_chunks[targetSegment];
-    int pBase = blockNo * JacobsonIndexSize;
-    int insertPos = pBase;
-    while(true){
-        if(UNLIKELY(ar[0] == 0)){//Got a complete empty block. select the first cell. This can not be the starting block
-            insertPos = pBase;
-            break;
+    //Insert among other inserted elements. Shift toward the closest vacant slot after the position or before it
+    int64_t insertPos = nextVacant(targetSegment, position + 1);
+    if(UNLIKELY(insertPos < 0)) insertPos = lastValidPos + position; //Nothing vacant ahead. Only shifting backward is possible
+
+    if(LIKELY(!backSearchInsert(position, key, value, targetSegment, insertPos))){
+        cout<<"error in inserting"<<endl;
+        exit(0);
+    }
+    account(leaf, targetSegment, key, value, 1);
+    return true;
+}
+
+
+/*
+    Insert a batch of key-value pairs. The batch is sorted and every run of keys routed to the same segment is merged
+    with that segment in one pass. A segment overflowing with its run is spread once over the smallest window of its
+    leaf with room for it, or split into all the segments it needs when no window has room. Short runs that fit go through insert() instead.
+    Keys already present or repeated in the batch are skipped. Returns the number of inserted pairs.
+ */
+PMA_TEMPLATE
+size_t PMA<PMA_ARGS>::insert_batch(const Key *keys, const value_t *values, size_t n){
+    vector<pair<Key, value_t>> batch(n);
+    for(size_t i = 0; i<n; i++) batch[i] = {keys[i], isSet ? value_t() : values[i]};
+    stable_sort(batch.begin(), batch.end(), [](const pair<Key, value_t> &a, const pair<Key, value_t> &b){ return a.first < b.first; });
+
+    u_char slots[JacobsonIndexSize+1];
+    vector<Key> mergedKeys, windowKeys;
+    vector<value_t> mergedValues, windowValues;
+    size_t inserted = 0, i = 0;
+    while(i < n){
+        leaf_t *leaf = tree->findLeaf(batch[i].first);
+        int pos = tree->findInLeaf(leaf, batch[i].first);
+        int targetSegment = leaf->segNo[pos];
+        optional<Key> bound = tree->segmentBound(leaf, pos);
+        auto routed = [&](Key key){ return !bound || key < *bound; };
+        //Spreading over a window reads the neighbouring segments too
+        mergeLeaf(leaf);
+
+        //Routing found the segment by batch[i], so the run holds it at least. Should the bound disagree, insert() takes
+        //the key rather than leave the batch without progress
+        if(UNLIKELY(!routed(batch[i].first))){
+            inserted += insert(batch[i].first, batch[i].second);
+            i++;
+            continue;
         }
-        else if(ar[0] == JacobsonIndexSize){
-            blockNo++;
-            if(blockNo == blocksInSegment){
-                if(!backSearchInsert(position, key, value, targetSegment, lastValidPos+position)) return false;
-                if(cardinality[targetSegment] > tree->maxLevel[0]) redistributeInsert(targetSegment, smallest[targetSegment]); 
-                return true;
+
+        //A short run that fits is cheaper to insert key by key than to rewrite the whole segment
+        size_t runEnd = i;
+        while(runEnd < n && runEnd - i < (size_t)blocksInSegment && routed(batch[runEnd].first)) runEnd++;
+        if((runEnd == n || !routed(batch[runEnd].first)) && header[targetSegment].cardinality + (int64_t)(runEnd - i) <= tree->maxLevel[0]){
+            for( ; i < runEnd; i++) inserted += insert(batch[i].first, batch[i].second);
+            continue;
+        }
+
+        //Merge the elements of the segment with the run of the batch routed to it
+        mergedKeys.clear(); mergedValues.clear();
+        Key * segmentKeyOffset = key_chunks[targetSegment];
+        for(int64_t blockNo = 0, pBase = 0; blockNo < blocksInSegment; blockNo++, pBase += JacobsonIndexSize){
+            u_char * ar = blockSlots(header[targetSegment].bitmap[blockNo], slots);
+            for(int offset = 1; offset <= ar[0]; offset++){
+                Key key = *(segmentKeyOffset + pBase + ar[offset]);
+                for( ; i < n && batch[i].first < key; i++){
+                    if(!mergedKeys.empty() && mergedKeys.back() == batch[i].first) continue;
+                    mergedKeys.push_back(batch[i].first);
+                    if(!isSet) mergedValues.push_back(batch[i].second);
+                }
+                while(i < n && batch[i].first == key) i++;
+                mergedKeys.push_back(key);
+                if(!isSet) mergedValues.push_back(valueAt(targetSegment, pBase + ar[offset]));
             }
-            ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-            pBase += JacobsonIndexSize;
-            insertPos = pBase;
-        }else{
-            //Before first element of the block
-            if(ar[1] != 0 && position <= pBase){
-                insertPos = pBase;
+        }
+        for( ; i < n && routed(batch[i].first); i++){
+            if(!mergedKeys.empty() && mergedKeys.back() == batch[i].first) continue;
+            mergedKeys.push_back(batch[i].first);
+            if(!isSet) mergedValues.push_back(batch[i].second);
+        }
+        int64_t total = mergedKeys.size();
+        inserted += total - header[targetSegment].cardinality;
+
+#if Rebalance_type == 2
+        //An overflowing run goes to the smallest aligned window of the leaf with room for it, as insert() would
+        int windowStart = pos, windowEnd = pos;
+        for(int level = 1, window = 2; total > tree->maxLevel[0] && window < 2 * leaf->childCount && level <= tree->totalLevel; level++, window *= 2){
+            int first = pos / window * window, last = min(first + window, (int)leaf->childCount) - 1;
+            int64_t windowElements = total;
+            for(int segPos = first; segPos <= last; segPos++) if(segPos != pos) windowElements += header[leaf->segNo[segPos]].cardinality;
+            if(windowElements <= tree->maxLevel[level] * (last - first + 1) / window){
+                windowStart = first;
+                windowEnd = last;
                 break;
-            } 
-            //In between other inserted elements in the block
-            bool got = false;
-            for(int j = 2; j <= ar[0]; j++){
-                if(ar[j]-ar[j-1] > 1 && pBase+ar[j-1] >= position) {
-                    insertPos += ar[j-1] + 1;
-                    got = true;
-                    break;
-                }
             }
-            //after last element
-            if(UNLIKELY(!got)){
-                if(ar[ar[0]] == JacobsonIndexSize-1){
-                    blockNo++;
-                    if(blockNo == blocksInSegment){
-                        if(!backSearchInsert(position, key, value, targetSegment, lastValidPos+position)) return false;
-                        if(cardinality[targetSegment] > tree->maxLevel[0]) redistributeInsert(targetSegment, smallest[targetSegment]);
-                        return true;
-                    }
-                    ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-                    pBase += JacobsonIndexSize;
-                    insertPos = pBase;
-                }else{
-                    insertPos += ar[ar[0]] + 1;
-                    break;
-                }
-            }else break;
         }
-    }
+        if(windowEnd > windowStart){
+            windowKeys.clear(); windowValues.clear();
+            gatherSegments(leaf, windowStart, pos - 1, windowKeys, windowValues);
+            windowKeys.insert(windowKeys.end(), mergedKeys.begin(), mergedKeys.end());
+            windowValues.insert(windowValues.end(), mergedValues.begin(), mergedValues.end());
+            gatherSegments(leaf, pos + 1, windowEnd, windowKeys, windowValues);
+            memset(header[targetSegment].bitmap, 0, sizeof(header[targetSegment].bitmap));
+            spreadSegments(leaf, windowStart, windowEnd, windowKeys.data(), valuesFrom(windowValues.data(), 0), windowKeys.size());
+            redisWindowCount++;
+            tree->refreshLeaf(leaf, this);
+            continue;
+        }
+#endif
 
-    if(LIKELY(!backSearchInsert(position, key, value, targetSegment, insertPos))){
-        cout<<"error in inserting"<<endl;
-        exit(0);
+        //Lay the merged run out again. The segment keeps the first part, new segments take the rest
+        int pieces = 1;
+        if(total > tree->maxLevel[0]) pieces = (int)ceil(total / (TOU_H * elementsInSegment));
+        memset(header[targetSegment].bitmap, 0, sizeof(header[targetSegment].bitmap));
+        int64_t begin = 0, end = total / pieces;
+        fillSegment(targetSegment, mergedKeys.data(), valuesFrom(mergedValues.data(), 0), end);
+        for(int piece = 1; piece < pieces; piece++){
+            begin = end;
+            end = total * (piece + 1) / pieces;
+            int curSegment = getSegment();
+            fillSegment(curSegment, mergedKeys.data() + begin, valuesFrom(mergedValues.data(), begin), end - begin);
+            tree->insertInTree(curSegment, header[curSegment].smallest, this);
+        }
+        if(pieces > 1) redisInsCount++;
+        tree->refreshLeaf(tree->findLeaf(header[targetSegment].smallest), this);
     }
-    if(cardinality[targetSegment] > tree->maxLevel[0]) {
-        redistributeInsert(targetSegment, smallest[targetSegment]);
+    return inserted;
+}
+
+/*
+    Load n pairs sorted by strictly increasing key into an empty PMA. Segments are filled directly to the target density
+    (fraction of slots used, capped by the insert threshold) and the B+ tree is built bottom-up over them in one pass.
+    A PMA already holding elements, and keys out of order or repeated, take the pairs through insert_batch, which sorts
+    them and skips repeated keys. Returns the number of loaded pairs.
+ */
+PMA_TEMPLATE
+size_t PMA<PMA_ARGS>::bulk_load(const Key *keys, const value_t *values, size_t n, double density){
+    mergeBuffers();
+    leaf_t *first = tree->leftmostLeaf(tree->root);
+    if(totalSegments > 1 || header[first->segNo[0]].cardinality > 0) return insert_batch(keys, values, n);
+    if(n == 0) return 0;
+    //fillSegment lays keys out by their gaps, a repeated key would land on the slot of the one before it
+    for(size_t i = 1; i<n; i++) if(UNLIKELY(keys[i] <= keys[i-1])) return insert_batch(keys, values, n);
+
+    int64_t perSegment = max((int64_t)1, min((int64_t)(density * elementsInSegment), (int64_t)tree->maxLevel[0]));
+    size_t segmentCount = (n + perSegment - 1) / perSegment;
+    vector<int> segments(segmentCount);
+    segments[0] = first->segNo[0];
+    for(size_t s = 1; s<segmentCount; s++) segments[s] = getSegment();
+
+    for(size_t s = 0; s<segmentCount; s++){
+        size_t begin = n * s / segmentCount, end = n * (s + 1) / segmentCount;
+        fillSegment(segments[s], keys + begin, valuesFrom(values, begin), end - begin);
     }
-    return true;
+    totalSegments = segmentCount;
+    tree->buildFromSegments(segments, this);
+    return n;
 }
 
+//Lay out count sorted pairs in an empty segment, leaving up to MaxGap slots between neighbouring keys
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::fillSegment(int targetSegment, const Key *keys, const value_t *values, int64_t count){
+    Key * destKeyOffset = key_chunks[targetSegment];
+    segment &seg = header[targetSegment];
+    int64_t j = 0, sum_key = 0, sum_value = 0;
+    for(int64_t i = 0; i < count; i++){
+        if(LIKELY(i > 0)) j += min((elementsInSegment - j) - (count - i), keyGap(keys[i-1], keys[i]));
+        *(destKeyOffset + j) = keys[i];
+        sum_key += keys[i];
+        if constexpr(!isSet){
+            setValue(targetSegment, j, values[i]);
+            sum_value += values[i];
+        }
+        seg.bitmap[j / JacobsonIndexSize] |= 1 << (j % JacobsonIndexSize);
+    }
+    seg.keySum = sum_key;
+    seg.valueSum = sum_value;
+    seg.smallest = count > 0 ? keys[0] : 0;
+    seg.lastElementPos = j;
+    seg.cardinality = count;
+    if(UNLIKELY(writeBuffer)) resetFilter(targetSegment, keys, count);
+}
 
-bool PMA::insertForward(type_t position, type_t key, type_t value, int targetSegment, int insertPos){
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::insertForward(int64_t position, Key key, value_t value, int targetSegment, int insertPos){
 
-    type_t * movePosKey = key_chunks[targetSegment] + insertPos;
-    type_t * movePosVal = value_chunks[targetSegment] + insertPos;
+    Key * movePosKey = key_chunks[targetSegment] + insertPos;
 
-    insertInPosition(insertPos, targetSegment, *(movePosKey-1), *(movePosVal-1));
-    movePosKey--; movePosVal--;    
+    insertInPosition(insertPos, targetSegment, *(movePosKey-1), valueAt(targetSegment, insertPos-1));
+    movePosKey--;
     insertPos--;
-    while(insertPos >= position && key < *(movePosKey-1)){
+    while(insertPos > 0 && insertPos >= position && key < *(movePosKey-1)){
     //while(insertPos >= position){
         *movePosKey = *(movePosKey-1);
-        *movePosVal = *(movePosVal-1);
-        movePosKey--; movePosVal--; insertPos--;
+        setValue(targetSegment, insertPos, valueAt(targetSegment, insertPos-1));
+        movePosKey--; insertPos--;
     }
     *movePosKey = key;
-    *movePosVal = value;
+    setValue(targetSegment, insertPos, value);
     return true;
 }
 
-bool PMA::insertBackward(type_t position, type_t key, type_t value, int targetSegment, int insertPos){
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::insertBackward(int64_t position, Key key, value_t value, int targetSegment, int insertPos){
     
-    type_t * movePosKey = key_chunks[targetSegment] + insertPos;
-    type_t * movePosVal = value_chunks[targetSegment] + insertPos;
-    insertInPosition(insertPos, targetSegment, *(movePosKey+1), *(movePosVal+1));
-    movePosKey++; movePosVal++;    
+    Key * movePosKey = key_chunks[targetSegment] + insertPos;
+    insertInPosition(insertPos, targetSegment, *(movePosKey+1), valueAt(targetSegment, insertPos+1));
+    movePosKey++;
     insertPos++;
     while(insertPos < position && key > *(movePosKey+1)){
     //while(insertPos < position){
         *movePosKey = *(movePosKey+1);
-        *movePosVal = *(movePosVal+1);
-        movePosKey++; movePosVal++; insertPos++;
+        setValue(targetSegment, insertPos, valueAt(targetSegment, insertPos+1));
+        movePosKey++; insertPos++;
     }
     *movePosKey = key;
-    *movePosVal = value;
+    setValue(targetSegment, insertPos, value);
     return true;
 }
 
-bool PMA::insertAfterLast(type_t position, type_t key, type_t value, int targetSegment, type_t foundKey) {
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::insertAfterLast(int64_t position, Key key, value_t value, int targetSegment, Key foundKey) {
 
     if(UNLIKELY(position >= lastValidPos)){ //Got out of the current segment. Traverse backward for vacant space
-        for(type_t i = lastValidPos-1; i>=0; i--){
-            int blockNo = i/JacobsonIndexSize;
-            int bitPosition = i % JacobsonIndexSize;
-            u_short mask =  1 << bitPosition;
-
-            if((bitmap[targetSegment][blockNo] & mask) == 0) {
-                return insertBackward(position, key, value, targetSegment, i);
-            }
-        }
+        int64_t vacant = prevVacant(targetSegment, lastValidPos-1);
+        if(vacant >= 0) return insertBackward(position, key, value, targetSegment, vacant);
         cout<<"Program should never reach hear at InsertAfterLast"<<endl;
         printSegElements(targetSegment);
         exit(0);
     }
     else{ //Have some space left in the segment. Go forward in the space max 3 slots
-        type_t adjust = min(abs(*(key_chunks[targetSegment]+lastElementPos[targetSegment])-key), min(lastValidPos - lastElementPos[targetSegment], (type_t) MaxGap));
-        //adjust = min(adjust, abs(*(key_chunks[targetSegment]+lastElementPos[targetSegment])-key));
+        Key lastKey = *(key_chunks[targetSegment]+header[targetSegment].lastElementPos);
+        int64_t adjust = min(keyGap(min(lastKey, key), max(lastKey, key)), lastValidPos - header[targetSegment].lastElementPos);
+        //adjust = min(adjust, abs((int64_t)*(key_chunks[targetSegment]+header[targetSegment].lastElementPos)-(int64_t)key));
         if(key > foundKey){
             insertInPosition(position+adjust, targetSegment, key, value);
             return true;
@@ -284,993 +839,1667 @@ bool PMA::insertAfterLast(type_t position, type_t key, type_t value, int targetS
     }
 }
 
-bool PMA::backSearchInsert(type_t position, type_t key, type_t value, int targetSegment, int forwardInsertPos) {
-    type_t blockNo = position/JacobsonIndexSize; 
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    type_t insertPos = blockNo * JacobsonIndexSize;
-    
-    while(true){
-        if(ar[0] == 0){//Got a complete empty block. select the last cell
-            insertPos += JacobsonIndexSize - 1;
-            break;
-        }
-        else if(ar[0] == JacobsonIndexSize){ //Fully loaded block
-            blockNo--;
-            if(blockNo < 0){
-                return insertForward(position, key, value, targetSegment, forwardInsertPos);
-            }
-            ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-            insertPos -= JacobsonIndexSize;
-        }else{
-            int elements = ar[0];
-            bool got = false;
-            if(ar[elements] < (JacobsonIndexSize - 1) && insertPos + ar[elements] < position){
-                insertPos += JacobsonIndexSize - 1;
-                got = true;
-            }else{
-                for(int j = elements; j > 1; j--){
-                    if(ar[j]-ar[j-1] > 1 && insertPos + ar[j] <= position) {
-                        insertPos += ar[j] - 1;
-                        got = true;
-                        break;
-                    }
-                }
-            }
-            if(!got){
-                if(ar[1] == 0){
-                    blockNo--;
-                    if(blockNo < 0){
-                        return insertForward(position, key, value, targetSegment, forwardInsertPos);
-                    }
-                    
-                    ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-                    insertPos -= JacobsonIndexSize;
-                }else{
-                    insertPos += ar[1] - 1;
-                    break;
-                }
-            }else break;
-        }
-    }
-    if(abs(insertPos-position)>abs(forwardInsertPos-position)){
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::backSearchInsert(int64_t position, Key key, value_t value, int targetSegment, int forwardInsertPos) {
+    int64_t insertPos = prevVacant(targetSegment, position - 1);
+    if(insertPos < 0 || abs(insertPos-position)>abs(forwardInsertPos-position)){
         return insertForward(position, key, value, targetSegment, forwardInsertPos);
     }else return insertBackward(position, key, value, targetSegment, insertPos);
 }
 
-void PMA::swapElements(type_t targetSegment, type_t position, type_t adjust){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t holdKey = *(segmentOffset + position);
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::swapElements(int64_t targetSegment, int64_t position, int64_t adjust){
+    Key * segmentOffset = key_chunks[targetSegment];
+    Key holdKey = *(segmentOffset + position);
     *(segmentOffset + position) = *(segmentOffset + position + adjust);
     *(segmentOffset + position + adjust) = holdKey;
 
-    segmentOffset = value_chunks[targetSegment];
-    type_t holdValue = *(segmentOffset + position);
-    *(segmentOffset + position) = *(segmentOffset + position + adjust);
-    *(segmentOffset + position + adjust) = holdValue;
+    value_t holdValue = valueAt(targetSegment, position);
+    setValue(targetSegment, position, valueAt(targetSegment, position + adjust));
+    setValue(targetSegment, position + adjust, holdValue);
 }
 
-void PMA::insertInPosition(type_t position, int targetSegment, type_t key, type_t value){
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::insertInPosition(int64_t position, int targetSegment, Key key, value_t value){
     //Store key, value and update bitmap, cardinality and last index
-    type_t * segmentOffset = key_chunks[targetSegment];
+    Key * segmentOffset = key_chunks[targetSegment];
     *(segmentOffset + position) = key;
-    segmentOffset = value_chunks[targetSegment];
-    *(segmentOffset + position) = value;
+    setValue(targetSegment, position, value);
     int blockPosition = position/JacobsonIndexSize;
     int bitPosition = position % JacobsonIndexSize;
     u_short mask =  1 << bitPosition;
-    bitmap[targetSegment][blockPosition] |= mask;
-    cardinality[targetSegment]++;
-    if(lastElementPos[targetSegment] < position) {
-        lastElementPos[targetSegment] = position;
+    header[targetSegment].bitmap[blockPosition] |= mask;
+    header[targetSegment].cardinality++;
+    if(header[targetSegment].lastElementPos < position) {
+        header[targetSegment].lastElementPos = position;
     }
 
 }
 
-bool PMA::remove(type_t key){
-    int targetSegment = tree->searchSegment(key);
-    type_t position = findLocation1(key, targetSegment);
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::remove(Key key){
+    leaf_t *leaf = tree->findLeaf(key);
+    int targetSegment = leaf->segNo[tree->findInLeaf(leaf, key)];
+    if(writeBuffer){
+        //A pending insert is just taken back. A key in the slots leaves them at once, clearing its bit is no dearer
+        //than holding the remove back, unless the segment has to be rebalanced with its neighbours
+        int message = pendingMessage(targetSegment, key);
+        if(message >= 0){
+            value_t value = buffers[targetSegment].values[message];
+            dropMessage(targetSegment, message);
+            tree->propagate(leaf, key, summand(value), -1, this);
+            return true;
+        }
+        if(header[targetSegment].cardinality <= tree->minLevel[0]) mergeLeaf(leaf);
+    }
+    if(!takeFromSegment(leaf, targetSegment, key)) return false;
+    if(header[targetSegment].cardinality < tree->minLevel[0]){
+        redistributeRemove(leaf, targetSegment);
+    }
+    return true;
+}
+
+//Remove key from targetSegment of leaf without rebalancing it, the counterpart of placeInSegment
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::takeFromSegment(leaf_t *leaf, int targetSegment, Key key){
+    int64_t position = findLocation1(key, targetSegment);
     int blockPosition = position/JacobsonIndexSize;
     int bitPosition = position % JacobsonIndexSize;
     u_short mask =  1 << bitPosition;
-    if(!(bitmap[targetSegment][blockPosition] & mask)) return false;
+    if(!(header[targetSegment].bitmap[blockPosition] & mask)) return false;
 
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t foundKey = *(segmentOffset + position);
+    Key * segmentOffset = key_chunks[targetSegment];
+    Key foundKey = *(segmentOffset + position);
     if(foundKey != key) return false;
     
-    bitmap[targetSegment][blockPosition] &= (~mask);
-    cardinality[targetSegment]--;
+    header[targetSegment].bitmap[blockPosition] &= (~mask);
+    header[targetSegment].cardinality--;
     //Check if the smallest of the current segment is deleted
-    if(key == smallest[targetSegment]){
-        u_char * ar = NonZeroEntries[bitmap[targetSegment][0]];
-        int blockNo = 0;
-        while(ar[0] == 0 && blockNo < blocksInSegment) ar =NonZeroEntries[bitmap[targetSegment][++blockNo]];
-        smallest[targetSegment] = *(key_chunks[targetSegment]+blockNo*JacobsonIndexSize+ar[1]);
+    if(key == header[targetSegment].smallest){
+        int64_t first = nextOccupied(targetSegment, 0);
+        if(first >= 0) header[targetSegment].smallest = *(key_chunks[targetSegment]+first);
     }
     //Check if the last element is deleted
-    else if(lastElementPos[targetSegment] == position){
-        u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-        while(ar[0] == 0 && blockPosition >= 0) ar = NonZeroEntries[bitmap[targetSegment][--blockPosition]];
-        lastElementPos[targetSegment] = blockPosition * JacobsonIndexSize + ar[ar[0]];
-    }
-    if(cardinality[targetSegment] < tree->minLevel[0]){
-        redistributeRemove(targetSegment);
+    if(header[targetSegment].lastElementPos == position){
+        header[targetSegment].lastElementPos = max(prevOccupied(targetSegment, position), (int64_t)0);
     }
+    account(leaf, targetSegment, key, valueAt(targetSegment, position), -1);
     return true;
 }
 
-void PMA::redistributeRemove(int targetSegment){
-    redisUpCount++;
-    BPlusTree::leaf *p = tree->findLeaf(smallest[targetSegment]);
-    if(UNLIKELY(p->childCount == 1)) return;
+/*
+    Remove the pairs with a key in [startKey, endKey] at once. Segments wholly in the range go back to the pool, the
+    ones it cuts through are laid out again with the pairs outside it, and the B+ tree is rebuilt over the remaining
+    segments in one pass. The other pairs stay where they are. Returns the number of removed pairs
+ */
+PMA_TEMPLATE
+size_t PMA<PMA_ARGS>::range_remove(Key startKey, Key endKey){
+    if(UNLIKELY(startKey > endKey)) return 0;
+    mergeBuffers();
+    vector<int> kept;
+    vector<Key> keys;
+    vector<value_t> values;
+    size_t removed = 0;
+    for(leaf_t *leaf = tree->leftmostLeaf(tree->root); leaf != NULL; leaf = leaf->nextLeaf){
+        for(int segPos = 0; segPos < leaf->childCount; segPos++){
+            int targetSegment = leaf->segNo[segPos];
+            const segment &seg = header[targetSegment];
+            if(seg.cardinality == 0 || seg.smallest > endKey || *(key_chunks[targetSegment] + seg.lastElementPos) < startKey){
+                kept.push_back(targetSegment);
+                continue;
+            }
+            keys.clear(); values.clear();
+            gatherSegments(leaf, segPos, segPos, keys, values);
+            size_t first = std::lower_bound(keys.begin(), keys.end(), startKey) - keys.begin();
+            size_t last = std::upper_bound(keys.begin(), keys.end(), endKey) - keys.begin();
+            keys.erase(keys.begin() + first, keys.begin() + last);
+            if(!isSet) values.erase(values.begin() + first, values.begin() + last);
+            removed += last - first;
+            if(keys.empty()){
+                deleteSegment(targetSegment);
+                continue;
+            }
+            fillSegment(targetSegment, keys.data(), valuesFrom(values.data(), 0), keys.size());
+            kept.push_back(targetSegment);
+        }
+    }
+    if(removed == 0) return 0;
+    if(kept.empty()) kept.push_back(getSegment());
+    tree->buildFromSegments(kept, this);
+    return removed;
+}
 
-    int loc = 0, start, end;
-    for(; loc<p->childCount; loc++){
-        if(p->segNo[loc] == targetSegment) break;
+/*
+    Rebalance a segment of leaf p that fell below minLevel. It is paired with its sparser neighbour in the leaf: a pair
+    that fits in one segment at the TOU_H density is merged, and the merged segment keeps absorbing neighbours while
+    still sparse. A pair too dense to merge is spread evenly over both segments. A segment alone in its leaf has no
+    neighbour there, so the leaf first merges with or borrows from its previous sibling, or the next one for the first
+    leaf of a node. A leaf left with fewer than Degree/2 segments is rebalanced with a neighbour the same way. Both leaf
+    steps are skipped when rebalanceLeaf is off for a caller not holding the parent of the leaf
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::redistributeRemove(leaf_t *p, int targetSegment, bool rebalanceLeaf){
+    __atomic_fetch_add(&redisUpCount, 1, __ATOMIC_RELAXED);
+    bool leafRebalanced = false;
+    if(p->childCount == 1 && rebalanceLeaf){
+        p = tree->rebalanceOnDelete(p, header[targetSegment].smallest, this);
+        leafRebalanced = true;
     }
-    if(loc > 0 && cardinality[targetSegment]+cardinality[p->segNo[loc-1]] < tree->maxLevel[1]){
-        int totalElements = cardinality[targetSegment] + cardinality[p->segNo[loc-1]];
-        p->segNo[loc-1] = mergeTwoSegments(p->segNo[loc-1], targetSegment, totalElements);
-        for(int i =loc+1; i < p->childCount; i++){
-            p->key[i-2] = p->key[i-1];
-            p->segNo[i-1] = p->segNo[i];
+    int loc = 0;
+    while(p->segNo[loc] != targetSegment) loc++;
+
+    while(p->childCount > 1){
+        int start = loc, end = loc;
+        if(loc == 0) end = 1;
+        else if(loc == p->childCount-1) start = loc-1;
+        else if(header[p->segNo[loc-1]].cardinality <= header[p->segNo[loc+1]].cardinality) start = loc-1;
+        else end = loc+1;
+        int64_t totalElements = header[p->segNo[start]].cardinality + header[p->segNo[end]].cardinality;
+        if(totalElements > TOU_H * elementsInSegment){
+            redistributeNToM(p, start, end, totalElements);
+            return;
         }
-        p->childCount--;
-        if(p->childCount < Tree_Degree/2) tree->rebalanceOnDelete(p, smallest[p->segNo[0]]);
-        return;
+        mergeMultipleSegments(p, start, end, totalElements);
+        loc = start;
+        if(header[p->segNo[loc]].cardinality >= tree->minLevel[0]) break;
     }
-    if(loc<p->childCount-1 && cardinality[targetSegment]+cardinality[p->segNo[loc+1]] < tree->maxLevel[1]){
-        int totalElements = cardinality[targetSegment] + cardinality[p->segNo[loc+1]];
-        p->segNo[loc] = mergeTwoSegments(targetSegment, p->segNo[loc+1], totalElements);
-        for(int i =loc+2; i < p->childCount; i++){
-            p->key[i-2] = p->key[i-1];
-            p->segNo[i-1] = p->segNo[i];
+    if(rebalanceLeaf && !leafRebalanced && p->childCount < Degree/2) tree->rebalanceOnDelete(p, header[p->segNo[0]].smallest, this);
+}
+
+//Move the elements of segments start to end of leaf p to the buffers in key order, leaving the segments empty
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::gatherSegments(leaf_t *p, int start, int end, vector<Key> &keys, vector<value_t> &values){
+    u_char slots[JacobsonIndexSize+1];
+    for(int segPos = start; segPos<=end; segPos++){
+        int movSegment = p->segNo[segPos];
+        Key * moveKeyOffset = key_chunks[movSegment];
+        for(int blockNo = 0, pBase = 0; blockNo < blocksInSegment; blockNo++, pBase += JacobsonIndexSize){
+            u_char * ar = blockSlots(header[movSegment].bitmap[blockNo], slots);
+            for(int i=1; i<=ar[0]; i++){
+                keys.push_back(*(moveKeyOffset + ar[i]));
+                if constexpr(!isSet) values.push_back(valueAt(movSegment, pBase + ar[i]));
+            }
+            header[movSegment].bitmap[blockNo] = 0;
+            moveKeyOffset += JacobsonIndexSize;
         }
-        p->childCount--;
-        if(p->childCount < Tree_Degree/2) tree->rebalanceOnDelete(p, smallest[p->segNo[0]]);
-        return;
     }
-    start = loc == 0 ? loc : loc-1;
-    end = loc == start ? loc+1: loc;
-    int totalElements = cardinality[p->segNo[start]] + cardinality[p->segNo[end]];
-    redistributeTwotoTwo(p, start, end, totalElements);
-    cout<<"Called two to two"<<endl;
+}
 
 /*
-    if(totalElements < tree->minLevel[1]){
-        int startLeft, endRight, curLevel = 1;
-        while(true){
-            int elementCount = totalElements, startCur = start, endCur = end;
-            startLeft = pow(2, curLevel-1), endRight = pow(2, curLevel-1) ;
-            if(startCur - startLeft < 0 ){ 
-                endRight += (startLeft - startCur); 
-                startLeft = startCur; 
-            }
-            if(endCur + endRight >= p->childCount) {
-                startLeft += (endRight-(p->childCount - (endCur + 1)));
-                endRight = p->childCount - (endCur + 1);
+    Merge segments startLoc to endLoc of leaf p into as few segments as hold their elements at the TOU_H density.
+    The leading segments of the range are reused and the others are recycled through deleteSegment
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::mergeMultipleSegments(leaf_t *p, int startLoc, int endLoc, int64_t totalElements){
+    vector<Key> keys;
+    vector<value_t> values;
+    keys.reserve(totalElements);
+    if(!isSet) values.reserve(totalElements);
+    Key smallest = header[p->segNo[startLoc]].smallest;
+    gatherSegments(p, startLoc, endLoc, keys, values);
+
+    tree_t::lockVersion(p->version);
+    int segments = max(1, (int)ceil(totalElements / (TOU_H * elementsInSegment)));
+    for(int i = 0; i<segments; i++){
+        int64_t begin = totalElements * i / segments;
+        int64_t count = totalElements * (i + 1) / segments - begin;
+        fillSegment(p->segNo[startLoc+i], keys.data() + begin, valuesFrom(values.data(), begin), count);
+        if(i > 0) p->key[startLoc+i-1] = header[p->segNo[startLoc+i]].smallest;
+    }
+    //An empty merge keeps the old smallest key, which still routes to the segment
+    if(UNLIKELY(totalElements == 0)) header[p->segNo[startLoc]].smallest = smallest;
+
+    int removed = endLoc - startLoc + 1 - segments;
+    for(int i = startLoc+segments; i<=endLoc; i++) deleteSegment(p->segNo[i]);
+    for(int i = endLoc+1; i < p->childCount; i++){
+        p->segNo[i-removed] = p->segNo[i];
+        p->key[i-removed-1] = p->key[i-1];
+    }
+    p->childCount -= removed;
+    if(p->childCount == 1) p->key[0] = numeric_limits<Key>::max();
+    tree_t::unlockVersion(p->version);
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::deleteSegment(int targetSegment){
+    unique_lock<mutex> lock;
+    if(UNLIKELY(allocationLatch != NULL)) lock = unique_lock<mutex>(*allocationLatch);
+    freeSegmentCount++;
+    freeSegID.push_back(targetSegment);
+
+    memset(header[targetSegment].bitmap, 0, sizeof(header[targetSegment].bitmap));
+    totalSegments--;
+}
+
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::lookup(Key key){
+    leaf_t *leaf;
+    int targetSegment;
+    int64_t position = locate(key, leaf, targetSegment);
+    if(writeBuffer){
+        int message = pendingMessage(targetSegment, key);
+        if(message >= 0) return true;
+    }
+    return position >= 0;
+}
+
+//Slot of key in targetSegment, -1 if it is absent
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::findKey(Key key, int targetSegment){
+    int64_t position = findLocation(key, targetSegment);
+    if(!(header[targetSegment].bitmap[position / JacobsonIndexSize] & (1 << position % JacobsonIndexSize))) return -1;
+    return *(key_chunks[targetSegment] + position) == key ? position : -1;
+}
+
+//Value of key, nullopt if it is absent
+PMA_TEMPLATE
+optional<typename PMA<PMA_ARGS>::value_t> PMA<PMA_ARGS>::get(Key key){
+    leaf_t *leaf;
+    int targetSegment;
+    int64_t position = locate(key, leaf, targetSegment);
+    if(writeBuffer){
+        int message = pendingMessage(targetSegment, key);
+        if(message >= 0) return buffers[targetSegment].values[message];
+    }
+    if(position < 0) return nullopt;
+    return valueAt(targetSegment, position);
+}
+
+//Set the value of a present key in place. Returns false if the key is absent
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::update(Key key, value_t value){
+    leaf_t *leaf;
+    int targetSegment;
+    int64_t position = locate(key, leaf, targetSegment);
+    if(writeBuffer){
+        int message = pendingMessage(targetSegment, key);
+        if(message >= 0){
+            WriteBuffer &buffer = buffers[targetSegment];
+            int64_t delta = summand(value) - summand(buffer.values[message]);
+            buffer.values[message] = value;
+            if(delta != 0) tree->propagateValue(leaf, delta);
+            return true;
+        }
+    }
+    if(position < 0) return false;
+    assignAt(leaf, targetSegment, position, value);
+    return true;
+}
+
+//Slot of key, -1 if it is absent. leaf and targetSegment are set to where the key belongs
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::locate(Key key, leaf_t *&leaf, int &targetSegment){
+    leaf = tree->findLeaf(key);
+    targetSegment = leaf->segNo[tree->findInLeaf(leaf, key)];
+    return findKey(key, targetSegment);
+}
+
+//Overwrite the value at an occupied slot, moving the value sums of the segment and the tree by the difference
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::assignAt(leaf_t *leaf, int targetSegment, int64_t position, value_t value){
+    int64_t delta = summand(value) - summand(valueAt(targetSegment, position));
+    setValue(targetSegment, position, value);
+    if(delta == 0) return;
+    header[targetSegment].valueSum += delta;
+    tree->propagateValue(leaf, delta);
+}
+
+/*
+    Insert or assign through the write buffer of targetSegment. A full buffer is merged first. Returns 1 if the key was
+    inserted, 0 if it was present, and -1 if the insert would overflow the segment and has to take the usual path
+ */
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::bufferInsert(leaf_t *leaf, int targetSegment, Key key, value_t value, bool assign){
+    WriteBuffer &buffer = buffers[targetSegment];
+    int i = messagePosition(targetSegment, key);
+    if(i < header[targetSegment].buffered && buffer.keys[i] == key){
+        if(assign){
+            int64_t delta = summand(value) - summand(buffer.values[i]);
+            buffer.values[i] = value;
+            if(delta != 0) tree->propagateValue(leaf, delta);
+        }
+        return 0;
+    }
+    //Most new keys miss the filter and leave the slots of the segment untouched
+    int64_t position = mayHold(targetSegment, key) ? findKey(key, targetSegment) : -1;
+    if(position >= 0){
+        if(assign) assignAt(leaf, targetSegment, position, value);
+        return 0;
+    }
+    if(header[targetSegment].buffered == Write_buffer){
+        mergeBuffer(targetSegment);
+        i = 0;
+    }
+    if(header[targetSegment].cardinality + header[targetSegment].buffered + 1 > tree->maxLevel[0]) return -1;
+    addMessage(targetSegment, i, key, value);
+    addToFilter(targetSegment, key);
+    tree->propagate(leaf, key, summand(value), 1, this);
+    return 1;
+}
+
+//Position of the first message of a buffer with a key not less than key
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::messagePosition(int targetSegment, Key key){
+    const WriteBuffer &buffer = buffers[targetSegment];
+    int i = 0, count = header[targetSegment].buffered;
+    while(i < count && buffer.keys[i] < key) i++;
+    return i;
+}
+
+//Message of key in the write buffer of targetSegment, -1 if there is none
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::pendingMessage(int targetSegment, Key key){
+    if(LIKELY(header[targetSegment].buffered == 0)) return -1;
+    int i = messagePosition(targetSegment, key);
+    return i < header[targetSegment].buffered && buffers[targetSegment].keys[i] == key ? i : -1;
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::addMessage(int targetSegment, int i, Key key, value_t value){
+    WriteBuffer &buffer = buffers[targetSegment];
+    for(int j = header[targetSegment].buffered; j > i; j--){
+        buffer.keys[j] = buffer.keys[j-1];
+        buffer.values[j] = buffer.values[j-1];
+    }
+    buffer.keys[i] = key;
+    buffer.values[i] = value;
+    header[targetSegment].buffered++;
+    if(!buffer.listed){
+        buffer.listed = true;
+        dirtySegments.push_back(targetSegment);
+    }
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::dropMessage(int targetSegment, int i){
+    WriteBuffer &buffer = buffers[targetSegment];
+    int count = --header[targetSegment].buffered;
+    for(int j = i; j < count; j++){
+        buffer.keys[j] = buffer.keys[j+1];
+        buffer.values[j] = buffer.values[j+1];
+    }
+}
+
+//Merge the write buffer of a segment if it holds inserts, before the slots or the header of the segment are read
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::settleBuffer(int targetSegment){
+    if(UNLIKELY(writeBuffer) && header[targetSegment].buffered > 0) mergeBuffer(targetSegment);
+}
+
+/*
+    Apply the pending inserts of a segment in one pass over its slots, into the gaps it already has. An inserted pair
+    takes the first vacant slot after the pairs below it, and the pairs it passes on the way move one slot right, so the
+    rest of the segment keeps its layout. Pairs beyond the last occupied slot are spaced by their key gaps as
+    fillSegment would. Only when they do not fit there is the segment laid out again. The tree aggregates already count
+    the inserts, only the slots and the header change
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::mergeBuffer(int targetSegment){
+    WriteBuffer &buffer = buffers[targetSegment];
+    segment &seg = header[targetSegment];
+    Key *slots = key_chunks[targetSegment];
+    //Pairs moved out of their slot and not placed yet, a queue in key order
+    Key carriedKeys[Write_buffer];
+    value_t carriedValues[Write_buffer];
+    int head = 0, carried = 0;
+    int insert = 0, pending = seg.buffered;
+    //The smallest pair waiting for a slot, from the queue or the buffer
+    auto fromQueue = [&](){ return carried > 0 && (insert == seg.buffered || carriedKeys[head] < buffer.keys[insert]); };
+    auto take = [&](Key &key, value_t &value){
+        if(fromQueue()){
+            key = carriedKeys[head];
+            value = carriedValues[head];
+            head = (head + 1) % Write_buffer;
+            carried--;
+        }else{
+            key = buffer.keys[insert];
+            value = buffer.values[insert];
+            insert++;
+            seg.cardinality++;
+            seg.keySum += key;
+            seg.valueSum += summand(value);
+        }
+        pending--;
+    };
+
+    //Last occupied slot before the current one and first occupied slot after it. The pairs below the first insert
+    //keep their slots, so the pass starts right after them
+    int64_t previous = lastAtMost(targetSegment, buffer.keys[0]), ahead = -1;
+    for(int64_t position = previous + 1; position <= lastValidPos && pending > 0; position++){
+        int blockNo = position / JacobsonIndexSize;
+        u_short mask = 1 << position % JacobsonIndexSize;
+        bool occupied = seg.bitmap[blockNo] & mask;
+        Key key = fromQueue() ? carriedKeys[head] : buffer.keys[insert];
+        if(occupied){
+            if(key < slots[position]){
+                //The pair here moves on and the waiting one takes its slot
+                Key movedKey = slots[position];
+                value_t movedValue = valueAt(targetSegment, position);
+                value_t value;
+                take(key, value);
+                int tail = (head + carried) % Write_buffer;
+                carriedKeys[tail] = movedKey;
+                carriedValues[tail] = movedValue;
+                carried++;
+                pending++;
+                slots[position] = key;
+                setValue(targetSegment, position, value);
             }
-            for(startCur--, startLeft--; startCur >= 0 && startLeft >= 0; startCur--, startLeft--){
-                elementCount += cardinality[startCur];
+        }else{
+            if(ahead <= position) ahead = nextOccupied(targetSegment, position + 1);
+            bool place = ahead >= 0 ? key < slots[ahead] : true;
+            if(ahead < 0 && previous >= 0){
+                //Past the last pair. Leave the gaps fillSegment would, as long as the rest still fits
+                if(UNLIKELY(lastValidPos - previous < pending)) break;
+                place = position >= previous + min(keyGap(slots[previous], key), lastValidPos - previous - pending + 1);
             }
-            startCur = max(startCur,0);
-            for(endCur++, endRight--; endCur < p->childCount && endRight >= 0; endCur++, endRight-- ){
-                elementCount += cardinality[endCur];
+            if(place){
+                value_t value;
+                take(key, value);
+                slots[position] = key;
+                setValue(targetSegment, position, value);
+                seg.bitmap[blockNo] |= mask;
+                occupied = true;
             }
-            if(elementCount >= tree->minLevel[curLevel] || startLeft !=0 || endRight != 0) break;
-            curLevel++; start = startCur; end = endCur; totalElements = elementCount;
         }
-        //redistribute the keys from stat to end
-        if(startLeft !=0 || endRight != 0) mergeMultipleSegments(p, 0, p->childCount-1, tree->findCardinality(p, this), true);
-        else mergeMultipleSegments(p, start, end, (type_t)totalElements, false);
-    }else{
-        //Not mergeable in one segments. redistribute from two to two
-        redistributeTwotoTWo(p, start, end, totalElements);
+        if(occupied) previous = position;
     }
-*/
+    if(UNLIKELY(pending > 0)) relayBuffer(targetSegment, carriedKeys, carriedValues, head, carried, insert);
+    seg.smallest = slots[nextOccupied(targetSegment, 0)];
+    seg.lastElementPos = prevOccupied(targetSegment, lastValidPos);
+    seg.buffered = 0;
 }
 
-void PMA::mergeMultipleSegments(BPlusTree::leaf *p, int startLoc, int endLoc, type_t totalElements, bool isAllElements){
-    return;
+/*
+    Finish a merge that ran out of slots after the last pair. The pairs in the slots, the queue of moved pairs and the
+    inserts left from insert on are laid out afresh, all in key order
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::relayBuffer(int targetSegment, const Key *carriedKeys, const value_t *carriedValues, int head, int carried, int insert){
+    WriteBuffer &buffer = buffers[targetSegment];
+    segment &seg = header[targetSegment];
+    Key keys[SegmentBytes / sizeof(Key)];
+    value_t values[SegmentBytes / sizeof(Key)];
+    int64_t count = 0;
+    for(int64_t blockNo = 0; blockNo < blocksInSegment; blockNo++){
+        for(u_int bits = seg.bitmap[blockNo]; bits; bits &= bits - 1){
+            int64_t position = blockNo * JacobsonIndexSize + __builtin_ctz(bits);
+            keys[count] = key_chunks[targetSegment][position];
+            values[count++] = valueAt(targetSegment, position);
+        }
+    }
+    while(carried > 0 || insert < seg.buffered){
+        if(carried > 0 && (insert == seg.buffered || carriedKeys[head] < buffer.keys[insert])){
+            keys[count] = carriedKeys[head];
+            values[count++] = carriedValues[head];
+            head = (head + 1) % Write_buffer;
+            carried--;
+        }else{
+            keys[count] = buffer.keys[insert];
+            values[count++] = buffer.values[insert++];
+        }
+    }
+    memset(seg.bitmap, 0, sizeof(seg.bitmap));
+    fillSegment(targetSegment, keys, valuesFrom(values, 0), count);
 }
 
-void PMA::redistributeTwotoTwo(BPlusTree::leaf *p, int startSeg, int endSeg, type_t totalElements){
-    int lSeg = getSegment();
-    int rSeg = getSegment();
-    int curSegment = lSeg;
-    int halfElement = totalElements/2;
-    type_t copyBlock = 0, lastInsertkey = 0, j = 0;
+//Merge the write buffers of the segments of a leaf, before they are rebalanced
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::mergeLeaf(leaf_t *leaf){
+    for(int i = 0; i < leaf->childCount; i++) settleBuffer(leaf->segNo[i]);
+}
 
-    type_t *moveKeyOffset = key_chunks[startSeg];
-    type_t *moveValOffset = value_chunks[startSeg];
-    type_t *destKeyOffset = key_chunks[curSegment];
-    type_t *destValOffset = value_chunks[curSegment];
-    u_char * ar = NonZeroEntries[bitmap[startSeg][0]];
-    cardinality[lSeg] = totalElements - halfElement;
-    cardinality[rSeg] = halfElement;
-    while(UNLIKELY(ar[0] == 0)){
-        copyBlock++;
-        ar = NonZeroEntries[bitmap[startSeg][copyBlock]];
+//Merge every write buffer holding messages, before a scan over the slots
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::mergeBuffers(){
+    for(int targetSegment : dirtySegments){
+        settleBuffer(targetSegment);
+        buffers[targetSegment].listed = false;
     }
-    moveKeyOffset += (copyBlock * JacobsonIndexSize);
-    moveValOffset += (copyBlock * JacobsonIndexSize);
-    lastInsertkey = smallest[lSeg] = *(moveKeyOffset + ar[1]);
+    dirtySegments.clear();
+}
 
-    for(int blockNo = copyBlock; blockNo <blocksInSegment; blockNo++){
-        ar = NonZeroEntries[bitmap[startSeg][blockNo]];
-        
-        for(int i = 1; i<=ar[0]; i++){
-            type_t current_element = *(moveKeyOffset + ar[i]);
-            j += min((elementsInSegment - j) - totalElements, min(current_element - lastInsertkey, (type_t)MaxGap));
-            *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(moveValOffset + ar[i]);
-            int blockPosition = j / JacobsonIndexSize;
-            int bitPosition = j % JacobsonIndexSize;
-            u_short mask = 1 << bitPosition;
-            bitmap[curSegment][blockPosition] |= mask;
-            totalElements--;
-            if(UNLIKELY(totalElements == halfElement)){
-                //load the second segment
-                curSegment = rSeg;
-                destKeyOffset = key_chunks[rSeg];
-                destValOffset = value_chunks[rSeg];
-                lastElementPos[lSeg] = j;
-                j = 0;
-            }
+//Word of the filter for key and its two bits in it, picked by a multiplicative hash
+PMA_TEMPLATE
+uint64_t PMA<PMA_ARGS>::filterMask(Key key, int &word){
+    uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    word = hash >> 61;
+    return 1ULL << (hash >> 55 & 63) | 1ULL << (hash >> 49 & 63);
+}
+
+//False only if key is neither in targetSegment nor pending in its write buffer
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::mayHold(int targetSegment, Key key){
+    int word;
+    uint64_t mask = filterMask(key, word);
+    return (buffers[targetSegment].filter[word] & mask) == mask;
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::addToFilter(int targetSegment, Key key){
+    int word;
+    uint64_t mask = filterMask(key, word);
+    buffers[targetSegment].filter[word] |= mask;
+}
+
+//Set the filter of a segment from the keys in its slots, after they were laid out anew
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::resetFilter(int targetSegment){
+    uint64_t *filter = buffers[targetSegment].filter;
+    memset(filter, 0, sizeof(buffers[targetSegment].filter));
+    const Key *slots = key_chunks[targetSegment];
+    int word;
+    for(int64_t blockNo = 0; blockNo < blocksInSegment; blockNo++){
+        for(u_int bits = header[targetSegment].bitmap[blockNo]; bits; bits &= bits - 1){
+            uint64_t mask = filterMask(slots[blockNo * JacobsonIndexSize + __builtin_ctz(bits)], word);
+            filter[word] |= mask;
         }
-        bitmap[startSeg][blockNo] = 0;
-        moveKeyOffset += JacobsonIndexSize;
-        moveValOffset += JacobsonIndexSize;
     }
+}
 
-    moveKeyOffset = key_chunks[endSeg];
-    moveValOffset = value_chunks[endSeg];
+//Set the filter of a segment from the count sorted keys fillSegment just laid out in it
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::resetFilter(int targetSegment, const Key *keys, int64_t count){
+    uint64_t *filter = buffers[targetSegment].filter;
+    memset(filter, 0, sizeof(buffers[targetSegment].filter));
+    int word;
+    for(int64_t i = 0; i < count; i++){
+        uint64_t mask = filterMask(keys[i], word);
+        filter[word] |= mask;
+    }
+}
 
-    for(int blockNo = 0; blockNo <blocksInSegment; blockNo++){
-        ar = NonZeroEntries[bitmap[endSeg][blockNo]];
-        
-        for(int i = 1; i<=ar[0]; i++){
-            type_t current_element = *(moveKeyOffset + ar[i]);
-            j += min((elementsInSegment - j) - totalElements, min(current_element - lastInsertkey, (type_t)MaxGap));
-            *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(moveValOffset + ar[i]);
-            int blockPosition = j / JacobsonIndexSize;
-            int bitPosition = j % JacobsonIndexSize;
-            u_short mask = 1 << bitPosition;
-            bitmap[curSegment][blockPosition] |= mask;
-            totalElements--;
-            if(UNLIKELY(totalElements == halfElement)){
-                //load the second segment
-                curSegment = rSeg;
-                destKeyOffset = key_chunks[rSeg];
-                destValOffset = value_chunks[rSeg];
-                lastElementPos[lSeg] = j;
-                j = 0;
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::findLocation(Key key, int targetSegment){
+    Key * segmentOffset = key_chunks[targetSegment];
+    int64_t start = 0, end = header[targetSegment].lastElementPos;
+    int blockPosition, bitPosition, mask;
+    Key data;
+    int64_t mid = 0;
+    while(start <= end){
+        mid = (start + end) / 2;
+        blockPosition = mid / JacobsonIndexSize;
+        bitPosition = mid % JacobsonIndexSize;
+        mask = 1 << bitPosition;
+        if((header[targetSegment].bitmap[blockPosition] & mask) == 0){
+            //Move to the closest occupied slot on the left, or on the right if the left is empty
+            int64_t changedMid = prevOccupied(targetSegment, mid);
+            if(changedMid < start){
+                changedMid = nextOccupied(targetSegment, mid);
+                if(changedMid < 0 || changedMid > end){
+                    return mid;
+                }else mid = changedMid;
+            }else mid = changedMid;
+        }
+        data = *(segmentOffset + mid);
+        if(data == key) return mid;
+        else if(data < key) start = mid + 1;
+        else end = mid - 1;
+    }
+    return mid;
+}
+
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::findLocation1(Key key, int targetSegment){
+    u_char slots[JacobsonIndexSize+1];
+    Key * segmentOffset = key_chunks[targetSegment];
+    int i = 0;
+    int64_t start = 0;
+    u_short block = header[targetSegment].bitmap[0];
+    while(LIKELY(i < blocksInSegment)){
+        if(LIKELY(block)){
+            int first = blockFirst(block);
+            int64_t lastpos = start + blockLast(block);
+            if(*(segmentOffset+lastpos)>=key){
+                //Got the target segment. Find the location in here.
+                if(*(segmentOffset+start+first) >= key){
+                    if(*(segmentOffset+start+first) == key) return start+first;
+                    //After an empty block the slot before a larger first key may be vacant. Take it, shifting assumes none is
+                    if(first == 0 && i > 0 && !(header[targetSegment].bitmap[i-1] >> (JacobsonIndexSize-1) & 1)) return start - 1;
+                    return start;
+                }
+                // Greater than the first elemenst. Search next elements
+                u_char * ar = blockSlots(block, slots);
+                for(int j = 2; j<=ar[0]; j++){
+                    if(*(segmentOffset+start+ar[j]) == key) return start + ar[j];
+                    else if(*(segmentOffset+start+ar[j]) > key){
+                        if(ar[j]-ar[j-1]>1) return start + ar[j] - 1;
+                        else return start + ar[j];
+                    }
+                }
+                cout<<"Program must never reach here"<<endl;
+                exit(0);
+            }else if(UNLIKELY(lastpos == header[targetSegment].lastElementPos)){ // larger than all elements in current segment!
+                return min(header[targetSegment].lastElementPos + keyGap(*(segmentOffset+header[targetSegment].lastElementPos), key), lastValidPos);
+            }
+            if(UNLIKELY(++i == blocksInSegment)) break;
+            block = header[targetSegment].bitmap[i];
+            start += JacobsonIndexSize;
+            if(UNLIKELY(block && *(segmentOffset+start+blockFirst(block))>key )) return lastpos + 1;
+        }
+        else{
+            if(UNLIKELY(++i == blocksInSegment)) break;
+            block = header[targetSegment].bitmap[i];
+            start += JacobsonIndexSize;
+        }
+    }
+    //cout<<"progam should never reach here except the first case"<<endl;
+    return 0;
+}
+
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::findLocation2(Key key, int targetSegment){
+    u_char slots[JacobsonIndexSize+1];
+    Key * segmentOffset = key_chunks[targetSegment];
+    int64_t start = 0;
+    int64_t end = header[targetSegment].lastElementPos;
+    Key data;
+    int64_t mid = 0;
+    int blockPosition, bitPosition, mask;
+    while(start<=end){
+        mid = (start+end)/2;
+        blockPosition = mid / JacobsonIndexSize;
+        bitPosition = mid % JacobsonIndexSize;
+        mask = 1 << bitPosition;
+        if((header[targetSegment].bitmap[blockPosition] & mask) == 0){
+            int64_t base = blockPosition * JacobsonIndexSize;
+            bool over = false, found = false;
+            while(true){
+                u_char * ar = blockSlots(header[targetSegment].bitmap[blockPosition], slots);
+                if(UNLIKELY(ar[0] == 0)){
+                    blockPosition++;
+                    base += JacobsonIndexSize;
+                    if(blockPosition >= blocksInSegment || base > end) break;
+                    continue;
+                }
+                for(int i = 1; i<=ar[0]; i++){
+                    if(base + ar[i] > mid) {
+                        if(base + ar[i] <= end) {mid = base + ar[i]; found = true;}
+                        else over = true;
+                        break;
+                    }
+                }
+                if(found || over) break;
+                blockPosition++;
+                base += JacobsonIndexSize;
+            }
+            if(!found){
+                blockPosition = mid / JacobsonIndexSize;
+                int64_t base = blockPosition * JacobsonIndexSize;
+                while(true){
+                    u_char * ar = blockSlots(header[targetSegment].bitmap[blockPosition], slots);
+                    if(UNLIKELY(ar[0] == 0)){
+                        blockPosition--;
+                        base -= JacobsonIndexSize;
+                        if(blockPosition < 0 || base < start) return mid;
+                        continue;
+                    }
+                    for(int i = ar[0]; i>0; i--){
+                        if(base + ar[i] < mid){
+                            if(base + ar[i] < start) return mid;
+                            mid = base + ar[i];
+                            found = true;
+                            break;
+                        }
+                    }
+                    if(found) break;
+                    blockPosition--;
+                    base -= JacobsonIndexSize;
+                }
             }
         }
-        bitmap[endSeg][blockNo] = 0;
-        moveKeyOffset += JacobsonIndexSize;
-        moveValOffset += JacobsonIndexSize;
-    }
-    //update the metrices
-    ar = NonZeroEntries[bitmap[rSeg][0]];
-    smallest[rSeg] = *(key_chunks[rSeg] + ar[1]);
-    lastElementPos[rSeg] = j;
-    //Now update the leaf
-    for(int i=0; i<p->childCount; i++){
-        if(p->segNo[i] == startSeg){
-            p->segNo[i] = lSeg;
-            p->segNo[i+1] = rSeg;
-            p->key[i] = smallest[rSeg];
+        data = *(segmentOffset + mid);
+        if(data == key) return mid;
+        else if(data < key) start = mid + 1;
+        else end = mid - 1;
+    }
+    return mid;
+}
+
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::printAllElements(){
+    tree->printAllElements(this);
+}
+
+//Sum of the keys and values in [startKey, endKey] from the aggregates of the tree and the segments
+PMA_TEMPLATE
+tuple<int64_t, int64_t> PMA<PMA_ARGS>::range_sum(Key startKey, Key endKey){
+    aggregate_t range = range_aggregate(startKey, endKey);
+    return {range.keySum, range.valueSum};
+}
+
+/*
+    Count, sums and bounds of the pairs in [startKey, endKey], as the difference of the aggregates up to endKey and
+    below startKey. Each takes one descent and a partial sum of one segment, whatever the length of the range
+ */
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::aggregate_t PMA<PMA_ARGS>::range_aggregate(Key startKey, Key endKey){
+    aggregate_t range, below, after;
+    if(UNLIKELY(startKey > endKey)) return range;
+    aggregate_t upTo = prefixAggregate(endKey, after);
+    if(startKey > numeric_limits<Key>::min()) below = prefixAggregate(startKey - 1, after);
+    else after = upTo;
+    if(upTo.count == below.count) return range;
+    range.count = upTo.count - below.count;
+    range.keySum = upTo.keySum - below.keySum;
+    range.valueSum = upTo.valueSum - below.valueSum;
+    range.min = after.min;
+    range.max = upTo.max;
+    return range;
+}
+
+/*
+    Aggregate of the pairs with keys up to bound. Children and segments left of the descent are added whole and the
+    segment bound falls in is summed up to it. after collects the pieces right of the descent, so its min is the
+    smallest key past bound
+ */
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::aggregate_t PMA<PMA_ARGS>::prefixAggregate(Key bound, aggregate_t &after){
+    tree->freshAggregates(this);
+    aggregate_t total;
+    after = aggregate_t();
+    typename tree_t::node *n = tree->root;
+    leaf_t *leaf;
+    while(true){
+        int c = childPosition<Degree>(n->key, n->ptrCount - 1, bound);
+        for(int i = 0; i < c; i++) total.add(n->agg[i]);
+        for(int i = c + 1; i < n->ptrCount; i++) after.add(n->agg[i]);
+        if(n->nodeLeaf){
+            leaf = (leaf_t *)n->child_ptr[c];
             break;
         }
+        n = n->child_ptr[c];
+    }
+    int c = tree->findInLeaf(leaf, bound);
+    for(int i = 0; i < c; i++) total.add(segmentAggregate(leaf->segNo[i]));
+    for(int i = c + 1; i < leaf->childCount; i++) after.add(segmentAggregate(leaf->segNo[i]));
+
+    int targetSegment = leaf->segNo[c];
+    settleBuffer(targetSegment);
+    int64_t position = lastAtMost(targetSegment, bound);
+    total.add(segmentPrefix(targetSegment, position));
+    int64_t next = nextOccupied(targetSegment, position + 1);
+    if(next >= 0){
+        aggregate_t first;
+        first.count = 1;
+        first.min = first.max = *(key_chunks[targetSegment] + next);
+        after.add(first);
     }
-    freeSegID.push_back(startSeg);
-    freeSegID.push_back(endSeg);
-    freeSegmentCount += 2;
+    return total;
 }
 
-//merge all elements in one segment and return
-int PMA::mergeTwoSegments(int startSeg, int endSeg, int totalElements){
-    //copy elements from 1st segment
-    int curSegment = getSegment();
+//Number of keys below key
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::rank(Key key){
+    return key > numeric_limits<Key>::min() ? countUpTo(key - 1) : 0;
+}
 
-    type_t *moveKeyOffset = key_chunks[startSeg];
-    type_t *moveValOffset = value_chunks[startSeg];
-    type_t *destKeyOffset = key_chunks[curSegment];
-    type_t *destValOffset = value_chunks[curSegment];
-    u_char * ar = NonZeroEntries[bitmap[startSeg][0]];
-    type_t copyBlock = 0, lastInsertkey = 0, j = 0;
-    while(UNLIKELY(ar[0] == 0)){
-        copyBlock++;
-        ar = NonZeroEntries[bitmap[startSeg][copyBlock]];
-    }
-    moveKeyOffset += (copyBlock * JacobsonIndexSize);
-    moveValOffset += (copyBlock * JacobsonIndexSize);
-    *destKeyOffset = lastInsertkey = *(moveKeyOffset + ar[1]);
-    *destValOffset = *(moveValOffset + ar[1]);
-    totalElements--;
-    bitmap[curSegment][0] = 1;
-
-    for(int i = 2; i<=ar[0]; i++){
-        type_t current_element = *(moveKeyOffset + ar[i]);
-          
-        j += min((elementsInSegment - j) - totalElements, min((current_element - lastInsertkey), (type_t)MaxGap));
-        *(destKeyOffset + j) = lastInsertkey = current_element;
-        *(destValOffset + j) = *(moveValOffset + ar[i]);
-        int blockPosition = j / JacobsonIndexSize;
-        int bitPosition = j % JacobsonIndexSize;
-        u_short mask = 1 << bitPosition;
-        bitmap[curSegment][blockPosition] |= mask;
-        totalElements--;
+//Number of keys in [startKey, endKey]
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::range_count(Key startKey, Key endKey){
+    if(UNLIKELY(startKey > endKey)) return 0;
+    return countUpTo(endKey) - rank(startKey);
+}
+
+/*
+    Number of keys up to bound. Adds the subtree counts left of the descent, the cardinalities of the segments before
+    the one bound falls in, and a popcount of that segment's bitmap up to its last key not past bound
+ */
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::countUpTo(Key bound){
+    tree->freshAggregates(this);
+    int64_t count = 0;
+    typename tree_t::node *n = tree->root;
+    leaf_t *leaf;
+    while(true){
+        int c = childPosition<Degree>(n->key, n->ptrCount - 1, bound);
+        for(int i = 0; i < c; i++) count += n->agg[i].count;
+        if(n->nodeLeaf){
+            leaf = (leaf_t *)n->child_ptr[c];
+            break;
+        }
+        n = n->child_ptr[c];
     }
-    bitmap[startSeg][copyBlock] = 0;
+    mergeLeaf(leaf);
+    int c = tree->findInLeaf(leaf, bound);
+    for(int i = 0; i < c; i++) count += header[leaf->segNo[i]].cardinality;
+    return count + occupiedUpTo(leaf->segNo[c], lastAtMost(leaf->segNo[c], bound));
+}
 
-    for(int blockno = copyBlock+1; blockno < blocksInSegment; blockno++){
-        moveKeyOffset += JacobsonIndexSize;
-        moveValOffset += JacobsonIndexSize;
-        ar = NonZeroEntries[bitmap[startSeg][blockno]];
-        for(int i = 1; i<=ar[0]; i++){
-            type_t current_element = *(moveKeyOffset + ar[i]);
-            
-            j += min((elementsInSegment - j) - totalElements, min(current_element - lastInsertkey, (type_t)MaxGap));
-            *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(moveValOffset + ar[i]);
-            int blockPosition = j / JacobsonIndexSize;
-            int bitPosition = j % JacobsonIndexSize;
-            u_short mask = 1 << bitPosition;
-            bitmap[curSegment][blockPosition] |= mask;
-            totalElements--;
+/*
+    Cursor at the pair of rank k, counting from 0. Subtree counts and cardinalities are subtracted on the way down and the
+    pair is selected within a bitmap block of the segment. The cursor is past the last pair for k out of range
+ */
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::Cursor PMA<PMA_ARGS>::select(int64_t k){
+    Cursor cursor(this);
+    if(UNLIKELY(k < 0)) return cursor;
+    tree->freshAggregates(this);
+    typename tree_t::node *n = tree->root;
+    int c;
+    while(true){
+        for(c = 0; c < n->ptrCount - 1 && k >= n->agg[c].count; c++) k -= n->agg[c].count;
+        if(n->nodeLeaf) break;
+        n = n->child_ptr[c];
+    }
+    if(UNLIKELY(k >= n->agg[c].count)) return cursor;
+
+    leaf_t *leaf = (leaf_t *)n->child_ptr[c];
+    mergeLeaf(leaf);
+    int segPos = 0;
+    for( ; k >= header[leaf->segNo[segPos]].cardinality; segPos++) k -= header[leaf->segNo[segPos]].cardinality;
+    int targetSegment = leaf->segNo[segPos];
+    int64_t blockNo = 0;
+    for( ; k >= blockCount(header[targetSegment].bitmap[blockNo]); blockNo++) k -= blockCount(header[targetSegment].bitmap[blockNo]);
+    cursor.leaf = leaf;
+    cursor.segPos = segPos;
+    cursor.targetSegment = targetSegment;
+    cursor.settle(blockNo * JacobsonIndexSize + blockSelect(header[targetSegment].bitmap[blockNo], k + 1));
+    return cursor;
+}
+
+//Last slot of a segment holding a key not past bound, -1 if there is none
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::lastAtMost(int targetSegment, Key bound){
+    if(header[targetSegment].cardinality == 0) return -1;
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    int64_t position = prevOccupied(targetSegment, findLocation(bound, targetSegment));
+    while(position >= 0 && *(segmentKeyOffset + position) > bound) position = prevOccupied(targetSegment, position - 1);
+    for(int64_t next = nextOccupied(targetSegment, position + 1); next >= 0 && *(segmentKeyOffset + next) <= bound; next = nextOccupied(targetSegment, next + 1)) position = next;
+    return position;
+}
+
+//Number of occupied slots of a segment up to position
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::occupiedUpTo(int targetSegment, int64_t position){
+    if(position < 0) return 0;
+    int64_t count = 0, lastBlock = position / JacobsonIndexSize;
+    for(int64_t blockNo = 0; blockNo < lastBlock; blockNo++) count += blockCount(header[targetSegment].bitmap[blockNo]);
+    return count + blockCount(header[targetSegment].bitmap[lastBlock] & (0xFFFF >> (JacobsonIndexSize - 1 - position % JacobsonIndexSize)));
+}
+
+//Aggregate of a segment. Its bounds are the smallest key and the key in the last occupied slot
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::aggregate_t PMA<PMA_ARGS>::segmentAggregate(int targetSegment){
+    const segment &seg = header[targetSegment];
+    aggregate_t total;
+    if(seg.cardinality > 0){
+        total.count = seg.cardinality;
+        total.keySum = seg.keySum;
+        total.valueSum = seg.valueSum;
+        total.min = seg.smallest;
+        total.max = *(key_chunks[targetSegment] + seg.lastElementPos);
+    }
+    //Pending inserts count before they are merged
+    if(UNLIKELY(seg.buffered > 0)){
+        const WriteBuffer &buffer = buffers[targetSegment];
+        for(int i = 0; i < seg.buffered; i++){
+            total.count++;
+            total.keySum += buffer.keys[i];
+            total.valueSum += summand(buffer.values[i]);
+            if(buffer.keys[i] < total.min) total.min = buffer.keys[i];
+            if(buffer.keys[i] > total.max) total.max = buffer.keys[i];
         }
-        bitmap[startSeg][blockno] = 0;
     }
+    return total;
+}
 
-    //Now copy elements from 2nd segment
-    moveKeyOffset = key_chunks[endSeg];
-    moveValOffset = value_chunks[endSeg];
-    for(int blockno = 0; blockno < blocksInSegment; blockno++){
-        ar = NonZeroEntries[bitmap[endSeg][blockno]];
+//Aggregate of the occupied slots of a segment up to position, which is occupied or -1
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::aggregate_t PMA<PMA_ARGS>::segmentPrefix(int targetSegment, int64_t position){
+    aggregate_t total;
+    if(position < 0) return total;
+    const segment &seg = header[targetSegment];
+    int64_t lastBlock = position / JacobsonIndexSize, pbase = lastBlock * JacobsonIndexSize;
+    if(lastBlock > 0) sumBlocks(targetSegment, 0, lastBlock - 1, total.keySum, total.valueSum);
+    total.count = occupiedUpTo(targetSegment, position);
+    for(u_int bits = seg.bitmap[lastBlock] & (0xFFFF >> (JacobsonIndexSize - 1 - position % JacobsonIndexSize)); bits; bits &= bits - 1){
+        total.keySum += *(key_chunks[targetSegment] + pbase + __builtin_ctz(bits));
+        total.valueSum += summand(valueAt(targetSegment, pbase + __builtin_ctz(bits)));
+    }
+    total.min = seg.smallest;
+    total.max = *(key_chunks[targetSegment] + position);
+    return total;
+}
 
-        for(int i = 1; i<=ar[0]; i++){
-            type_t current_element = *(moveKeyOffset + ar[i]);
-            j += min((elementsInSegment - j) - totalElements, min(current_element - lastInsertkey, (type_t)MaxGap));
-            *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(moveValOffset + ar[i]);
-            int blockPosition = j / JacobsonIndexSize;
-            int bitPosition = j % JacobsonIndexSize;
-            u_short mask = 1 << bitPosition;
-            bitmap[curSegment][blockPosition] |= mask;
-            totalElements--;
+//Carry a pair inserted into (sign 1) or removed from (sign -1) a segment of leaf into the segment and tree aggregates
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::account(leaf_t *leaf, int targetSegment, Key key, value_t value, int sign){
+    header[targetSegment].keySum += sign * (int64_t)key;
+    header[targetSegment].valueSum += sign * summand(value);
+    tree->propagate(leaf, key, summand(value), sign, this);
+    if(UNLIKELY(writeBuffer) && sign > 0) addToFilter(targetSegment, key);
+}
+
+//Sums of a segment recomputed from its slots
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::recountSegment(int targetSegment){
+    int64_t sum_key = 0, sum_value = 0;
+    sumBlocks(targetSegment, 0, blocksInSegment - 1, sum_key, sum_value);
+    header[targetSegment].keySum = sum_key;
+    header[targetSegment].valueSum = sum_value;
+}
+
+/*
+    Sum of the keys and values in [startKey, endKey] by scanning them. Only the first block and the block where the
+    range ends compare keys. The blocks in between go through the masked block kernel, a segment at a time, while the
+    next segment in the leaf chain is prefetched
+ */
+PMA_TEMPLATE
+tuple<int64_t, int64_t> PMA<PMA_ARGS>::range_sum_scan(Key startKey, Key endKey){
+    mergeBuffers();
+    return scanLeaves(tree->findLeaf(startKey), startKey, endKey);
+}
+
+//Scan of range_sum_scan from the leaf holding startKey
+PMA_TEMPLATE
+tuple<int64_t, int64_t> PMA<PMA_ARGS>::scanLeaves(leaf_t *leaf, Key startKey, Key endKey){
+    int SegNo = tree->findInLeaf(leaf, startKey);
+    int targetSegment = leaf->segNo[SegNo];
+    int64_t sum_key = 0, sum_value = 0;
+    bool first = true;
+    while(LIKELY(true)){
+        //targetSegment++; //Will not work. Use leaf containing the current segment.
+        if(SegNo + 1 < leaf->childCount) prefetchSegment(leaf->segNo[SegNo + 1]);
+        else if(leaf->nextLeaf != NULL) prefetchSegment(leaf->nextLeaf->segNo[0]);
+
+        bool ends = UNLIKELY(first) ? sumSegmentFrom(targetSegment, startKey, endKey, sum_key, sum_value) : sumSegment(targetSegment, 0, endKey, sum_key, sum_value);
+        if(ends) return {sum_key, sum_value};
+        first = false;
+        if(++SegNo == leaf->childCount){
+            if(leaf->nextLeaf == NULL) return {sum_key, sum_value};
+            leaf = leaf->nextLeaf;
+            SegNo = 0;
+        }
+        targetSegment = leaf->segNo[SegNo];
+    }
+}
+
+//Add the elements of a segment from startKey on, up to endKey. Returns true if the range ends in the segment
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::sumSegmentFrom(int targetSegment, Key startKey, Key endKey, int64_t &sum_key, int64_t &sum_value){
+    u_char slots[JacobsonIndexSize+1];
+    int64_t blockNo = findLocation(startKey, targetSegment) / JacobsonIndexSize;
+    u_char * ar = blockSlots(header[targetSegment].bitmap[blockNo], slots);
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    int64_t pbase = blockNo * JacobsonIndexSize;
+
+    //Range starts somewhere within this block
+    for(int offset = 1; offset <= ar[0] ; offset++){
+        Key key = *(segmentKeyOffset+pbase+ar[offset]);
+        if(key > endKey) return true;
+        if(key >= startKey) {
+            sum_key += key;
+            if constexpr(!isSet) sum_value += valueAt(targetSegment, pbase+ar[offset]);
+        }
+    }
+    return sumSegment(targetSegment, blockNo + 1, endKey, sum_key, sum_value);
+}
+
+//Runs the parallel scans on threads threads, the calling one included. 1 or less scans on the calling thread alone
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::setThreads(int threads){
+    delete pool;
+    pool = threads > 1 ? new WorkerPool(threads) : NULL;
+}
+
+/*
+    With the write buffer on, each segment holds back up to Write_buffer inserts and merges them into its gaps in one
+    pass once full. A filter of the keys of each segment spares most new keys the search of its slots. Removes take
+    back a pending insert or leave the slots at once. Point calls and range_sum read the messages in place or merge the
+    segments they land on, cursors merge each segment as they reach it, and the scans merge all of them first. Turning
+    it off merges them. ConcurrentPMA leaves it off
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::setWriteBuffer(bool enabled){
+    if(enabled == writeBuffer) return;
+    if(enabled){
+        buffers.resize(header.size());
+        for(leaf_t *leaf = tree->leftmostLeaf(tree->root); leaf != NULL; leaf = leaf->nextLeaf){
+            for(int segPos = 0; segPos < leaf->childCount; segPos++) resetFilter(leaf->segNo[segPos]);
+        }
+    }
+    else mergeBuffers();
+    writeBuffer = enabled;
+}
+
+/*
+    Sum of the keys and values in [startKey, endKey] scanned on the worker pool. The range is cut at the separator keys of
+    the shallowest tree level that gives each worker about four groups of leaves. A worker takes a group at a time, scans
+    it from its leftmost leaf into its own partial sums, and the partials are added up once all groups are done
+ */
+PMA_TEMPLATE
+tuple<int64_t, int64_t> PMA<PMA_ARGS>::range_sum_parallel(Key startKey, Key endKey){
+    if(pool == NULL || startKey > endKey) return range_sum_scan(startKey, endKey);
+    mergeBuffers();
+    typedef typename tree_t::node node_t;
+    size_t groups = (size_t)pool->size() * 4;
+    vector<pair<Key, leaf_t *>> starts(1, {startKey, tree->findLeaf(startKey)});
+    vector<node_t *> level(1, tree->root);
+    while(starts.size() < groups && !level.empty()){
+        vector<node_t *> below;
+        for(node_t *n : level){
+            int first = childPosition<Degree>(n->key, n->ptrCount - 1, startKey);
+            int last = childPosition<Degree>(n->key, n->ptrCount - 1, endKey);
+            //Keys from separator key[i] on route to child i + 1
+            for(int i = first; i < last; i++){
+                node_t *child = n->child_ptr[i + 1];
+                starts.push_back({n->key[i], n->nodeLeaf ? (leaf_t *)child : tree->leftmostLeaf(child)});
+            }
+            if(!n->nodeLeaf) below.insert(below.end(), n->child_ptr + first, n->child_ptr + last + 1);
         }
-        bitmap[endSeg][blockno] = 0;
+        level.swap(below);
+    }
+    sort(starts.begin(), starts.end(), [](const pair<Key, leaf_t *> &a, const pair<Key, leaf_t *> &b){ return a.first < b.first; });
 
-        moveKeyOffset += JacobsonIndexSize;
-        moveValOffset += JacobsonIndexSize;
+    struct alignas(64) Partial{ int64_t sum_key = 0, sum_value = 0; };
+    vector<Partial> partials(pool->size());
+    pool->run((int)starts.size(), [&](int task, int worker){
+        Key to = task + 1 < (int)starts.size() ? starts[task + 1].first - 1 : endKey;
+        int64_t sum_key, sum_value;
+        tie(sum_key, sum_value) = scanLeaves(starts[task].second, starts[task].first, to);
+        partials[worker].sum_key += sum_key;
+        partials[worker].sum_value += sum_value;
+    });
+    int64_t sum_key = 0, sum_value = 0;
+    for(const Partial &p : partials){
+        sum_key += p.sum_key;
+        sum_value += p.sum_value;
+    }
+    return {sum_key, sum_value};
+}
+
+/*
+    Sum of the keys and values of the last limit pairs in [startKey, endKey], all of them for a negative limit. The scan
+    starts from the segment holding endKey and walks the leaf chain backward, summing whole blocks with the masked block
+    kernel like range_sum_scan, so a top-k from the end of the range never reads its start
+ */
+PMA_TEMPLATE
+tuple<int64_t, int64_t> PMA<PMA_ARGS>::range_sum_desc(Key startKey, Key endKey, int64_t limit){
+    int64_t sum_key = 0, sum_value = 0;
+    if(UNLIKELY(startKey > endKey || limit == 0)) return {sum_key, sum_value};
+    mergeBuffers();
+    leaf_t *leaf = tree->findLeaf(endKey);
+    int segPos = tree->findInLeaf(leaf, endKey);
+    int targetSegment = leaf->segNo[segPos];
+    int64_t position = lastAtMost(targetSegment, endKey);
+    int64_t remaining = limit;
+    while(true){
+        //Two segments ahead, the hardware prefetchers pick up backward streams later than forward ones
+        if(segPos > 1) prefetchSegment(leaf->segNo[segPos - 2]);
+        else if(leaf->prevLeaf != NULL) prefetchSegment(leaf->prevLeaf->segNo[max(0, leaf->prevLeaf->childCount - 2 + segPos)]);
+
+        if(sumSegmentDesc(targetSegment, position, startKey, remaining, sum_key, sum_value)) return {sum_key, sum_value};
+        if(segPos-- == 0){
+            if(leaf->prevLeaf == NULL) return {sum_key, sum_value};
+            leaf = leaf->prevLeaf;
+            segPos = leaf->childCount - 1;
+        }
+        targetSegment = leaf->segNo[segPos];
+        position = header[targetSegment].cardinality > 0 ? header[targetSegment].lastElementPos : -1;
+    }
+}
+
+/*
+    Add the pairs of a segment at or below slot position, down to startKey and no more than remaining of them when it is
+    not negative. Returns true once the range is done
+ */
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::sumSegmentDesc(int targetSegment, int64_t position, Key startKey, int64_t &remaining, int64_t &sum_key, int64_t &sum_value){
+    if(position < 0) return false;
+    const segment &seg = header[targetSegment];
+    int64_t topBlock = position / JacobsonIndexSize;
+    //The range ends inside this segment, its last block is taken pair by pair
+    if(position < seg.lastElementPos){
+        if(takeBlockDesc(targetSegment, topBlock, seg.bitmap[topBlock] & (0xFFFF >> (JacobsonIndexSize - 1 - position % JacobsonIndexSize)), startKey, remaining, sum_key, sum_value)) return true;
+        topBlock--;
+    }
+
+    //The range starts inside this segment, in the highest block whose first key is below startKey
+    const Key *keys = key_chunks[targetSegment];
+    int64_t startBlock = -1;
+    if(UNLIKELY(keys[nextOccupied(targetSegment, 0)] < startKey)){
+        for(startBlock = topBlock; ; startBlock--){
+            u_short block = seg.bitmap[startBlock];
+            if(block && keys[startBlock * JacobsonIndexSize + blockFirst(block)] < startKey) break;
+        }
     }
 
-    lastElementPos[curSegment] = j;
-    smallest[curSegment] = *(destKeyOffset);
-    cardinality[curSegment] = cardinality[startSeg] + cardinality[endSeg];
-    totalSegments--;
-    freeSegID.push_back(startSeg);
-    freeSegID.push_back(endSeg);
-    freeSegmentCount += 2;
-
-    return curSegment;
+    //Blocks above it are summed whole, from the top down as far as the limit allows
+    int64_t cut = startBlock + 1;
+    if(remaining >= 0){
+        int64_t count = 0;
+        for(cut = topBlock + 1; cut > startBlock + 1 && count + blockCount(seg.bitmap[cut - 1]) <= remaining; cut--) count += blockCount(seg.bitmap[cut - 1]);
+        remaining -= count;
+    }
+    if(cut <= topBlock) sumBlocks(targetSegment, cut, topBlock, sum_key, sum_value);
+    if(cut > startBlock + 1) return takeBlockDesc(targetSegment, cut - 1, seg.bitmap[cut - 1], startKey, remaining, sum_key, sum_value);
+    if(remaining == 0) return true;
+    return startBlock >= 0 && takeBlockDesc(targetSegment, startBlock, seg.bitmap[startBlock], startKey, remaining, sum_key, sum_value);
 }
 
-void PMA::deleteSegment(int targetSegment){
-    freeSegmentCount++;
-    freeSegID.push_back(targetSegment);
-
-    fill(bitmap[targetSegment].begin(), bitmap[targetSegment].end(), 0);
-    totalSegments--;
+//Add the pairs of bits in a block from the highest slot down. Returns true on a key below startKey or once remaining runs out
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::takeBlockDesc(int targetSegment, int64_t blockNo, u_int bits, Key startKey, int64_t &remaining, int64_t &sum_key, int64_t &sum_value){
+    const Key *keys = key_chunks[targetSegment];
+    int64_t pbase = blockNo * JacobsonIndexSize;
+    for( ; bits; bits &= ~(1u << (31 - __builtin_clz(bits)))){
+        if(remaining == 0) return true;
+        int64_t slot = pbase + 31 - __builtin_clz(bits);
+        if(keys[slot] < startKey) return true;
+        sum_key += keys[slot];
+        if constexpr(!isSet) sum_value += valueAt(targetSegment, slot);
+        if(remaining > 0) remaining--;
+    }
+    return remaining == 0;
 }
 
-bool PMA::lookup(type_t key){
-    int targetSegment = tree->searchSegment(key);
-    type_t position = findLocation(key, targetSegment);
-    int blockNo = position/JacobsonIndexSize;
-    int bitPosition = position % JacobsonIndexSize;
-    u_short mask =  1 << bitPosition;
-    if(!(bitmap[targetSegment][blockNo] & mask)) return false;
+/*
+    Add the elements of a segment from block fromBlock on, up to endKey. Returns true if the segment holds a key past
+    endKey, which ends the range
+ */
+PMA_TEMPLATE
+bool PMA<PMA_ARGS>::sumSegment(int targetSegment, int64_t fromBlock, Key endKey, int64_t &sum_key, int64_t &sum_value){
+    const segment &seg = header[targetSegment];
+    if(UNLIKELY(seg.cardinality == 0)) return false;
+    Key * segmentKeyOffset = key_chunks[targetSegment];
+    int64_t lastBlock = seg.lastElementPos / JacobsonIndexSize;
+    if(LIKELY(*(segmentKeyOffset + seg.lastElementPos) <= endKey)){
+        if(fromBlock <= lastBlock) sumBlocks(targetSegment, fromBlock, lastBlock, sum_key, sum_value);
+        return false;
+    }
+
+    //The range ends in this segment. Sum the blocks before the one holding the first key past endKey
+    int64_t endBlock = fromBlock;
+    for( ; endBlock <= lastBlock; endBlock++){
+        u_short block = seg.bitmap[endBlock];
+        if(block && *(segmentKeyOffset + endBlock * JacobsonIndexSize + blockLast(block)) > endKey) break;
+    }
+    if(endBlock > fromBlock) sumBlocks(targetSegment, fromBlock, endBlock - 1, sum_key, sum_value);
+    if(UNLIKELY(endBlock > lastBlock)) return false;
 
-    type_t * segmentOffsetKey = key_chunks[targetSegment];
-    type_t * segmentOffsetVal = value_chunks[targetSegment];
-    type_t foundKey = *(segmentOffsetKey + position);
-    type_t foundVal = *(segmentOffsetVal + position);
-    assert(foundKey*10 == foundVal);
-    return foundKey == key ? true : false;
+    int64_t pbase = endBlock * JacobsonIndexSize;
+    for(u_int bits = seg.bitmap[endBlock]; bits && *(segmentKeyOffset + pbase + __builtin_ctz(bits)) <= endKey; bits &= bits - 1){
+        sum_key += *(segmentKeyOffset + pbase + __builtin_ctz(bits));
+        if constexpr(!isSet) sum_value += valueAt(targetSegment, pbase + __builtin_ctz(bits));
+    }
+    return true;
 }
 
-type_t PMA::findLocation(type_t key, int targetSegment){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t start = 0, end = lastElementPos[targetSegment];
-    int blockPosition, bitPosition, mask;
-    type_t data, mid = 0;
-    while(start <= end){
-        mid = (start + end) / 2;
-        blockPosition = mid / JacobsonIndexSize;
-        bitPosition = mid % JacobsonIndexSize;
-        mask = 1 << bitPosition;
-        if((bitmap[targetSegment][blockPosition] & mask) == 0){
-            int64_t changedMid = mid, offset = -1;
-            while(changedMid >= start){
-                changedMid += offset;
-                blockPosition = changedMid / JacobsonIndexSize;
-                bitPosition = changedMid % JacobsonIndexSize;
-                mask = 1 << bitPosition;
-                if((bitmap[targetSegment][blockPosition] & mask) !=0) break;
+/*
+    Masked block kernel. Sums the occupied slots of blocks fromBlock to toBlock of a segment by loading each block whole
+    and masking its vacant slots with the bitmap: masked adds with AVX-512, a compare against the lane bits and an AND
+    with AVX2, a mask per slot otherwise. Sums run in 64-bit lanes, so 32-bit keys and values are widened first and don't
+    wrap. Other key and value types take the scalar mask.
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::sumBlocks(int targetSegment, int64_t fromBlock, int64_t toBlock, int64_t &sum_key, int64_t &sum_value){
+    const Key *keys = key_chunks[targetSegment];
+    const value_t *values = isSet ? NULL : value_chunks[targetSegment];
+    const u_short *bitmap = header[targetSegment].bitmap;
+#if defined(__AVX512F__)
+    if constexpr(laneType<Key>() && (isSet || laneType<value_t>())){
+        __m512i keyAcc = _mm512_setzero_si512(), valueAcc = _mm512_setzero_si512();
+        for(int64_t blockNo = fromBlock; blockNo <= toBlock; blockNo++){
+            u_int bits = bitmap[blockNo];
+            if(bits == 0) continue;
+            int64_t pbase = blockNo * JacobsonIndexSize;
+            for(int lane = 0; lane < JacobsonIndexSize; lane += 8){
+                __mmask8 mask = (__mmask8)(bits >> lane);
+                keyAcc = _mm512_mask_add_epi64(keyAcc, mask, keyAcc, loadLanes8(keys + pbase + lane));
+                if constexpr(!isSet) valueAcc = _mm512_mask_add_epi64(valueAcc, mask, valueAcc, loadLanes8(values + pbase + lane));
             }
-            if(changedMid < start){
-                changedMid = mid;
-                offset = 1;
-                while(changedMid <= end){
-                    changedMid += offset;
-                    blockPosition = changedMid / JacobsonIndexSize;
-                    bitPosition = changedMid % JacobsonIndexSize;
-                    mask = 1 << bitPosition;
-                    if((bitmap[targetSegment][blockPosition] & mask) !=0 ) break;
-                }
-                if(changedMid > end){
-                    return mid;
-                }else mid = changedMid;
-            }else mid = changedMid;
         }
-        data = *(segmentOffset + mid);
-        if(data == key) return mid;
-        else if(data < key) start = mid + 1;
-        else end = mid - 1;
+        sum_key += horizontalSum(keyAcc);
+        if constexpr(!isSet) sum_value += horizontalSum(valueAcc);
+        return;
+    }
+#elif defined(__AVX2__)
+    if constexpr(laneType<Key>() && (isSet || laneType<value_t>())){
+        const __m256i laneBits = _mm256_setr_epi64x(1, 2, 4, 8);
+        __m256i keyAcc = _mm256_setzero_si256(), valueAcc = _mm256_setzero_si256();
+        for(int64_t blockNo = fromBlock; blockNo <= toBlock; blockNo++){
+            u_int bits = bitmap[blockNo];
+            if(bits == 0) continue;
+            int64_t pbase = blockNo * JacobsonIndexSize;
+            for(int lane = 0; lane < JacobsonIndexSize; lane += 4){
+                __m256i mask = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits >> lane), laneBits), laneBits);
+                keyAcc = _mm256_add_epi64(keyAcc, _mm256_and_si256(loadLanes4(keys + pbase + lane), mask));
+                if constexpr(!isSet) valueAcc = _mm256_add_epi64(valueAcc, _mm256_and_si256(loadLanes4(values + pbase + lane), mask));
+            }
+        }
+        sum_key += horizontalSum(keyAcc);
+        if constexpr(!isSet) sum_value += horizontalSum(valueAcc);
+        return;
+    }
+#endif
+    for(int64_t blockNo = fromBlock; blockNo <= toBlock; blockNo++){
+        u_int bits = bitmap[blockNo];
+        if(bits == 0) continue;
+        int64_t pbase = blockNo * JacobsonIndexSize;
+        for(int j = 0; j < JacobsonIndexSize; j++){
+            int64_t occupied = -(int64_t)((bits >> j) & 1);
+            sum_key += (int64_t)*(keys + pbase + j) & occupied;
+            if constexpr(!isSet) sum_value += (int64_t)*(values + pbase + j) & occupied;
+        }
     }
-    return mid;
 }
 
-type_t PMA::findLocation1(type_t key, int targetSegment){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    int i = 0;
-    type_t start = 0;
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][0]];
-    while(LIKELY(i < blocksInSegment)){
-        int elements = ar[0], lastpos = start + ar[elements];
-        if(LIKELY(elements)){
-            if(*(segmentOffset+lastpos)>=key){
-                //Got the target segment. Find the location in here.
-                if(*(segmentOffset+start+ar[1]) >= key){
-                    if(*(segmentOffset+start+ar[1]) == key) return start+ar[1];
-                    return start;
-                }
-                // Greater than the first elemenst. Search next elements
-                for(int j = 2; j<=elements; j++){
-                    if(*(segmentOffset+start+ar[j]) == key) return start + ar[j];
-                    else if(*(segmentOffset+start+ar[j]) > key){
-                        if(ar[j]-ar[j-1]>1) return start + ar[j] - 1;
-                        else return start + ar[j];
-                    }
+/*
+    Count, sums and bounds of the pairs in [startKey, endKey] whose value passes the predicate, tested in the segment loop
+    with vector compares against the occupancy bitmap. Only the block where the range starts and the blocks of the
+    segment where it ends compare keys
+ */
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::aggregate_t PMA<PMA_ARGS>::range_sum_where(Key startKey, Key endKey, const ValuePredicate &predicate){
+    aggregate_t total;
+    if(UNLIKELY(startKey > endKey)) return total;
+    mergeBuffers();
+    leaf_t *leaf = tree->findLeaf(startKey);
+    int segPos = tree->findInLeaf(leaf, startKey);
+    int64_t fromBlock = findLocation(startKey, leaf->segNo[segPos]) / JacobsonIndexSize;
+    bool first = true;
+    while(true){
+        int targetSegment = leaf->segNo[segPos];
+        if(segPos + 1 < leaf->childCount) prefetchSegment(leaf->segNo[segPos + 1]);
+        else if(leaf->nextLeaf != NULL) prefetchSegment(leaf->nextLeaf->segNo[0]);
+
+        const segment &seg = header[targetSegment];
+        int64_t lastBlock = seg.lastElementPos / JacobsonIndexSize;
+        if(LIKELY(seg.cardinality > 0 && fromBlock <= lastBlock)){
+            const Key *keys = key_chunks[targetSegment];
+            u_int firstMask = 0xFFFF, lastMask = 0xFFFF;
+            if(UNLIKELY(first)){
+                int64_t pbase = fromBlock * JacobsonIndexSize;
+                for(u_int bits = seg.bitmap[fromBlock]; bits && keys[pbase + __builtin_ctz(bits)] < startKey; bits &= bits - 1) firstMask &= ~(1u << __builtin_ctz(bits));
+            }
+            bool ends = keys[seg.lastElementPos] > endKey;
+            //The range ends in this segment. Stop at the block holding the first key past endKey
+            if(UNLIKELY(ends)){
+                for(lastBlock = fromBlock; ; lastBlock++){
+                    u_short block = seg.bitmap[lastBlock];
+                    if(block && keys[lastBlock * JacobsonIndexSize + blockLast(block)] > endKey) break;
                 }
-                cout<<"Program must never reach here"<<endl;
-                exit(0);
-            }else if(UNLIKELY(lastpos == lastElementPos[targetSegment])){ // larger than all elements in current segment!
-                return min(lastElementPos[targetSegment] + min((type_t)MaxGap, key-*(segmentOffset+lastElementPos[targetSegment])), lastValidPos);
+                int64_t pbase = lastBlock * JacobsonIndexSize;
+                for(u_int bits = seg.bitmap[lastBlock]; bits; bits &= bits - 1) if(keys[pbase + __builtin_ctz(bits)] > endKey) lastMask &= ~(1u << __builtin_ctz(bits));
             }
-            ar = NonZeroEntries[bitmap[targetSegment][++i]];
-            start += JacobsonIndexSize;
-            if(UNLIKELY(ar[0] && *(segmentOffset+start+ar[1])>key )) return lastpos + 1;
+            filterBlocks(targetSegment, fromBlock, lastBlock, firstMask, lastMask, predicate, total);
+            if(UNLIKELY(ends)) return total;
         }
-        else{
-            ar = NonZeroEntries[bitmap[targetSegment][++i]];
-            start += JacobsonIndexSize;
+        first = false;
+        fromBlock = 0;
+        if(++segPos == leaf->childCount){
+            if(leaf->nextLeaf == NULL) return total;
+            leaf = leaf->nextLeaf;
+            segPos = 0;
         }
     }
-    //cout<<"progam should never reach here except the first case"<<endl;
-    return 0;
 }
 
-type_t PMA::findLocation2(type_t key, int targetSegment){
-    type_t * segmentOffset = key_chunks[targetSegment];
-    type_t start = 0;
-    type_t end = lastElementPos[targetSegment];
-    type_t data, mid = 0;
-    int blockPosition, bitPosition, mask;
-    while(start<=end){
-        mid = (start+end)/2;
-        blockPosition = mid / JacobsonIndexSize;
-        bitPosition = mid % JacobsonIndexSize;
-        mask = 1 << bitPosition;
-        if((bitmap[targetSegment][blockPosition] & mask) == 0){
-            type_t base = blockPosition * JacobsonIndexSize;
-            bool over = false, found = false;
-            while(true){
-                u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-                if(UNLIKELY(ar[0] == 0)){
-                    blockPosition++;
-                    base += JacobsonIndexSize;
-                    if(blockPosition >= blocksInSegment || base > end) break;
-                    continue;
-                }
-                for(int i = 1; i<=ar[0]; i++){
-                    if(base + ar[i] > mid) {
-                        if(base + ar[i] <= end) {mid = base + ar[i]; found = true;}
-                        else over = true;
-                        break;
-                    }
-                }
-                if(found || over) break;
-                blockPosition++;
-                base += JacobsonIndexSize;
+/*
+    Add the pairs of blocks fromBlock to toBlock of a segment that pass the predicate into total. firstMask and lastMask
+    trim the slots of the first and last block. Matched keys and values are summed in vector lanes like in sumBlocks
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::filterBlocks(int targetSegment, int64_t fromBlock, int64_t toBlock, u_int firstMask, u_int lastMask, const ValuePredicate &predicate, aggregate_t &total){
+    const Key *keys = key_chunks[targetSegment];
+    const value_t *values = isSet ? NULL : value_chunks[targetSegment];
+    const u_short *bitmap = header[targetSegment].bitmap;
+#if defined(__AVX512F__)
+    constexpr bool vectorSums = laneType<Key>() && (isSet || laneType<value_t>());
+    __m512i keyAcc = _mm512_setzero_si512(), valueAcc = _mm512_setzero_si512();
+#elif defined(__AVX2__)
+    constexpr bool vectorSums = laneType<Key>() && (isSet || laneType<value_t>());
+    const __m256i laneBits = _mm256_setr_epi64x(1, 2, 4, 8);
+    __m256i keyAcc = _mm256_setzero_si256(), valueAcc = _mm256_setzero_si256();
+#else
+    constexpr bool vectorSums = false;
+#endif
+    for(int64_t blockNo = fromBlock; blockNo <= toBlock; blockNo++){
+        u_int bits = bitmap[blockNo];
+        if(blockNo == fromBlock) bits &= firstMask;
+        if(blockNo == toBlock) bits &= lastMask;
+        if(bits == 0) continue;
+        int64_t pbase = blockNo * JacobsonIndexSize;
+        u_int match;
+        if constexpr(isSet) match = matchBlock(keys + pbase, bits, predicate);
+        else match = matchBlock(values + pbase, bits, predicate);
+        if(match == 0) continue;
+
+        total.count += __builtin_popcount(match);
+        if(keys[pbase + __builtin_ctz(match)] < total.min) total.min = keys[pbase + __builtin_ctz(match)];
+        total.max = keys[pbase + 31 - __builtin_clz(match)];
+        if constexpr(vectorSums){
+#if defined(__AVX512F__)
+            for(int lane = 0; lane < JacobsonIndexSize; lane += 8){
+                __mmask8 mask = (__mmask8)(match >> lane);
+                keyAcc = _mm512_mask_add_epi64(keyAcc, mask, keyAcc, loadLanes8(keys + pbase + lane));
+                if constexpr(!isSet) valueAcc = _mm512_mask_add_epi64(valueAcc, mask, valueAcc, loadLanes8(values + pbase + lane));
             }
-            if(!found){
-                blockPosition = mid / JacobsonIndexSize;
-                type_t base = blockPosition * JacobsonIndexSize;
-                while(true){
-                    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockPosition]];
-                    if(UNLIKELY(ar[0] == 0)){
-                        blockPosition--;
-                        base -= JacobsonIndexSize;
-                        if(blockPosition < 0 || base < start) return mid;
-                        continue;
-                    }
-                    for(int i = ar[0]; i>0; i--){
-                        if(base + ar[i] < mid){
-                            if(base + ar[i] < start) return mid;
-                            mid = base + ar[i];
-                            found = true;
-                            break;
-                        }
-                    }
-                    if(found) break;
-                    blockPosition--;
-                    base -= JacobsonIndexSize;
-                }
+#elif defined(__AVX2__)
+            for(int lane = 0; lane < JacobsonIndexSize; lane += 4){
+                __m256i mask = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(match >> lane), laneBits), laneBits);
+                keyAcc = _mm256_add_epi64(keyAcc, _mm256_and_si256(loadLanes4(keys + pbase + lane), mask));
+                if constexpr(!isSet) valueAcc = _mm256_add_epi64(valueAcc, _mm256_and_si256(loadLanes4(values + pbase + lane), mask));
+            }
+#endif
+        }else{
+            for(u_int b = match; b; b &= b - 1){
+                total.keySum += keys[pbase + __builtin_ctz(b)];
+                if constexpr(!isSet) total.valueSum += summand(values[pbase + __builtin_ctz(b)]);
             }
         }
-        data = *(segmentOffset + mid);
-        if(data == key) return mid;
-        else if(data < key) start = mid + 1;
-        else end = mid - 1;
     }
-    return mid;
+#if defined(__AVX512F__) || defined(__AVX2__)
+    if constexpr(vectorSums){
+        total.keySum += horizontalSum(keyAcc);
+        if constexpr(!isSet) total.valueSum += horizontalSum(valueAcc);
+    }
+#endif
 }
 
-void PMA::printAllElements(){
-    tree->printAllElements(this);
+//Bring the header, keys and values of a segment into the cache ahead of a scan reaching it
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::prefetchSegment(int targetSegment){
+    __builtin_prefetch(&header[targetSegment]);
+    const char *keys = (const char *)key_chunks[targetSegment];
+    for(int line = 0; line < SegmentBytes; line += 64) __builtin_prefetch(keys + line);
+    if constexpr(!isSet){
+        const char *values = (const char *)value_chunks[targetSegment];
+        for(size_t line = 0; line < elementsInSegment * sizeof(value_t); line += 64) __builtin_prefetch(values + line);
+    }
 }
 
-tuple<type_t, type_t> PMA::range_sum(type_t startKey, type_t endKey){
-    BPlusTree::leaf *leaf = tree->findLeaf(startKey);
-    int SegNo = tree->findInLeaf(leaf, startKey);
-    int targetSegment = leaf->segNo[SegNo++];
-    if(SegNo == leaf->childCount){leaf=leaf->nextLeaf; SegNo = 0;}
+//Key sum of [startKey, endKey] through a cursor, a pair at a time. range_sum covers the same range a block at a time
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::range_sum2(Key startKey, Key endKey){
+    int64_t sum_key = 0;
+    for(Cursor cursor = seek(startKey); cursor.valid() && cursor.key() <= endKey; cursor.next()) sum_key += cursor.key();
+    return sum_key;
+}
 
-    type_t position = findLocation(startKey, targetSegment);
-    type_t sum_key = 0, sum_value = 0;
-    type_t blockNo = position/JacobsonIndexSize;
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-    type_t * segmentKeyOffset = key_chunks[targetSegment];
-    type_t * segmentValOffset = value_chunks[targetSegment];
-    type_t pbase = blockNo * JacobsonIndexSize;
+//Cursor at the first pair with a key not less than key
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::Cursor PMA<PMA_ARGS>::seek(Key key){
+    Cursor cursor(this);
+    cursor.leaf = tree->findLeaf(key);
+    cursor.segPos = tree->findInLeaf(cursor.leaf, key);
+    cursor.targetSegment = cursor.leaf->segNo[cursor.segPos];
+    settleBuffer(cursor.targetSegment);
+    cursor.settle(findLocation(key, cursor.targetSegment));
+    //findLocation may stop one pair short of the key
+    while(cursor.valid() && cursor.key() < key) cursor.next();
+    return cursor;
+}
 
-    //Range starts somewhere within this block
-    bool flag = false;
-    for(int offset = 1; offset <= ar[0] ; offset++){
-        type_t key = *(segmentKeyOffset+pbase+ar[offset]);
-        if(flag && key > endKey) flag = false;
-        else if(!flag && key >= startKey) flag = true;
-        if(flag) {
-            sum_key += key;
-            sum_value += *(segmentValOffset+pbase+ar[offset]);
+//Cursor at the smallest pair
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::Cursor PMA<PMA_ARGS>::begin(){
+    Cursor cursor(this);
+    cursor.leaf = tree->leftmostLeaf(tree->root);
+    cursor.targetSegment = cursor.leaf->segNo[0];
+    cursor.settle(0);
+    return cursor;
+}
+
+//First pair with a key not less than key
+PMA_TEMPLATE
+optional<typename PMA<PMA_ARGS>::pair_t> PMA<PMA_ARGS>::lower_bound(Key key){
+    Cursor cursor = seek(key);
+    if(!cursor.valid()) return nullopt;
+    return pair_t(cursor.key(), cursor.value());
+}
+
+//First pair with a key greater than key
+PMA_TEMPLATE
+optional<typename PMA<PMA_ARGS>::pair_t> PMA<PMA_ARGS>::upper_bound(Key key){
+    if(UNLIKELY(key == numeric_limits<Key>::max())) return nullopt;
+    return lower_bound(key + 1);
+}
+
+//Pair of the next larger key, which is the pair upper_bound finds
+PMA_TEMPLATE
+optional<typename PMA<PMA_ARGS>::pair_t> PMA<PMA_ARGS>::successor(Key key){
+    return upper_bound(key);
+}
+
+//Pair of the next smaller key
+PMA_TEMPLATE
+optional<typename PMA<PMA_ARGS>::pair_t> PMA<PMA_ARGS>::predecessor(Key key){
+    if(UNLIKELY(key == numeric_limits<Key>::min())) return nullopt;
+    ReverseCursor cursor = rseek(key - 1);
+    if(!cursor.valid()) return nullopt;
+    return pair_t(cursor.key(), cursor.value());
+}
+
+//Reverse cursor at the last pair with a key not greater than key
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::ReverseCursor PMA<PMA_ARGS>::rseek(Key key){
+    ReverseCursor cursor(this);
+    cursor.leaf = tree->findLeaf(key);
+    cursor.segPos = tree->findInLeaf(cursor.leaf, key);
+    cursor.targetSegment = cursor.leaf->segNo[cursor.segPos];
+    settleBuffer(cursor.targetSegment);
+    cursor.settle(lastAtMost(cursor.targetSegment, key));
+    return cursor;
+}
+
+//Reverse cursor at the last pair
+PMA_TEMPLATE
+typename PMA<PMA_ARGS>::ReverseCursor PMA<PMA_ARGS>::rbegin(){
+    ReverseCursor cursor(this);
+    cursor.leaf = tree->rightmostLeaf(tree->root);
+    cursor.segPos = cursor.leaf->childCount - 1;
+    cursor.targetSegment = cursor.leaf->segNo[cursor.segPos];
+    cursor.settle(lastValidPos);
+    return cursor;
+}
+
+//Move to the last occupied slot at or before from, going back through the segments and leaves. -1 moves to the previous segment
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::ReverseCursor::settle(int64_t from){
+    while(true){
+        pma->settleBuffer(targetSegment);
+        const segment &seg = pma->header[targetSegment];
+        keys = pma->key_chunks[targetSegment];
+        if constexpr(!isSet) values = pma->value_chunks[targetSegment];
+        if(seg.cardinality > 0 && from >= 0){
+            from = min(from, seg.lastElementPos);
+            u_int mask = 0xFFFF >> (JacobsonIndexSize - 1 - from % JacobsonIndexSize);
+            for(int64_t blockNo = from / JacobsonIndexSize; blockNo >= 0; blockNo--, mask = 0xFFFF){
+                bits = seg.bitmap[blockNo] & mask;
+                if(bits){
+                    position = blockNo * JacobsonIndexSize + 31 - __builtin_clz(bits);
+                    return;
+                }
+            }
+        }
+        if(segPos-- == 0){
+            leaf = leaf->prevLeaf;
+            if(leaf == NULL){
+                bits = 0;
+                position = -1;
+                return;
+            }
+            segPos = leaf->childCount - 1;
         }
+        targetSegment = leaf->segNo[segPos];
+        from = pma->lastValidPos;
     }
+}
 
-    type_t * key_pos, *value_pos;
-    int offset;
-    while(LIKELY(true)){
-        pbase += JacobsonIndexSize;
-        blockNo++;
-        if(blockNo == blocksInSegment){
-            blockNo = 0;
-            pbase = 0;
-            targetSegment = leaf->segNo[SegNo++];
-            if(SegNo == leaf->childCount){
-                if(leaf->nextLeaf == NULL)return{sum_key, sum_value};
-                leaf=leaf->nextLeaf;
-                SegNo = 0;
+//Move to the first occupied slot at or after from in the current segment, or on to the following segments
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::Cursor::settle(int64_t from){
+    while(true){
+        pma->settleBuffer(targetSegment);
+        const segment &seg = pma->header[targetSegment];
+        keys = pma->key_chunks[targetSegment];
+        if constexpr(!isSet) values = pma->value_chunks[targetSegment];
+        int64_t lastBlock = seg.cardinality > 0 ? seg.lastElementPos / JacobsonIndexSize : -1;
+        u_int mask = 0xFFFF << (from % JacobsonIndexSize);
+        for(int64_t blockNo = from / JacobsonIndexSize; blockNo <= lastBlock; blockNo++, mask = 0xFFFF){
+            bits = seg.bitmap[blockNo] & mask;
+            if(bits){
+                position = blockNo * JacobsonIndexSize + __builtin_ctz(bits);
+                return;
             }
-            //targetSegment++; //Will not work. Use leaf containing the current segment.
-            if(UNLIKELY(targetSegment == totalSegments)) return{sum_key, sum_value};
-            segmentKeyOffset = key_chunks[targetSegment];
-            segmentValOffset = value_chunks[targetSegment];
-        }
-        ar = NonZeroEntries[bitmap[targetSegment][blockNo]];
-        key_pos = segmentKeyOffset + pbase;
-        value_pos = segmentValOffset + pbase;
-        offset = ar[0];
-        switch (offset){
-            case 1:
-                sum_key += *(key_pos + ar[1]);
-                sum_value += *(value_pos + ar[1]);
-                break;
-            case 2:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                break;
-            case 3:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                break;
-            case 4:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                break;
-            case 5:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                break;
-            case 6:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                break;
-            case 7:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                break;
-            case 8:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                break;
-            case 9:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                break;
-            case 10:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                break;
-            case 11:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                break;
-            case 12:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                break;
-            case 13:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                break;
-            case 14:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_key += *(key_pos + ar[14]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                sum_value += *(value_pos + ar[14]);
-                break;
-            case 15:
-                sum_key += *(key_pos + ar[1]);
-                sum_key += *(key_pos + ar[2]);
-                sum_key += *(key_pos + ar[3]);
-                sum_key += *(key_pos + ar[4]);
-                sum_key += *(key_pos + ar[5]);
-                sum_key += *(key_pos + ar[6]);
-                sum_key += *(key_pos + ar[7]);
-                sum_key += *(key_pos + ar[8]);
-                sum_key += *(key_pos + ar[9]);
-                sum_key += *(key_pos + ar[10]);
-                sum_key += *(key_pos + ar[11]);
-                sum_key += *(key_pos + ar[12]);
-                sum_key += *(key_pos + ar[13]);
-                sum_key += *(key_pos + ar[14]);
-                sum_key += *(key_pos + ar[15]);
-                sum_value += *(value_pos + ar[1]);
-                sum_value += *(value_pos + ar[2]);
-                sum_value += *(value_pos + ar[3]);
-                sum_value += *(value_pos + ar[4]);
-                sum_value += *(value_pos + ar[5]);
-                sum_value += *(value_pos + ar[6]);
-                sum_value += *(value_pos + ar[7]);
-                sum_value += *(value_pos + ar[8]);
-                sum_value += *(value_pos + ar[9]);
-                sum_value += *(value_pos + ar[10]);
-                sum_value += *(value_pos + ar[11]);
-                sum_value += *(value_pos + ar[12]);
-                sum_value += *(value_pos + ar[13]);
-                sum_value += *(value_pos + ar[14]);
-                sum_value += *(value_pos + ar[15]);
-                break;
-            case 16:
-                sum_key += *key_pos;
-                sum_key += *(key_pos + 1);
-                sum_key += *(key_pos + 2);
-                sum_key += *(key_pos + 3);
-                sum_key += *(key_pos + 4);
-                sum_key += *(key_pos + 5);
-                sum_key += *(key_pos + 6);
-                sum_key += *(key_pos + 7);
-                sum_key += *(key_pos + 8);
-                sum_key += *(key_pos + 9);
-                sum_key += *(key_pos + 10);
-                sum_key += *(key_pos + 11);
-                sum_key += *(key_pos + 12);
-                sum_key += *(key_pos + 13);
-                sum_key += *(key_pos + 14);
-                sum_key += *(key_pos + 15);
-                sum_value += *value_pos;
-                sum_value += *(value_pos + 1);
-                sum_value += *(value_pos + 2);
-                sum_value += *(value_pos + 3);
-                sum_value += *(value_pos + 4);
-                sum_value += *(value_pos + 5);
-                sum_value += *(value_pos + 6);
-                sum_value += *(value_pos + 7);
-                sum_value += *(value_pos + 8);
-                sum_value += *(value_pos + 9);
-                sum_value += *(value_pos + 10);
-                sum_value += *(value_pos + 11);
-                sum_value += *(value_pos + 12);
-                sum_value += *(value_pos + 13);
-                sum_value += *(value_pos + 14);
-                sum_value += *(value_pos + 15);
-        }
-        if(*(key_pos + ar[offset]) > endKey){
-            while(offset > 0 && *(key_pos + ar[offset]) > endKey){
-                sum_key -= *(key_pos + ar[offset]);
-                sum_value -= *(value_pos + ar[offset]);
-                offset--;
+        }
+        if(++segPos == leaf->childCount){
+            leaf = leaf->nextLeaf;
+            segPos = 0;
+            if(leaf == NULL){
+                bits = 0;
+                position = -1;
+                return;
             }
-		    return {sum_key, sum_value};
-	    }
+        }
+        targetSegment = leaf->segNo[segPos];
+        from = 0;
     }
-    return {sum_key, sum_value};
 }
 
-void PMA::printSegElements(int targetSegment){
-    type_t * key = key_chunks[targetSegment];
-    type_t pBase = 0;
-    for(type_t block = 0; block<blocksInSegment; block++){
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::printSegElements(int targetSegment){
+    Key * key = key_chunks[targetSegment];
+    int64_t pBase = 0;
+    for(int64_t block = 0; block<blocksInSegment; block++){
         u_short bitpos = 1;
-        cout <<" Bitmap: "<<bitmap[targetSegment][block]<<" ";
-        for(type_t j = 0; j<JacobsonIndexSize; j++){
-            if(bitmap[targetSegment][block] & bitpos)
+        cout <<" Bitmap: "<<header[targetSegment].bitmap[block]<<" ";
+        for(int64_t j = 0; j<JacobsonIndexSize; j++){
+            if(header[targetSegment].bitmap[block] & bitpos)
                 cout << *(key+pBase+j) << " ";
             else cout <<"0 ";
             bitpos = bitpos << 1;
         }
         pBase += JacobsonIndexSize;
     }
-    cout<<"last offset: "<<lastElementPos[targetSegment] <<" Cardinality: "<<cardinality[targetSegment]<<" Total Segment: "<<totalSegments<< endl;
+    cout<<"last offset: "<<header[targetSegment].lastElementPos <<" Cardinality: "<<header[targetSegment].cardinality<<" Total Segment: "<<totalSegments<< endl;
 }
 
-void PMA::printStat(){
-    type_t totalElements = 0;
-    BPlusTree::leaf * leaf = tree->leftmostLeaf(tree->root);
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::printStat(){
+    int64_t totalElements = 0;
+    leaf_t * leaf = tree->leftmostLeaf(tree->root);
     while(leaf != NULL){
         for(int i=0; i<leaf->childCount; i++){
-            totalElements += cardinality[leaf->segNo[i]];
+            totalElements += header[leaf->segNo[i]].cardinality;
         }
         leaf = leaf->nextLeaf;
     }
-    //for(type_t i = 0; i<totalSegments; i++){
-    //    totalElements += cardinality[i];
+    //for(int64_t i = 0; i<totalSegments; i++){
+    //    totalElements += header[i].cardinality;
     //}
     cout<<"Tree Level: "<<tree->totalLevel<<endl;
     cout<<"Total elements: "<<totalElements<<endl;
     cout<<"Total Segment: "<<totalSegments<<", Free Segments: "<<freeSegmentCount<<", Elements in a Segment: "<<elementsInSegment<<endl;
-    cout<<"Redistribute with insert: "<<redisInsCount<<", Redistribute with update: "<<redisUpCount<<endl;
+    cout<<"Redistribute with insert: "<<redisInsCount<<", Redistribute with update: "<<redisUpCount<<", Window rebalance: "<<redisWindowCount<<endl;
+    cout<<"Memory per element: "<<(double)totalSegments * (elementsInSegment * (sizeof(Key) + (isSet ? 0 : sizeof(value_t))) + sizeof(segment)) / max(totalElements, (int64_t)1)<<" bytes"<<endl;
     //cout<<"Total Shift for insert: "<<totalShiftingInsert<<", total shift for rebalance: "<<totalShiftingReb<<endl;
 }
 
 
-BPlusTree::BPlusTree(PMA *obj){
+PMA_TEMPLATE
+BPlusTree<PMA_ARGS>::BPlusTree(pma_t *obj){
     root = NULL;
     calculateThreshold(obj->elementsInSegment);
 }
 
-void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
+/*
+    Replace the tree with one built bottom-up over segments, given in key order. Leaves and nodes are filled to three
+    quarters of Degree so the first inserts don't split them, and each level is spread evenly over its nodes
+ */
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::buildFromSegments(const vector<int> &segments, pma_t *obj){
+    const int fill = Degree * 3 / 4;
+    deleteNode(root);
+
+    //Leaves over the segments, with the smallest key under each leaf kept for the level above
+    size_t count = segments.size();
+    size_t groups = count <= Degree ? 1 : (count + fill - 1) / fill;
+    vector<void *> level(groups);
+    vector<Key> smallest(groups);
+    leaf *prev = NULL;
+    for(size_t g = 0; g<groups; g++){
+        size_t begin = count * g / groups, end = count * (g + 1) / groups;
+        leaf *l = new leaf();
+        for(size_t i = begin; i<end; i++){
+            l->segNo[i - begin] = segments[i];
+            if(i > begin) l->key[i - begin - 1] = obj->header[segments[i]].smallest;
+        }
+        l->childCount = end - begin;
+        if(l->childCount == 1) l->key[0] = numeric_limits<Key>::max();
+        if(prev != NULL) prev->nextLeaf = l;
+        l->prevLeaf = prev;
+        prev = l;
+        level[g] = l;
+        smallest[g] = obj->header[segments[begin]].smallest;
+    }
+
+    //Nodes level by level up to a single root. The root is always a node, even over a single leaf
+    bool nodeLeaf = true;
+    do{
+        count = level.size();
+        groups = count <= Degree ? 1 : (count + fill - 1) / fill;
+        vector<void *> upper(groups);
+        vector<Key> upperSmallest(groups);
+        for(size_t g = 0; g<groups; g++){
+            size_t begin = count * g / groups, end = count * (g + 1) / groups;
+            node *N = new node();
+            for(size_t i = begin; i<end; i++){
+                N->child_ptr[i - begin] = (node *)level[i];
+                if(i > begin) N->key[i - begin - 1] = smallest[i];
+            }
+            N->ptrCount = end - begin;
+            if(N->ptrCount == 1) N->key[0] = numeric_limits<Key>::max();
+            N->nodeLeaf = nodeLeaf;
+            setParent(N, 0, N->ptrCount);
+            refreshNode(N, obj);
+            upper[g] = N;
+            upperSmallest[g] = smallest[begin];
+        }
+        level.swap(upper);
+        smallest.swap(upperSmallest);
+        nodeLeaf = false;
+    }while(level.size() > 1);
+    root = (node *)level[0];
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::insertInTree(int chunkNo, Key search_key, pma_t *obj){
     if(UNLIKELY(root == NULL)){
         root = new Node();
         leaf *leafNode = new leaf();
         root->child_ptr[0] = (node *)leafNode;
-        root->key[0] = INT64_MAX;
+        root->key[0] = numeric_limits<Key>::max();
         root->ptrCount = 1;
         root->nodeLeaf = true;
 
         leafNode->segNo[0] = chunkNo;
-        leafNode->key[0] = INT64_MAX;
+        leafNode->key[0] = numeric_limits<Key>::max();
         leafNode->childCount = 1;
+        leafNode->parent = root;
+        refreshNode(root, obj);
         return;
     }
 
+    //The leaf stays locked until its parent routes to both halves of a split
     leaf *leaf = findLeaf(search_key);
-    if(leaf->childCount < Tree_Degree){ //insert in leaf
+    lockVersion(leaf->version);
+    if(leaf->childCount < Degree){ //insert in leaf
         if(leaf->childCount == 1){
             int segNo = leaf->segNo[0];
-            if(obj->smallest[segNo] > search_key){
+            if(obj->header[segNo].smallest > search_key){
                 leaf->segNo[1] = leaf->segNo[0];
                 leaf->segNo[0] = chunkNo;
-                leaf->key[0] = obj->smallest[segNo];
+                leaf->key[0] = obj->header[segNo].smallest;
             }else{
                 leaf->segNo[1] = chunkNo;
                 leaf->key[0] = search_key;
             }
             leaf->childCount = 2;
+            unlockVersion(leaf->version);
+            refreshLeaf(leaf, obj);
             return;
         }
         int position;
@@ -1281,34 +2510,38 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
             }
             else{
                 int segNo = leaf->segNo[position];
-                if(obj->smallest[segNo] > search_key){
+                if(obj->header[segNo].smallest > search_key){
                     leaf->segNo[position+1] = leaf->segNo[position];
                     leaf->segNo[position] = chunkNo;
-                    leaf->key[position] = obj->smallest[segNo];
+                    leaf->key[position] = obj->header[segNo].smallest;
                 }else{
                     leaf->segNo[position+1] = chunkNo;
                     leaf->key[position] = search_key;
                 }
                 leaf->childCount++;
+                unlockVersion(leaf->version);
+                refreshLeaf(leaf, obj);
                 return;
             }
         }
         int segNo = leaf->segNo[0];
-        if(obj->smallest[segNo] > search_key){
+        if(obj->header[segNo].smallest > search_key){
             leaf->segNo[1] = leaf->segNo[0];
             leaf->segNo[0] = chunkNo;
-            leaf->key[0] = obj->smallest[segNo];
+            leaf->key[0] = obj->header[segNo].smallest;
         }else{
             leaf->segNo[1] = chunkNo;
             leaf->key[0] = search_key;
         }
         leaf->childCount++;
+        unlockVersion(leaf->version);
+        refreshLeaf(leaf, obj);
         return;
     }
     //Leaf is not empty. Divide.
     //Copy the key-value pairs
-    type_t key_store[Tree_Degree+1];
-    int segNo_store[Tree_Degree+1];
+    Key key_store[Degree+1];
+    int segNo_store[Degree+1];
     int position;
     bool done = false;
     for(position = leaf->childCount-1; position>0; position--){
@@ -1317,10 +2550,10 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
             segNo_store[position + 1] = leaf->segNo[position];
         }else{
             int segNo = leaf->segNo[position];
-            if(obj->smallest[segNo] > search_key){
+            if(obj->header[segNo].smallest > search_key){
                 segNo_store[position+1] = leaf->segNo[position];
                 segNo_store[position] = chunkNo;
-                key_store[position] = obj->smallest[segNo];
+                key_store[position] = obj->header[segNo].smallest;
             }else{
                 segNo_store[position+1] = chunkNo;
                 segNo_store[position] = leaf->segNo[position];
@@ -1338,10 +2571,10 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
         }
     }else{
         int segNo = leaf->segNo[0];
-        if(obj->smallest[segNo] > search_key){
+        if(obj->header[segNo].smallest > search_key){
             segNo_store[position+1] = leaf->segNo[position];
             segNo_store[position] = chunkNo;
-            key_store[position] = obj->smallest[segNo];
+            key_store[position] = obj->header[segNo].smallest;
         }else{
             segNo_store[position+1] = chunkNo;
             segNo_store[position] = leaf->segNo[position];
@@ -1351,95 +2584,159 @@ void BPlusTree::insertInTree(int chunkNo, type_t search_key, PMA *obj){
 
     //Copying done. Create two nodes
     BPlusTree::leaf *newleaf = new BPlusTree::leaf();
-    for(int halfLeaf = 0; halfLeaf <= Tree_Degree/2; halfLeaf++){
+    for(int halfLeaf = 0; halfLeaf <= Degree/2; halfLeaf++){
         leaf->segNo[halfLeaf] = segNo_store[halfLeaf];
         leaf->key[halfLeaf] = key_store[halfLeaf];
     }
-    for(int nextHalf = Tree_Degree/2 + 1, index = 0; nextHalf <= Tree_Degree; nextHalf++, index++){
+    for(int nextHalf = Degree/2 + 1, index = 0; nextHalf <= Degree; nextHalf++, index++){
         newleaf->segNo[index] = segNo_store[nextHalf];
         newleaf->key[index] = key_store[nextHalf];
     }
-    leaf->childCount = Tree_Degree/2 + 1;
-    newleaf->childCount = Tree_Degree + 1 - leaf->childCount;
+    leaf->childCount = Degree/2 + 1;
+    newleaf->childCount = Degree + 1 - leaf->childCount;
     newleaf->nextLeaf = leaf->nextLeaf;
+    newleaf->prevLeaf = leaf;
+    if(leaf->nextLeaf != NULL){
+        lockVersion(leaf->nextLeaf->version);
+        leaf->nextLeaf->prevLeaf = newleaf;
+        unlockVersion(leaf->nextLeaf->version);
+    }
     leaf->nextLeaf = newleaf;
-    type_t key_parent = obj->smallest[leaf->segNo[0]];
-    insert_in_parent(leaf,key_store[Tree_Degree/2],newleaf, key_parent);
+    insert_in_parent(leaf, key_store[Degree/2], newleaf, obj);
+    unlockVersion(leaf->version);
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::insert_in_parent(leaf *left, Key search_key, leaf *right, pma_t *obj){
+    //A leaf always has a parent as the root is a node
+    right->parent = left->parent;
+    insertInNode(left->parent, left, search_key, right, obj);
 }
 
-void BPlusTree::insert_in_parent(void *left, type_t search_key, void *right, type_t key_parent){
-    if(left == root || right == root){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::insert_in_parent(node *left, Key search_key, node *right, pma_t *obj){
+    if(left->parent == NULL){
         node *N = new node();
-        N->child_ptr[0] = (node *)left;
-        N->child_ptr[1] = (node *)right;
+        N->child_ptr[0] = left;
+        N->child_ptr[1] = right;
         N->key[0] = search_key; 
         N->ptrCount = 2;
-        root = N;
+        setParent(N, 0, 2);
+        __atomic_store_n(&root, N, __ATOMIC_RELEASE);
+        refreshNode(N, obj);
         return;
     }
-    node *N = findParent(root, left, key_parent);
-    if(N->ptrCount < Tree_Degree){
+    right->parent = left->parent;
+    insertInNode(left->parent, left, search_key, right, obj);
+}
+
+//Set the parent link of children [from, to) of a node to the node itself, and their slots to where they now are
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::setParent(node *parent, int from, int to){
+    if(parent->nodeLeaf){
+        for(int i = from; i<to; i++){
+            ((leaf *)parent->child_ptr[i])->parent = parent;
+            ((leaf *)parent->child_ptr[i])->slot = i;
+        }
+    }else{
+        for(int i = from; i<to; i++){
+            parent->child_ptr[i]->parent = parent;
+            parent->child_ptr[i]->slot = i;
+        }
+    }
+}
+
+//Add right next to left in node N. Divide N if it is already full
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::insertInNode(node *N, void *left, Key search_key, void *right, pma_t *obj){
+    lockVersion(N->version);
+    if(N->ptrCount < Degree){
         for(int position = N->ptrCount-1; position >= 0; position--){
             if(N->child_ptr[position] == left){
                 N->child_ptr[position+1] = (node *)right;
                 N->key[position] = search_key;
                 N->ptrCount++;
+                setParent(N, position+1, N->ptrCount);
+                unlockVersion(N->version);
+                N->agg[position] = childAggregate(left, N->nodeLeaf, obj);
+                N->agg[position+1] = childAggregate(right, N->nodeLeaf, obj);
+                refreshUp(N);
                 return;
             }else{
                 N->child_ptr[position+1] = N->child_ptr[position];
+                N->agg[position+1] = N->agg[position];
                 N->key[position] = N->key[position-1];
             }
         }
         cout<<"Program should never reach here. Insert in Parent node of B+ Tree"<<endl;
         exit(0);
     }
-    type_t key_store[Tree_Degree+1];
-    Node *ptr_store[Tree_Degree+1];
+    Key key_store[Degree+1];
+    Node *ptr_store[Degree+1];
+    Aggregate agg_store[Degree+1];
     int position;
     bool done = false;
     for(position = N->ptrCount-1; position >= 0; position--){
         if(N->child_ptr[position] == left){
             ptr_store[position+1] = (node *) right;
             ptr_store[position] = N->child_ptr[position];
+            agg_store[position+1] = childAggregate(right, N->nodeLeaf, obj);
+            agg_store[position] = childAggregate(left, N->nodeLeaf, obj);
             key_store[position] = search_key;
             done = true;
         }else if(done){
             ptr_store[position] = N->child_ptr[position];
+            agg_store[position] = N->agg[position];
             key_store[position] = N->key[position];
         }else{
             ptr_store[position+1] = N->child_ptr[position];
+            agg_store[position+1] = N->agg[position];
             key_store[position] = N->key[position-1];
         }
     }
 
     //Spilit records into two nodes
     node *N2 = new node();
-    for(int half = 0; half <= Tree_Degree/2; half++){
+    for(int half = 0; half <= Degree/2; half++){
         N->child_ptr[half] = ptr_store[half];
+        N->agg[half] = agg_store[half];
         N->key[half] = key_store[half];
     }
-    for(int nextHalf = Tree_Degree/2 + 1, index = 0; nextHalf <= Tree_Degree; nextHalf++, index++){
+    for(int nextHalf = Degree/2 + 1, index = 0; nextHalf <= Degree; nextHalf++, index++){
         N2->child_ptr[index] = ptr_store[nextHalf];
+        N2->agg[index] = agg_store[nextHalf];
         N2->key[index] = key_store[nextHalf];
     }
-    N->ptrCount = Tree_Degree/2 + 1;
-    N2->ptrCount = Tree_Degree + 1 - N->ptrCount;
+    N->ptrCount = Degree/2 + 1;
+    N2->ptrCount = Degree + 1 - N->ptrCount;
     N2->nodeLeaf = N->nodeLeaf;
-    insert_in_parent(N, key_store[Tree_Degree/2], N2, key_parent);
+    setParent(N, 0, N->ptrCount);
+    setParent(N2, 0, N2->ptrCount);
+    insert_in_parent(N, key_store[Degree/2], N2, obj);
+    unlockVersion(N->version);
 }
 
-void BPlusTree::rebalanceOnDelete(leaf *p, type_t key){
-    node *n = findParent(root, p, key);
-    if(UNLIKELY(n->ptrCount==1)) return;
-    int loc = 0;
-    for( ; loc < n->ptrCount; loc++) if(n->child_ptr[loc] == (node *)p) break;
+//Merge leaf p with a sibling, or move a segment over from it. Returns the leaf that holds the segments of p afterwards
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::rebalanceOnDelete(leaf *p, Key key, pma_t *obj){
+    node *n = p->parent;
+    if(UNLIKELY(n->ptrCount==1)) return p;
+    int loc = p->slot;
     //check if leaves can be combined
     leaf * prev = loc > 0 ? (leaf *) n->child_ptr[loc-1] : p;
     leaf * next = prev == p ? (leaf *) n->child_ptr[loc+1]: p;
     if(loc == 0) key = n->key[loc];
     else key = n->key[loc-1];
-    if(prev->childCount + next->childCount < Tree_Degree){
+    lockVersion(n->version);
+    lockVersion(prev->version);
+    lockVersion(next->version);
+    if(prev->childCount + next->childCount < Degree){
         prev->nextLeaf = next->nextLeaf;
+        if(next->nextLeaf != NULL){
+            lockVersion(next->nextLeaf->version);
+            next->nextLeaf->prevLeaf = prev;
+            unlockVersion(next->nextLeaf->version);
+        }
         prev->key[prev->childCount-1] = key;
         for(int j = 0; j<next->childCount-1; j++){
             prev->key[prev->childCount+j] = next->key[j];
@@ -1450,12 +2747,19 @@ void BPlusTree::rebalanceOnDelete(leaf *p, type_t key){
         
         for(int pos = loc>0 ? loc+1: loc+2 ; pos<n->ptrCount; pos++){
             n->child_ptr[pos-1] = n->child_ptr[pos];
+            n->agg[pos-1] = n->agg[pos];
             n->key[pos-2] = n->key[pos-1];
         }
-        delete next;
         n->ptrCount--;
-        if(n->ptrCount < Tree_Degree/2) rebalanceOnDelete(n, key);
-        return;
+        setParent(n, loc>0 ? loc : loc+1, n->ptrCount);
+        n->agg[loc>0 ? loc-1 : loc] = leafAggregate(prev, obj);
+        refreshUp(n);
+        unlockVersion(next->version);
+        unlockVersion(prev->version);
+        unlockVersion(n->version);
+        retire(next);
+        if(n->ptrCount < Degree/2) rebalanceOnDelete(n, key, obj);
+        return prev;
     }
     //Not mergeable: redistribute with neighbor
     if(loc>0){ //get a key-value pair from left segment
@@ -1467,7 +2771,13 @@ void BPlusTree::rebalanceOnDelete(leaf *p, type_t key){
         n->key[loc-1] = prev->key[prev->childCount-2];
         next->segNo[0] = prev->segNo[prev->childCount-1];
         prev->childCount--; next->childCount++;
-        return;
+        n->agg[loc-1] = leafAggregate(prev, obj);
+        n->agg[loc] = leafAggregate(next, obj);
+        refreshUp(n);
+        unlockVersion(next->version);
+        unlockVersion(prev->version);
+        unlockVersion(n->version);
+        return p;
     }
     //Get a key-value pair from the right segment
 
@@ -1481,20 +2791,30 @@ void BPlusTree::rebalanceOnDelete(leaf *p, type_t key){
     }
     next->childCount--;
     next->segNo[next->childCount-1] = next->segNo[next->childCount];
+    n->agg[loc] = leafAggregate(prev, obj);
+    n->agg[loc+1] = leafAggregate(next, obj);
+    refreshUp(n);
+    unlockVersion(next->version);
+    unlockVersion(prev->version);
+    unlockVersion(n->version);
+    return p;
 }
 
-void BPlusTree::rebalanceOnDelete(node *p, type_t key){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::rebalanceOnDelete(node *p, Key key, pma_t *obj){
     //CHECK THE VERY FIRST CONDITION
-    node *n = findParent(root, p, key);
+    node *n = p->parent;
     if(UNLIKELY(n == NULL || n->ptrCount == 1)){
-        if(n == root && !n->nodeLeaf) {
-            root = p;
-            delete n;
+        if(n != NULL && n->parent == NULL && !n->nodeLeaf) {
+            lockVersion(n->version);
+            __atomic_store_n(&root, p, __ATOMIC_RELEASE);
+            p->parent = NULL;
+            unlockVersion(n->version);
+            retire(n);
         }
         return;
     }
-    int loc = 0;
-    for( ; loc < n->ptrCount; loc++) if(n->child_ptr[loc] == p) break;
+    int loc = p->slot;
     //If the current node is leaf-parent and the siblings are not... then do nothing
     node *prev = NULL, *next = NULL;
     if(loc>0 && n->child_ptr[loc-1]->nodeLeaf == p->nodeLeaf){        
@@ -1507,81 +2827,329 @@ void BPlusTree::rebalanceOnDelete(node *p, type_t key){
         key = n->key[loc];
     }else return; //Got no same status sibling
 
-    if(prev->ptrCount + next->ptrCount < Tree_Degree){
+    lockVersion(n->version);
+    lockVersion(prev->version);
+    lockVersion(next->version);
+    if(prev->ptrCount + next->ptrCount < Degree){
         prev->key[prev->ptrCount-1] = key;
         for(int j = 0; j<next->ptrCount-1; j++){
             prev->key[prev->ptrCount+j] = next->key[j];
             prev->child_ptr[prev->ptrCount+j] = next->child_ptr[j];
+            prev->agg[prev->ptrCount+j] = next->agg[j];
         }
         prev->ptrCount += next->ptrCount;
         prev->child_ptr[prev->ptrCount-1] = next->child_ptr[next->ptrCount-1];
+        prev->agg[prev->ptrCount-1] = next->agg[next->ptrCount-1];
+        setParent(prev, prev->ptrCount - next->ptrCount, prev->ptrCount);
         for(int pos = loc>0? loc+1: loc+2; pos<n->ptrCount; pos++){
             n->child_ptr[pos-1] = n->child_ptr[pos];
+            n->agg[pos-1] = n->agg[pos];
             n->key[pos-2] = n->key[pos-1];
         }
-        delete next;
         n->ptrCount--;
-        if(n->ptrCount < Tree_Degree/2) rebalanceOnDelete(n, key);
+        setParent(n, loc>0 ? loc : loc+1, n->ptrCount);
+        n->agg[loc>0 ? loc-1 : loc] = nodeAggregate(prev);
+        refreshUp(n);
+        unlockVersion(next->version);
+        unlockVersion(prev->version);
+        unlockVersion(n->version);
+        retire(next);
+        if(n->ptrCount < Degree/2) rebalanceOnDelete(n, key, obj);
         return;
     }
     //Not mergeable: redistribute with neighbor
     if(loc>0){ //get a key-value pair from left segment
         for(int i=next->ptrCount-1; i>0; i--){
             next->child_ptr[i+1] = next->child_ptr[i];
+            next->agg[i+1] = next->agg[i];
             next->key[i] = next->key[i-1];
         }next->child_ptr[1] = next->child_ptr[0];
+        next->agg[1] = next->agg[0];
         next->key[0] = key;
         n->key[loc-1] = prev->key[prev->ptrCount-2];
         next->child_ptr[0] = prev->child_ptr[prev->ptrCount-1];
+        next->agg[0] = prev->agg[prev->ptrCount-1];
         prev->ptrCount--; next->ptrCount++;
+        setParent(next, 0, next->ptrCount);
+        n->agg[loc-1] = nodeAggregate(prev);
+        n->agg[loc] = nodeAggregate(next);
+        refreshUp(n);
+        unlockVersion(next->version);
+        unlockVersion(prev->version);
+        unlockVersion(n->version);
         return;
     }
     //Get a key-value pair from the right segment
 
     prev->child_ptr[prev->ptrCount] = next->child_ptr[0];
+    prev->agg[prev->ptrCount] = next->agg[0];
     prev->key[prev->ptrCount-1] = key;
     prev->ptrCount++;
+    setParent(prev, prev->ptrCount-1, prev->ptrCount);
     n->key[loc] = next->key[0];
     for(int i=1; i < next->ptrCount-1; i++){
         next->child_ptr[i-1] = next->child_ptr[i];
+        next->agg[i-1] = next->agg[i];
         next->key[i-1] = next->key[i];
     }
-    next->ptrCount--;
-    next->child_ptr[next->ptrCount-1] = next->child_ptr[next->ptrCount];
+    next->ptrCount--;
+    next->child_ptr[next->ptrCount-1] = next->child_ptr[next->ptrCount];
+    next->agg[next->ptrCount-1] = next->agg[next->ptrCount];
+    setParent(next, 0, next->ptrCount);
+    n->agg[loc] = nodeAggregate(prev);
+    n->agg[loc+1] = nodeAggregate(next);
+    refreshUp(n);
+    unlockVersion(next->version);
+    unlockVersion(prev->version);
+    unlockVersion(n->version);
+}
+
+//Aggregate of the segments of a leaf. Empty, with the aggregates marked stale, while they are not kept
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::Aggregate BPlusTree<PMA_ARGS>::leafAggregate(leaf *l, pma_t *obj){
+    Aggregate total;
+    if(UNLIKELY(!keepAggregates)){
+        markStale();
+        return total;
+    }
+    for(int i = 0; i<l->childCount; i++) total.add(obj->segmentAggregate(l->segNo[i]));
+    return total;
+}
+
+//Aggregate of the children of a node
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::Aggregate BPlusTree<PMA_ARGS>::nodeAggregate(node *n){
+    Aggregate total;
+    if(UNLIKELY(!keepAggregates)){
+        markStale();
+        return total;
+    }
+    for(int i = 0; i<n->ptrCount; i++) total.add(n->agg[i]);
+    return total;
+}
+
+//Aggregate of a child of a node, a leaf if isLeaf, computed from the child itself
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::Aggregate BPlusTree<PMA_ARGS>::childAggregate(void *child, bool isLeaf, pma_t *obj){
+    return isLeaf ? leafAggregate((leaf *)child, obj) : nodeAggregate((node *)child);
+}
+
+//Recompute the aggregates of all children of n. Used after children are moved, split or merged
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::refreshNode(node *n, pma_t *obj){
+    for(int i = 0; i<n->ptrCount; i++) n->agg[i] = childAggregate(n->child_ptr[i], n->nodeLeaf, obj);
+}
+
+//Carry the aggregate of n into the nodes above it
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::refreshUp(node *n){
+    if(UNLIKELY(!keepAggregates)) return markStale();
+    for(node *parent = n->parent; parent != NULL; n = parent, parent = parent->parent){
+        parent->agg[n->slot] = nodeAggregate(n);
+    }
+}
+
+//Recompute the aggregate of leaf l from its segments and carry it up to the root
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::refreshLeaf(leaf *l, pma_t *obj){
+    if(UNLIKELY(!keepAggregates)) return markStale();
+    l->parent->agg[l->slot] = leafAggregate(l, obj);
+    refreshUp(l->parent);
+}
+
+/*
+    Add (sign 1) or take out (sign -1) a pair of a segment of leaf l in the aggregates on the way to the root. Taking
+    out a bound of a child recomputes the child's aggregate, below which the pair is already gone
+ */
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::propagate(leaf *l, Key key, int64_t value, int sign, pma_t *obj){
+    if(UNLIKELY(!keepAggregates)) return markStale();
+    node *child = (node *)l;
+    int slot = l->slot;
+    for(node *n = l->parent; n != NULL; slot = n->slot, child = n, n = n->parent){
+        Aggregate &a = n->agg[slot];
+        if(sign > 0){
+            a.count++; a.keySum += key; a.valueSum += value;
+            if(key < a.min) a.min = key;
+            if(key > a.max) a.max = key;
+        }else if(UNLIKELY(key == a.min || key == a.max)){
+            a = n->nodeLeaf ? leafAggregate(l, obj) : nodeAggregate(child);
+        }else{
+            a.count--; a.keySum -= key; a.valueSum -= value;
+        }
+    }
+}
+
+//Move the value sums on the way from leaf l to the root by delta. Counts and key bounds stay
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::propagateValue(leaf *l, int64_t delta){
+    if(UNLIKELY(!keepAggregates)) return markStale();
+    int slot = l->slot;
+    for(node *n = l->parent; n != NULL; slot = n->slot, n = n->parent) n->agg[slot].valueSum += delta;
+}
+
+//Flag the aggregates for a rebuild. Written once, so threads sharing the tree only read the flag afterwards
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::markStale(){
+    if(!__atomic_load_n(&staleAggregates, __ATOMIC_RELAXED)) __atomic_store_n(&staleAggregates, true, __ATOMIC_RELAXED);
+}
+
+//Rebuild the aggregates if changes made while they were not kept left them stale. Called by the calls reading them
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::freshAggregates(pma_t *obj){
+    if(LIKELY(!staleAggregates)) return;
+    bool keep = keepAggregates;
+    keepAggregates = true;
+    rebuildAggregates(root, obj);
+    keepAggregates = keep;
+    staleAggregates = false;
+}
+
+//Recompute the aggregates of the subtree of n bottom up
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::rebuildAggregates(node *n, pma_t *obj){
+    if(!n->nodeLeaf) for(int i = 0; i<n->ptrCount; i++) rebuildAggregates(n->child_ptr[i], obj);
+    refreshNode(n, obj);
+}
+
+/*
+    Leaf of search_key without locks, for readers racing the writers that split and merge. Each node is read between two
+    loads of its version, and its child is only entered once the node is known not to have moved. leafVersion is the
+    version of the leaf on arrival, for the caller to check again after reading it
+ */
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::descendOptimistic(Key search_key, uint64_t &leafVersion){
+    while(true){
+        node *n = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+        uint64_t version = stableVersion(n->version);
+        if(__atomic_load_n(&root, __ATOMIC_ACQUIRE) != n) continue;
+        while(true){
+            node *child = n->child_ptr[childPosition<Degree>(n->key, n->ptrCount - 1, search_key)];
+            bool nodeLeaf = n->nodeLeaf;
+            if(!unchanged(n->version, version)) break;
+            uint64_t childVersion = stableVersion(nodeLeaf ? ((leaf *)child)->version : child->version);
+            if(!unchanged(n->version, version)) break;
+            if(nodeLeaf){
+                leafVersion = childVersion;
+                return (leaf *)child;
+            }
+            n = child;
+            version = childVersion;
+        }
+    }
+}
+
+//Even version to check a read against, once no writer holds the node
+PMA_TEMPLATE
+uint64_t BPlusTree<PMA_ARGS>::stableVersion(const uint64_t &version){
+    while(true){
+        uint64_t seen = __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+        if(!(seen & 1)) return seen;
+        this_thread::yield();
+    }
+}
+
+//True if no writer held the node since stableVersion returned seen
+PMA_TEMPLATE
+bool BPlusTree<PMA_ARGS>::unchanged(const uint64_t &version, uint64_t seen){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&version, __ATOMIC_RELAXED) == seen;
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::lockVersion(uint64_t &version){
+    while(true){
+        uint64_t seen = __atomic_load_n(&version, __ATOMIC_RELAXED);
+        if(!(seen & 1) && __atomic_compare_exchange_n(&version, &seen, seen + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        this_thread::yield();
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::unlockVersion(uint64_t &version){
+    __atomic_fetch_add(&version, 1, __ATOMIC_RELEASE);
 }
 
-BPlusTree::node* BPlusTree::findParent(node *r, void *n, type_t search_key){
-    if(n == r) return NULL; //Root will return null as parent
-    for(int position = r->ptrCount-1; position>0; position--){
-        if(r->key[position-1] <= search_key){
-            if(n == r->child_ptr[position]) return r;
-            return findParent(r->child_ptr[position], n, search_key);
+/*
+    Leaf of search_key for a writer that may split (removing false) or merge (removing true) the leaves and nodes on its
+    way, while other writers do the same elsewhere. Writer latches are taken from the root pointer down, each while the
+    one above is held. A child with room for one more, when inserting, or with more than Degree/2 children, when
+    removing, takes in the change of its child without passing it up, so the latches above it are let go. A remove also
+    latches the neighbour a child it keeps latched would merge with or borrow from. held gets the latches still held
+ */
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::latchPath(Key search_key, bool removing, vector<bool *> &held){
+    latch(rootWriter);
+    held.push_back(&rootWriter);
+    node *n = root;
+    latch(n->writer);
+    //The root only moves when it splits, or when it is left with one child that merges below it
+    if(removing ? n->ptrCount > 1 : n->ptrCount < Degree) unlatchAll(held);
+    held.push_back(&n->writer);
+    while(true){
+        int c = childPosition<Degree>(n->key, n->ptrCount - 1, search_key);
+        int neighbour = c > 0 ? c - 1 : c + 1;
+        if(n->nodeLeaf){
+            leaf *l = (leaf *)n->child_ptr[c];
+            latch(l->writer);
+            if(removing ? l->childCount > Degree/2 : l->childCount < Degree) unlatchAll(held);
+            else if(removing && neighbour < n->ptrCount){
+                leaf *other = (leaf *)n->child_ptr[neighbour];
+                latch(other->writer);
+                held.push_back(&other->writer);
+            }
+            held.push_back(&l->writer);
+            return l;
         }
+        node *child = n->child_ptr[c];
+        latch(child->writer);
+        if(removing ? child->ptrCount > Degree/2 : child->ptrCount < Degree) unlatchAll(held);
+        else if(removing && neighbour < n->ptrCount){
+            node *other = n->child_ptr[neighbour];
+            latch(other->writer);
+            held.push_back(&other->writer);
+        }
+        held.push_back(&child->writer);
+        n = child;
     }
-    if(n == r->child_ptr[0]) return r;
-    return findParent(r->child_ptr[0], n, search_key);
 }
 
-BPlusTree::leaf* BPlusTree::findLeaf(type_t search_key){
+//Wait for the writer latch of a leaf or node. Holders never wait on a latch above the ones they hold
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::latch(bool &writer){
+    while(__atomic_load_n(&writer, __ATOMIC_RELAXED) || __atomic_exchange_n(&writer, true, __ATOMIC_ACQUIRE)) this_thread::yield();
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::unlatchAll(vector<bool *> &held){
+    for(bool *writer : held) __atomic_store_n(writer, false, __ATOMIC_RELEASE);
+    held.clear();
+}
+
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::findLeaf(Key search_key){
+    //Writers sharing the tree change the nodes above the ones a restructuring writer holds under it
+    if(UNLIKELY(shared)){
+        uint64_t leafVersion;
+        return descendOptimistic(search_key, leafVersion);
+    }
     node *temp = root;
+    descentCount++;
     while(!temp->nodeLeaf){
-        int smallest;
-        for(smallest = temp->ptrCount - 1; smallest > 0; smallest--){
-            if(temp->key[smallest-1] <= search_key) break;
-        }
-        temp = temp->child_ptr[smallest];
-    }
-    for(int smallest = temp->ptrCount - 1; smallest > 0; smallest--){
-        if(temp->key[smallest-1] <= search_key) return (leaf *)temp->child_ptr[smallest];
+        temp = temp->child_ptr[childPosition<Degree>(temp->key, temp->ptrCount - 1, search_key)];
+        nodeVisitCount++;
     }
-    return (leaf *)temp->child_ptr[0];
+    nodeVisitCount++;
+    return (leaf *)temp->child_ptr[childPosition<Degree>(temp->key, temp->ptrCount - 1, search_key)];
 }
 
-BPlusTree::leaf* BPlusTree::findLeftSiblingLeaf(void *cur, int key){
-    node * temp = findParent(root, cur, key);
-    if(temp->child_ptr[0] == cur){
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::findLeftSiblingLeaf(leaf *cur){
+    node * temp = cur->parent;
+    if(temp->child_ptr[0] == (node *)cur){
         while(true){
-            node * temp2 = findParent(root, temp, key);
+            node * temp2 = temp->parent;
             if(temp2 == NULL) return NULL;
             if(temp2->child_ptr[0] != temp){
                 for(int i=1; i<temp2->ptrCount; i++){
@@ -1592,23 +3160,21 @@ BPlusTree::leaf* BPlusTree::findLeftSiblingLeaf(void *cur, int key){
         }
     }
     for(int i = 1; i<temp->ptrCount; i++){
-        if(temp->child_ptr[i] == cur) return (leaf *)temp->child_ptr[i-1];
+        if(temp->child_ptr[i] == (node *)cur) return (leaf *)temp->child_ptr[i-1];
     }
     return NULL;
 }
 
-int BPlusTree::searchSegment(type_t search_key){
+PMA_TEMPLATE
+int BPlusTree<PMA_ARGS>::searchSegment(Key search_key){
     leaf *leaf = findLeaf(search_key);
-    if(leaf->childCount == 1) return leaf->segNo[0];
-    for(int smallest = leaf->childCount - 1; smallest > 0; smallest--){
-        if(leaf->key[smallest-1] <= search_key) return leaf->segNo[smallest];
-    }
-    return leaf->segNo[0];
+    return leaf->segNo[childPosition<Degree>(leaf->key, leaf->childCount - 1, search_key)];
 }
 
-void BPlusTree::calculateThreshold(int elements){
-    int estSegments = INT32_MAX/(SEGMENT_SIZE/sizeof(type_t));
-    totalLevel = (int)(ceil((log(estSegments)/log(Tree_Degree))));
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::calculateThreshold(int elements){
+    int estSegments = INT32_MAX/elements;
+    totalLevel = (int)(ceil((log(estSegments)/log(Degree))));
     maxLevel = (double *) malloc(sizeof(double) * (totalLevel+1));
     minLevel = (double *) malloc(sizeof(double) * (totalLevel+1));
 
@@ -1621,188 +3187,80 @@ void BPlusTree::calculateThreshold(int elements){
     }
 }
 
-void PMA::redistributeInsert(int segment, type_t SKey){ 
-    int segNo = redistributeWithDividing(segment);
-    tree->insertInTree(segNo, smallest[segNo], this);
-    //return;
-    /*
-    BPlusTree::leaf * leaf=tree->findLeaf(SKey);
-    if(UNLIKELY(leaf->childCount == 1)){
-        redisInsCount++;
-        int segNo = redistributeWithDividing(segment);
-        tree->insertInTree(segNo, smallest[segNo], this);
-        return;
-    }
+/*
+    Rebalance an overflowing segment. With window rebalancing, the aligned windows of 2, 4, 8... segments around it in its
+    leaf are tried in turn and the first one within the density threshold of its level is spread evenly over its own
+    segments. The segment is split in two when no window in the leaf can take the extra elements, or always with
+    split-only rebalancing
+ */
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::redistributeInsert(int segment, Key SKey){
+#if Rebalance_type == 2
+    leaf_t * leaf = tree->findLeaf(SKey);
     int pos = tree->findInLeaf(leaf, SKey);
-    int start, end, totalElements;
-    start = pos>0 ? pos-1 : pos;
-    end = start == pos? pos+1 : pos;
-    totalElements = cardinality[leaf->segNo[start]]+cardinality[leaf->segNo[end]];
-    if(totalElements > tree->maxLevel[1]){
-        redisUpCount++;
-        int startLeft, endRight, curLevel = 1;
-        while(true){
-            int elementCount = totalElements, startCur = start, endCur = end;
-            startLeft = endRight = pow(2, curLevel-1);
-            if(startCur - startLeft < 0 ){ 
-                endRight += (startLeft - startCur); 
-                startLeft = startCur; 
-            }
-            if(endCur + endRight >= leaf->childCount) {
-                startLeft += (endRight-(leaf->childCount - (endCur + 1)));
-                endRight = leaf->childCount - (endCur + 1);
-            }
-
-            for(startCur--, startLeft--; startCur>=0 && startLeft >= 0; startCur--, startLeft--){
-                elementCount += cardinality[leaf->segNo[startCur]];
-            }
-            startCur++;
-            for(endCur++, endRight--; endCur < leaf->childCount && endRight >= 0; endCur++, endRight-- ){
-                elementCount += cardinality[leaf->segNo[endCur]];
+    if(LIKELY(leaf->segNo[pos] == segment)){
+        for(int level = 1, window = 2; window < 2 * leaf->childCount && level <= tree->totalLevel; level++, window *= 2){
+            int start = pos / window * window;
+            int end = min(start + window, (int)leaf->childCount) - 1;
+            int64_t totalElements = 0;
+            for(int i = start; i <= end; i++) totalElements += header[leaf->segNo[i]].cardinality + header[leaf->segNo[i]].buffered;
+            //Thresholds of a level are for a full window of 2^level segments, scale them to the segments at hand
+            if(totalElements <= tree->maxLevel[level] * (end - start + 1) / window){
+                for(int i = start; i <= end; i++) settleBuffer(leaf->segNo[i]);
+                __atomic_fetch_add(&redisWindowCount, 1, __ATOMIC_RELAXED);
+                redistributeNToM(leaf, start, end, totalElements);
+                return;
             }
-            endCur--;
-            //cout<<"startCur: "<<startCur<<" endCur: "<<endCur<<" totalEle: "<<elementCount<<endl;
-            if(elementCount <= tree->maxLevel[curLevel+1] || startLeft >= 0 || endRight >= 0) break;
-            curLevel++; start = startCur; end = endCur; totalElements = elementCount;
-        }
-        //cout<<"start: "<<start<<" end: "<<end<<" totalEle: "<<totalElements<<" startLeft: "<<startLeft<<" endRight: "<<endRight<<endl;
-        if(startLeft >=0 || endRight >= 0){
-            //cout<<"Got inside Full Leaf! Leaf Child: "<<leaf->childCount<<endl;
-            type_t allElements = 0;
-            for(int i=0; i<leaf->childCount; i++) allElements += cardinality[leaf->segNo[i]];
-            int limitElement = (tree->maxLevel[curLevel]*leaf->childCount) / pow(2, curLevel);
-            if(limitElement < allElements) return redistributeNToM(leaf, 0, leaf->childCount-1, allElements);
-            return redistributeNToM(leaf, start, end, (type_t)totalElements);
-        }
-        else redistributeNToM(leaf, start, end, (type_t)totalElements);
-    }else{
-        redisInsCount++;
-        int segNo = redistributeWithDividing(segment);
-        tree->insertInTree(segNo, smallest[segNo], this);
+        }
     }
-    */
+#endif
+    __atomic_fetch_add(&redisInsCount, 1, __ATOMIC_RELAXED);
+    int segNo = redistributeWithDividing(segment);
+    tree->insertInTree(segNo, header[segNo].smallest, this);
 }
 
-void PMA::redistributeNToM(BPlusTree::leaf *p, int start, int end, type_t totalElements){
-    double capacity = elementsInSegment * 0.5;
-    vector<int> newSegments;
-    int curSegment = getSegment();
-    newSegments.push_back(curSegment);
-    int curCount = min((type_t)capacity, totalElements);
-    totalElements -= capacity;
-    cardinality[curSegment] = capacity;
-    type_t *moveKeyOffset, *moveValOffset;
-    type_t *destKeyOffset = key_chunks[curSegment];
-    type_t *destValOffset = value_chunks[curSegment];
-    u_char * ar = NonZeroEntries[bitmap[p->segNo[start]][0]];
-    type_t j=0, lastInsertKey = 0;
+//Spread the totalElements elements of segments start to end of leaf p evenly over the same segments
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::redistributeNToM(leaf_t *p, int start, int end, int64_t totalElements){
+    vector<Key> keys;
+    vector<value_t> values;
+    keys.reserve(totalElements);
+    if(!isSet) values.reserve(totalElements);
+    gatherSegments(p, start, end, keys, values);
+    spreadSegments(p, start, end, keys.data(), valuesFrom(values.data(), 0), totalElements);
+}
 
+//Lay count sorted pairs evenly over the emptied segments start to end of leaf p
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::spreadSegments(leaf_t *p, int start, int end, const Key *keys, const value_t *values, int64_t count){
+    //The separator before start still bounds the window, the ones inside it follow the new smallest keys
+    int segments = end - start + 1;
+    tree_t::lockVersion(p->version);
     for(int segPos = start; segPos<=end; segPos++){
-        int movSegment = p->segNo[segPos];
-
-        moveKeyOffset = key_chunks[movSegment];
-        moveValOffset = value_chunks[movSegment];
-        for(int blockNo = 0; blockNo < blocksInSegment; blockNo++){
-            ar = NonZeroEntries[bitmap[movSegment][blockNo]];
-            for(int i=1; i<=ar[0]; i++){
-                type_t current_element = *(moveKeyOffset + ar[i]);
-                j += min((lastValidPos - j) - curCount, min(current_element - lastInsertKey, (type_t)MaxGap));
-                *(destKeyOffset + j) = lastInsertKey = current_element;
-                *(destValOffset + j) = *(moveValOffset + ar[i]);
-                int blockPosition = j / JacobsonIndexSize;
-                int bitPosition = j % JacobsonIndexSize;
-                u_short mask = 1 << bitPosition;
-                bitmap[curSegment][blockPosition] |= mask;
-                curCount--;
-                if(curCount == 0){
-                    lastElementPos[curSegment] = j;
-                    //Load a new segment
-                    if(totalElements > 0){
-                        curCount = min((type_t)capacity, totalElements);
-                        totalElements -= curCount;
-                        j = 0;
-                        curSegment = getSegment();
-                        newSegments.push_back(curSegment);
-                        cardinality[curSegment] = curCount;
-                        destKeyOffset = key_chunks[curSegment];
-                        destValOffset = value_chunks[curSegment];
-                    }
-                }
-            }
-            //bitmap[movSegment][blockNo] = 0;
-            moveKeyOffset += JacobsonIndexSize;
-            moveValOffset += JacobsonIndexSize;
-        }
-        //freeSegID.push_back(movSegment);
-        //freeSegmentCount++;
-    }
-    lastElementPos[curSegment] = j;
-
-    for(int i=start; i<=end; i++){
-        for(int j=0; j<blocksInSegment; j++)
-            bitmap[p->segNo[i]][j] = 0;
-    }
-    for(u_int i=0; i<newSegments.size(); i++){
-        ar = NonZeroEntries[bitmap[newSegments[i]][0]];
-        smallest[newSegments[i]] = *(key_chunks[newSegments[i]] + ar[1]);
-    }
-    //Update the tree with the new segments. First copy all the segments in a buffer
-    vector<int> segs;
-    for(int i=0; i<start; i++) segs.push_back(p->segNo[i]);
-
-    segs.insert(segs.end(), newSegments.begin(), newSegments.end());
-
-    for(int i=end+1; i<p->childCount; i++) segs.push_back(p->segNo[i]);
-    //Now redistribute to p and possibly a new child
-    totalSegments -= p->childCount;
-    totalSegments += segs.size();
-    if(segs.size()>Tree_Degree){
-        BPlusTree::leaf *nleaf = new BPlusTree::leaf();
-        int halfSegs = segs.size()/2;
-        p->segNo[0] = segs[0];
-        nleaf->segNo[0] = segs[halfSegs];
-        for(int i=1; i<halfSegs; i++){
-            p->segNo[i] = segs[i];
-            p->key[i-1] = smallest[segs[i]];
-        }
-        for(u_int i=1; i+halfSegs<segs.size(); i++){
-            nleaf->segNo[i] = segs[i+halfSegs];
-            nleaf->key[i-1] = smallest[segs[i+halfSegs]];
-        }
-        nleaf->nextLeaf = p->nextLeaf;
-        p->nextLeaf = nleaf;
-        p->childCount = halfSegs;
-        nleaf->childCount = segs.size() - halfSegs;
-        cout<<"prev leaf:"<<p<<" new leaf: "<<nleaf<<endl;
-        cout<<"previous tree"<<endl;
-        tree->showTreeStat();
-        tree->insert_in_parent(p, smallest[nleaf->segNo[0]], nleaf, smallest[p->segNo[0]]);
-        cout<<"after insert: tree---"<<endl;
-        tree->showTreeStat();
-    }else{
-        p->segNo[0] = segs[0];
-        for(u_int i=1; i<segs.size(); i++){
-            p->segNo[i] = segs[i];
-            p->key[i-1] = smallest[segs[i]];
-        }
-        p->childCount = segs.size();
+        int64_t begin = count * (segPos - start) / segments;
+        int64_t size = count * (segPos - start + 1) / segments - begin;
+        fillSegment(p->segNo[segPos], keys + begin, valuesFrom(values, begin), size);
+        if(segPos > start) p->key[segPos-1] = header[p->segNo[segPos]].smallest;
     }
+    tree_t::unlockVersion(p->version);
 }
-void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
+PMA_TEMPLATE
+void PMA<PMA_ARGS>::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
+    u_char slots[JacobsonIndexSize+1], xslots[JacobsonIndexSize+1];
     int xblock = 0, j=1;
     u_int x=0;
     u_char * ar, *xar;
-    xar = NonZeroEntries[bitmap[newSegments[x]][xblock]];
-    type_t *chcekKeyOffset1, *chcekKeyOffset2;
+    xar = blockSlots(header[newSegments[x]].bitmap[xblock], xslots);
+    Key *chcekKeyOffset1, *chcekKeyOffset2;
     chcekKeyOffset2 = key_chunks[newSegments[x]];
     int compMade = 0;
     for(u_int a=0; a<usedSegment.size(); a++){
         chcekKeyOffset1 = key_chunks[usedSegment[a]];
         for(int block = 0; block<blocksInSegment; block++){
-            ar = NonZeroEntries[bitmap[usedSegment[a]][block]];
+            ar = blockSlots(header[usedSegment[a]].bitmap[block], slots);
             for(int i=1; i<=ar[0]; i++){
-                type_t element1 = *(chcekKeyOffset1+ar[i]);
-                type_t element2 = *(chcekKeyOffset2+xar[j++]);
+                Key element1 = *(chcekKeyOffset1+ar[i]);
+                Key element2 = *(chcekKeyOffset2+xar[j++]);
                 if(element1 != element2){
                     cout<<"got the case in mismatch3! comparison done: "<<compMade<< endl;
                     cout<<"element1: "<<element1<<" element2: "<<element2<<" newSeg: "<<newSegments[x]<<" oldSeg: "<<usedSegment[a]<<" nblock "<<xblock<<" oblock "<<block<<endl;
@@ -1818,10 +3276,10 @@ void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
                     j = 1;
                     xblock++;
                     if(xblock < blocksInSegment){ //Avoid the trailing zeros of a segment
-                        xar = NonZeroEntries[bitmap[newSegments[x]][xblock]];
+                        xar = blockSlots(header[newSegments[x]].bitmap[xblock], xslots);
                         while(xar[0] == 0 && xblock < blocksInSegment) {
                             xblock++;
-                            xar = NonZeroEntries[bitmap[newSegments[x]][xblock]];
+                            xar = blockSlots(header[newSegments[x]].bitmap[xblock], xslots);
                         }
                     }
                     if(xblock == blocksInSegment){
@@ -1832,7 +3290,7 @@ void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
                             bool flag = false;
                             if(i<ar[0]) flag = true;
                             for(int b = block+1; !flag && b<blocksInSegment; b++){
-                                ar = NonZeroEntries[bitmap[usedSegment[a]][b]];
+                                ar = blockSlots(header[usedSegment[a]].bitmap[b], slots);
                                 if(ar[0]>0) {cout<<"Got more non-zero blocks"<<endl; flag = true;}
                             }
                             if((a < usedSegment.size()-1) || flag){
@@ -1854,7 +3312,7 @@ void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
                     else{
                         chcekKeyOffset2 += JacobsonIndexSize;
                     }
-                    xar = NonZeroEntries[bitmap[newSegments[x]][xblock]];
+                    xar = blockSlots(header[newSegments[x]].bitmap[xblock], xslots);
                 }
             }
             chcekKeyOffset1 += JacobsonIndexSize;
@@ -1868,7 +3326,7 @@ void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
         for(int ii = j; ii<=xar[0]; ii++) cout<< *(chcekKeyOffset2+xar[ii])<<" ";
     }
     for(int b = xblock+1; !flag && b<blocksInSegment; b++){
-        xar = NonZeroEntries[bitmap[newSegments[x]][b]];
+        xar = blockSlots(header[newSegments[x]].bitmap[b], xslots);
         chcekKeyOffset2 += JacobsonIndexSize;
         if(xar[0]>0) {
             cout<<"Got more non-zero blocks"<<endl;
@@ -1889,36 +3347,41 @@ void PMA::checkElementWise(vector<int> usedSegment, vector<int>newSegments){
     }
 }
 
-type_t PMA::findSegmentElements(int segno){
-    type_t total = 0;
-    u_char * ar;
+PMA_TEMPLATE
+int64_t PMA<PMA_ARGS>::findSegmentElements(int segno){
+    int64_t total = 0;
+#if Bitmap_engine == 1
     for(int i=0; i<blocksInSegment; i++){
-        ar = NonZeroEntries[bitmap[segno][i]];
-        total += ar[0];
+        total += blockCount(header[segno].bitmap[i]);
     }
+#else
+    for(int64_t word = 0; word * 64 < elementsInSegment; word++){
+        total += __builtin_popcountll(bitmapWord(segno, word));
+    }
+#endif
     return total;
 }
 
 /*
     Returns new segment nubmer. Unsed in cases only one new segment needs to be created
  */
-int PMA::redistributeWithDividing(int targetSegment){
-    type_t halfElement = cardinality[targetSegment]/2;
+PMA_TEMPLATE
+int PMA<PMA_ARGS>::redistributeWithDividing(int targetSegment){
+    u_char slots[JacobsonIndexSize+1];
+    int64_t halfElement = header[targetSegment].cardinality/2;
     int curSegment = getSegment();
 
-    type_t * moveKeyOffset = key_chunks[targetSegment];
-    type_t * moveValOffset = value_chunks[targetSegment];
-    type_t * destKeyOffset = key_chunks[curSegment];
-    type_t * destValOffset = value_chunks[curSegment];
+    Key * moveKeyOffset = key_chunks[targetSegment];
+    Key * destKeyOffset = key_chunks[curSegment];
 
     int copyBlock, i, elementCount = 0;
-    type_t j;
+    int64_t j;
 
     for(copyBlock=0; copyBlock<blocksInSegment; copyBlock++){
-        u_char * ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
+        u_char * ar = blockSlots(header[targetSegment].bitmap[copyBlock], slots);
         if((elementCount + ar[0]) >= halfElement){
             halfElement = elementCount + ar[0];
-            lastElementPos[targetSegment] = copyBlock * JacobsonIndexSize + ar[ar[0]];
+            header[targetSegment].lastElementPos = copyBlock * JacobsonIndexSize + ar[ar[0]];
             copyBlock++;
             break;
         }
@@ -1926,103 +3389,115 @@ int PMA::redistributeWithDividing(int targetSegment){
     }        
 
     //Copy the elements of current block
-    elementCount = cardinality[targetSegment]-halfElement;
-    u_char * ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
+    elementCount = header[targetSegment].cardinality-halfElement;
+    u_char * ar = blockSlots(header[targetSegment].bitmap[copyBlock], slots);
     while(UNLIKELY(ar[0] == 0)){
         copyBlock++;
-        ar = NonZeroEntries[bitmap[targetSegment][copyBlock]];
+        ar = blockSlots(header[targetSegment].bitmap[copyBlock], slots);
     }
-    type_t * pKeyBase = moveKeyOffset + copyBlock * JacobsonIndexSize;
-    type_t * pValBase = moveValOffset + copyBlock * JacobsonIndexSize;
-    type_t lastInsertkey = 0;
+    int64_t pBase = copyBlock * JacobsonIndexSize;
+    Key * pKeyBase = moveKeyOffset + pBase;
+    Key lastInsertkey = 0;
 
     *destKeyOffset = lastInsertkey = *(pKeyBase + ar[1]);
-    *destValOffset = *(pValBase + ar[1]);
-    bitmap[curSegment][0] = 1;
+    setValue(curSegment, 0, valueAt(targetSegment, pBase + ar[1]));
+    header[curSegment].bitmap[0] = 1;
     for(i = 2, j = 0; i<=ar[0]; i++){
-        type_t current_element = *(pKeyBase + ar[i]);
-        j += min(lastValidPos - (j + elementCount), min(current_element - lastInsertkey, (type_t)MaxGap));
+        Key current_element = *(pKeyBase + ar[i]);
+        j += min(lastValidPos - (j + elementCount), keyGap(lastInsertkey, current_element));
         *(destKeyOffset + j) = lastInsertkey = current_element;
-        *(destValOffset + j) = *(pValBase + ar[i]);
+        setValue(curSegment, j, valueAt(targetSegment, pBase + ar[i]));
         int blockPosition = j / JacobsonIndexSize;
         int bitPosition = j % JacobsonIndexSize;
         u_short mask = 1 << bitPosition;
-        bitmap[curSegment][blockPosition] |= mask;
+        header[curSegment].bitmap[blockPosition] |= mask;
         elementCount--;
     }
     //lastInput = j;
-    bitmap[targetSegment][copyBlock] = 0;
+    header[targetSegment].bitmap[copyBlock] = 0;
 
-    //type_t lastAccessPos = lastValidPos;
+    //int64_t lastAccessPos = lastValidPos;
     for(int blockno = copyBlock+1; blockno < blocksInSegment; blockno++){
         pKeyBase += JacobsonIndexSize;
-        pValBase += JacobsonIndexSize;
-        ar = NonZeroEntries[bitmap[targetSegment][blockno]];
+        pBase += JacobsonIndexSize;
+        ar = blockSlots(header[targetSegment].bitmap[blockno], slots);
         if(UNLIKELY(ar[0] == 0)){ 
             continue;
         }
         for(i = 1; i<=ar[0]; i++){
-            type_t current_element = *(pKeyBase + ar[i]);
+            Key current_element = *(pKeyBase + ar[i]);
             
-            j += min(lastValidPos - (j + elementCount), min(current_element - lastInsertkey, (type_t)MaxGap));   
+            j += min(lastValidPos - (j + elementCount), keyGap(lastInsertkey, current_element));   
             *(destKeyOffset + j) = lastInsertkey = current_element;
-            *(destValOffset + j) = *(pValBase + ar[i]);
+            setValue(curSegment, j, valueAt(targetSegment, pBase + ar[i]));
             int blockPosition = j / JacobsonIndexSize;
             int bitPosition = j % JacobsonIndexSize;
             u_short mask = 1 << bitPosition;
-            bitmap[curSegment][blockPosition] |= mask;
+            header[curSegment].bitmap[blockPosition] |= mask;
             elementCount--;
         }
-        bitmap[targetSegment][blockno] = 0;
+        header[targetSegment].bitmap[blockno] = 0;
     }
 
-    lastElementPos[curSegment] = j;
-    smallest[curSegment] = *(destKeyOffset);
-    cardinality[curSegment] = cardinality[targetSegment] - halfElement;
-    cardinality[targetSegment] = halfElement;
-    totalSegments++;
+    header[curSegment].lastElementPos = j;
+    header[curSegment].smallest = *(destKeyOffset);
+    header[curSegment].cardinality = header[targetSegment].cardinality - halfElement;
+    header[targetSegment].cardinality = halfElement;
+    recountSegment(curSegment);
+    if(UNLIKELY(writeBuffer)) resetFilter(curSegment);
+    header[targetSegment].keySum -= header[curSegment].keySum;
+    header[targetSegment].valueSum -= header[curSegment].valueSum;
     return curSegment;
 }
 
-type_t BPlusTree::findCardinality(leaf *l, PMA *obj){
-    type_t total = 0;
+PMA_TEMPLATE
+int64_t BPlusTree<PMA_ARGS>::findCardinality(leaf *l, pma_t *obj){
+    int64_t total = 0;
     for(int i=0; i<l->childCount; i++){
-        total += obj->cardinality[l->segNo[i]];
+        total += obj->header[l->segNo[i]].cardinality;
     }
     return total;
 }
 
-//Use binary search to find the position of key and segment in leaf
-int BPlusTree::findInLeaf(leaf * leaf, int key){
-    if(leaf->key[0]>key || leaf->childCount == 1) return 0;
-    else if(leaf->key[leaf->childCount-2] <= key) return leaf->childCount-1;
-    int start = 0, end = leaf->childCount-2, mid;
-    while(start<end-1){
-        mid = (start+end+1)/2;
-        if(leaf->key[mid] < key) start = mid;
-        else if(leaf->key[mid] > key) end = mid;
-        else return mid+1;
+//Find the position of key and segment in leaf
+PMA_TEMPLATE
+int BPlusTree<PMA_ARGS>::findInLeaf(leaf * leaf, Key key){
+    return childPosition<Degree>(leaf->key, leaf->childCount - 1, key);
+}
+
+//Smallest key routed past the segment at pos of leaf l, found through the parent links. None for the last segment,
+//which takes every key up to numeric_limits<Key>::max()
+PMA_TEMPLATE
+optional<Key> BPlusTree<PMA_ARGS>::segmentBound(leaf *l, int pos){
+    if(pos < l->childCount - 1) return l->key[pos];
+    node *child = (node *)l;
+    for(node *n = l->parent; n != NULL; child = n, n = n->parent){
+        for(int i = 0; i < n->ptrCount - 1; i++){
+            if(n->child_ptr[i] == child) return n->key[i];
+        }
     }
-    return start+1;
+    return nullopt;
 }
 
-BPlusTree::leaf* BPlusTree::rightmostLeaf(node *parent){
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::rightmostLeaf(node *parent){
     if(parent->nodeLeaf) return (leaf *)parent->child_ptr[parent->ptrCount-1];
     while(!parent->nodeLeaf){
-        parent = parent->child_ptr[root->ptrCount-1];
+        parent = parent->child_ptr[parent->ptrCount-1];
     }
     return (leaf *)parent->child_ptr[parent->ptrCount-1];
 }
 
-BPlusTree::leaf* BPlusTree::leftmostLeaf(node *parent){
-    if(parent->nodeLeaf) return (leaf *)root->child_ptr[0];
+PMA_TEMPLATE
+typename BPlusTree<PMA_ARGS>::leaf* BPlusTree<PMA_ARGS>::leftmostLeaf(node *parent){
     while(!parent->nodeLeaf){
         parent = parent->child_ptr[0];
     }
     return (leaf *)parent->child_ptr[0];
 }
 
-void BPlusTree::listSegments(vector<int> &segments, node *parent){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::listSegments(vector<int> &segments, node *parent){
     if(parent->nodeLeaf){
         for(int i = 0; i<parent->ptrCount; i++){
             leaf *l = (leaf *)parent->child_ptr[i];
@@ -2039,7 +3514,8 @@ void BPlusTree::listSegments(vector<int> &segments, node *parent){
     }
 }
 
-void BPlusTree::deleteNode(node *parent){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::deleteNode(node *parent){
     if(parent->nodeLeaf){
         for(int i=0; i<parent->ptrCount; i++){
             delete (leaf *)parent->child_ptr[i];
@@ -2048,28 +3524,136 @@ void BPlusTree::deleteNode(node *parent){
     }else{
         for(int i = 0; i<parent->ptrCount; i++){
             deleteNode(parent->child_ptr[i]);
-            delete parent;
         }
+        delete parent;
     }
 }
 
-void BPlusTree::deleteLeaf(leaf *l, type_t SKey){
-    leaf *prev = findLeaf(SKey);
-    prev->nextLeaf = l->nextLeaf;
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::deleteLeaf(leaf *l){
+    if(l->prevLeaf != NULL) l->prevLeaf->nextLeaf = l->nextLeaf;
+    if(l->nextLeaf != NULL) l->nextLeaf->prevLeaf = l->prevLeaf;
 
-    node *par = findParent(root, l, SKey);
+    node *par = l->parent;
     while(par->ptrCount == 1){
         if(par == root) return;
-        node *par2 = findParent(root, par, SKey);
+        node *par2 = par->parent;
         par2->child_ptr[0] = par->child_ptr[0];
+        if(par->nodeLeaf) ((leaf *)par2->child_ptr[0])->parent = par2;
+        else par2->child_ptr[0]->parent = par2;
         delete par;
         par = par2;
     }
 
 }
 
-type_t BPlusTree::findCardinality(node *n, PMA *obj){
-    type_t total = 0;
+/*
+    Epochs of the threads in ConcurrentPMA calls, shared by all ConcurrentPMAs. A thread takes a slot on its first call
+    and gives it back when it exits. A call stores the global epoch in the slot of its thread and clears it on return,
+    so a thread writes no line shared with the others. A tree node unlinked in epoch e is freed once the global epoch
+    has moved past e and no slot holds an epoch up to e. Threads finding all Epoch_slots slots taken count their calls
+    in overflowCalls instead, which announces no epoch, so nothing is freed while one of them is in a call
+ */
+struct alignas(64) EpochSlot{
+    uint64_t epoch = 0;     //0 while the thread is in no call
+    bool taken = false;
+};
+
+static EpochSlot epochSlots[Epoch_slots];
+static uint64_t globalEpoch = 1;
+static uint64_t overflowCalls = 0;
+
+//Slot of a thread, taken on its first call and given back when the thread exits. NULL while all slots are taken
+class EpochHandle{
+public:
+    EpochSlot *slot = NULL;
+
+    EpochSlot *get(){
+        if(UNLIKELY(slot == NULL)){
+            for(EpochSlot &s : epochSlots){
+                bool expected = false;
+                if(!__atomic_load_n(&s.taken, __ATOMIC_RELAXED) && __atomic_compare_exchange_n(&s.taken, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+                    slot = &s;
+                    break;
+                }
+            }
+        }
+        return slot;
+    }
+    ~EpochHandle(){
+        if(slot != NULL) __atomic_store_n(&slot->taken, false, __ATOMIC_RELEASE);
+    }
+};
+
+static thread_local EpochHandle epochHandle;
+
+//Holds the global epoch in the slot of the thread for the scope of a call. The fence orders it before the tree reads
+class EpochGuard{
+public:
+    EpochGuard() : slot(epochHandle.get()){
+        if(LIKELY(slot != NULL)) __atomic_store_n(&slot->epoch, __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        else __atomic_fetch_add(&overflowCalls, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    ~EpochGuard(){
+        if(LIKELY(slot != NULL)) __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+        else __atomic_fetch_sub(&overflowCalls, 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    EpochSlot *slot;
+};
+
+//Free an unlinked node, or keep it until reclaim when readers may still be on it. The fence orders the unlink first
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::retire(node *n){
+    if(!shared){
+        delete n;
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    lock_guard<mutex> lock(retireLatch);
+    retiredNodes.push_back({__atomic_load_n(&globalEpoch, __ATOMIC_RELAXED), n});
+}
+
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::retire(leaf *l){
+    if(!shared){
+        delete l;
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    lock_guard<mutex> lock(retireLatch);
+    retiredLeaves.push_back({__atomic_load_n(&globalEpoch, __ATOMIC_RELAXED), l});
+}
+
+//Free the retired nodes and leaves unlinked in an epoch before the given one, all of them by default
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::reclaim(uint64_t before){
+    lock_guard<mutex> lock(retireLatch);
+    size_t kept = 0;
+    for(size_t i = 0; i < retiredNodes.size(); i++){
+        if(retiredNodes[i].first < before) delete retiredNodes[i].second;
+        else retiredNodes[kept++] = retiredNodes[i];
+    }
+    retiredNodes.resize(kept);
+    kept = 0;
+    for(size_t i = 0; i < retiredLeaves.size(); i++){
+        if(retiredLeaves[i].first < before) delete retiredLeaves[i].second;
+        else retiredLeaves[kept++] = retiredLeaves[i];
+    }
+    retiredLeaves.resize(kept);
+}
+
+PMA_TEMPLATE
+size_t BPlusTree<PMA_ARGS>::retiredCount(){
+    lock_guard<mutex> lock(retireLatch);
+    return retiredNodes.size() + retiredLeaves.size();
+}
+
+PMA_TEMPLATE
+int64_t BPlusTree<PMA_ARGS>::findCardinality(node *n, pma_t *obj){
+    int64_t total = 0;
     for(int i=0; i < n->ptrCount; i++){
         if(n->nodeLeaf) total += findCardinality((leaf *)n->child_ptr[i], obj);
         else total += findCardinality(n->child_ptr[i], obj);
@@ -2077,34 +3661,36 @@ type_t BPlusTree::findCardinality(node *n, PMA *obj){
     return total;
 }
 
-void BPlusTree::printAllElements(PMA *obj){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::printAllElements(pma_t *obj){
     int totalElements = 0;
     leaf *leaf;
     for(leaf = leftmostLeaf(root); leaf != NULL; leaf = leaf->nextLeaf){
         for(int i = 0; i<leaf->childCount; i++){
             int segNo = leaf->segNo[i];
-            type_t *key = obj->key_chunks[segNo];
-            type_t pBase = 0;
-            for(type_t block = 0; block<obj->blocksInSegment; block++){
-                cout <<" Bitmap: "<<obj->bitmap[segNo][block]<<" ";
+            Key * key = obj->key_chunks[segNo];
+            int64_t pBase = 0;
+            for(int64_t block = 0; block<obj->blocksInSegment; block++){
+                cout <<" Bitmap: "<<obj->header[segNo].bitmap[block]<<" ";
                 u_short bitpos = 1;
                 for(int j = 0; j<JacobsonIndexSize; j++){
-                    if(obj->bitmap[segNo][block] & bitpos)
+                    if(obj->header[segNo].bitmap[block] & bitpos)
                         cout << *(key+pBase+j) << " ";
                     else cout <<"0 ";
                     bitpos = bitpos << 1;
                 }
                 pBase += JacobsonIndexSize;
-                if(pBase>obj->lastElementPos[segNo]) break;
+                if(pBase>obj->header[segNo].lastElementPos) break;
             }
-            totalElements += obj->cardinality[segNo];
-            cout<<"SIGMENT NO: "<<segNo<<" CARDINALITY: "<<obj->cardinality[segNo]<<" LAST Position: "<<obj->lastElementPos[segNo]<<endl;
+            totalElements += obj->header[segNo].cardinality;
+            cout<<"SIGMENT NO: "<<segNo<<" CARDINALITY: "<<obj->header[segNo].cardinality<<" LAST Position: "<<obj->header[segNo].lastElementPos<<endl;
         }
     }
     cout<<"Total element inserted in the PMA: "<<totalElements<<" Total Segments: "<<obj->totalSegments<<endl;
 }
 
-void BPlusTree::printTree(vector<Node *> nodes, int level){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::printTree(vector<Node *> nodes, int level){
     if(nodes[0] == NULL) return;
     if(nodes[0]->nodeLeaf){ //Create list of leaf child nodes from the current list
         cout<<"Printing level: "<<level<<endl;
@@ -2139,7 +3725,8 @@ void BPlusTree::printTree(vector<Node *> nodes, int level){
     }
 }
 
-void BPlusTree::printTree(vector<Leaf *> nodes, int level){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::printTree(vector<Leaf *> nodes, int level){
     cout<<"Printing level: "<<level<<endl;
     
     for(u_int i=0; i<nodes.size(); i++){
@@ -2154,8 +3741,753 @@ void BPlusTree::printTree(vector<Leaf *> nodes, int level){
     cout<<endl;
 }
 
-void BPlusTree::showTreeStat(){
+PMA_TEMPLATE
+void BPlusTree<PMA_ARGS>::showTreeStat(){
     vector<Node *> temp;
     temp.push_back(root);
     printTree(temp, 0);
-}
\ No newline at end of file
+}
+
+PMA_TEMPLATE
+ConcurrentPMA<PMA_ARGS>::ConcurrentPMA(int64_t totalInsert) : pma(totalInsert){
+    pma.tree->shared = true;
+    pma.tree->keepAggregates = false;
+    latches.resize(pma.header.size());
+    pma.segmentLatches = &latches;
+    pma.allocationLatch = &allocation;
+}
+
+PMA_TEMPLATE
+ConcurrentPMA<PMA_ARGS>::~ConcurrentPMA(){
+    pma.tree->reclaim();
+}
+
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::insert(Key key, value_t value){
+    return insertOrAssign(key, value, false);
+}
+
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::upsert(Key key, value_t value){
+    return insertOrAssign(key, value, true);
+}
+
+/*
+    An insert that leaves the segment within maxLevel holds only the segment latch. Otherwise it latches its way down to
+    its leaf and latches the segments of the leaf, as rebalancing and splits of segments stay within it. A split takes
+    a free segment, or a new page of them, without stopping the other threads
+ */
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::insertOrAssign(Key key, value_t value, bool assign){
+    EpochGuard guard;
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        int targetSegment = route(key, leaf, leafVersion);
+        lockSegment(targetSegment);
+        if(!pma.tree->unchanged(leaf->version, leafVersion)){
+            unlockSegment(targetSegment);
+            continue;
+        }
+        if(pma.header[targetSegment].cardinality + 1 <= pma.tree->maxLevel[0]){
+            bool inserted = pma.placeInSegment(leaf, targetSegment, key, value, assign);
+            unlockSegment(targetSegment);
+            return inserted;
+        }
+        unlockSegment(targetSegment);
+        break;
+    }
+    vector<bool *> held;
+    vector<int> segments;
+    leaf_t *leaf = pma.tree->latchPath(key, false, held);
+    latchSegments(leaf, segments);
+    int targetSegment = leaf->segNo[pma.tree->findInLeaf(leaf, key)];
+    bool inserted = pma.placeInSegment(leaf, targetSegment, key, value, assign);
+    if(inserted && pma.header[targetSegment].cardinality > pma.tree->maxLevel[0]) pma.redistributeInsert(targetSegment, pma.header[targetSegment].smallest);
+    for(int latched : segments) unlockSegment(latched);
+    pma.tree->unlatchAll(held);
+    return inserted;
+}
+
+/*
+    A remove that keeps the segment at minLevel or above holds only the segment latch. Otherwise it latches its way down
+    like an insert. The leaf is only merged with a neighbour if it was latched with its parent. One that merges more
+    segments than expected latches its way down again with the parent to rebalance the leaf. The retired tree nodes are
+    freed once enough pile up
+ */
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::remove(Key key){
+    EpochGuard guard;
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        int targetSegment = route(key, leaf, leafVersion);
+        lockSegment(targetSegment);
+        if(!pma.tree->unchanged(leaf->version, leafVersion)){
+            unlockSegment(targetSegment);
+            continue;
+        }
+        if(pma.header[targetSegment].cardinality - 1 >= pma.tree->minLevel[0]){
+            bool removed = pma.takeFromSegment(leaf, targetSegment, key);
+            unlockSegment(targetSegment);
+            return removed;
+        }
+        unlockSegment(targetSegment);
+        break;
+    }
+    vector<bool *> held;
+    vector<int> segments;
+    leaf_t *leaf = pma.tree->latchPath(key, true, held);
+    bool parentHeld = held.size() > 1;   //Only the leaf is held once it cannot merge
+    latchSegments(leaf, segments);
+    if(parentHeld) latchNeighbourSegments(leaf, segments);
+    int targetSegment = leaf->segNo[pma.tree->findInLeaf(leaf, key)];
+    bool removed = pma.takeFromSegment(leaf, targetSegment, key);
+    if(removed && pma.header[targetSegment].cardinality < pma.tree->minLevel[0]) pma.redistributeRemove(leaf, targetSegment, parentHeld);
+    bool underfull = !parentHeld && leaf->childCount < Degree/2;
+    for(int latched : segments) unlockSegment(latched);
+    pma.tree->unlatchAll(held);
+    if(UNLIKELY(underfull)) rebalanceLeaf(key);
+    if(pma.tree->retiredCount() >= retireLimit) reclaim();
+    return removed;
+}
+
+/*
+    Rebalance the leaf key routes to with a neighbour, for a remove that left it with fewer than Degree/2 segments
+    without holding its parent. A leaf below Degree/2 is latched with its parent and a neighbour on the way down. It
+    may have been rebalanced in the meantime, or have a single segment left to merge
+ */
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::rebalanceLeaf(Key key){
+    vector<bool *> held;
+    vector<int> segments;
+    leaf_t *leaf = pma.tree->latchPath(key, true, held);
+    if(held.size() > 1 && leaf->childCount < Degree/2){
+        latchSegments(leaf, segments);
+        latchNeighbourSegments(leaf, segments);
+        int first = leaf->segNo[0];
+        if(leaf->childCount == 1 && pma.header[first].cardinality < pma.tree->minLevel[0]) pma.redistributeRemove(leaf, first);
+        else pma.tree->rebalanceOnDelete(leaf, pma.header[first].smallest, &pma);
+    }
+    for(int latched : segments) unlockSegment(latched);
+    pma.tree->unlatchAll(held);
+}
+
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::lookup(Key key){
+    EpochGuard guard;
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        int targetSegment = route(key, leaf, leafVersion);
+        uint64_t version = readBegin(targetSegment);
+        if(!pma.tree->unchanged(leaf->version, leafVersion)) continue;
+        bool found = pma.findKey(key, targetSegment) >= 0;
+        if(readValid(targetSegment, version)) return found;
+    }
+}
+
+PMA_TEMPLATE
+optional<typename ConcurrentPMA<PMA_ARGS>::value_t> ConcurrentPMA<PMA_ARGS>::get(Key key){
+    EpochGuard guard;
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        int targetSegment = route(key, leaf, leafVersion);
+        uint64_t version = readBegin(targetSegment);
+        if(!pma.tree->unchanged(leaf->version, leafVersion)) continue;
+        int64_t position = pma.findKey(key, targetSegment);
+        optional<value_t> value;
+        if(position >= 0) value = pma.valueAt(targetSegment, position);
+        if(readValid(targetSegment, version)) return value;
+    }
+}
+
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::update(Key key, value_t value){
+    EpochGuard guard;
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        int targetSegment = route(key, leaf, leafVersion);
+        lockSegment(targetSegment);
+        if(!pma.tree->unchanged(leaf->version, leafVersion)){
+            unlockSegment(targetSegment);
+            continue;
+        }
+        int64_t position = pma.findKey(key, targetSegment);
+        if(position >= 0) pma.assignAt(leaf, targetSegment, position, value);
+        unlockSegment(targetSegment);
+        return position >= 0;
+    }
+}
+
+/*
+    Sum of the keys and values in [startKey, endKey], scanned a segment at a time. Each segment is summed between two
+    loads of its version and summed again if a writer got in between, so the sum holds every pair of a segment as of
+    some moment, but the segments are not read at the same moment. A leaf that changes under the scan sends it back
+    down the tree, to carry on after the largest key summed so far
+ */
+PMA_TEMPLATE
+tuple<int64_t, int64_t> ConcurrentPMA<PMA_ARGS>::range_sum(Key startKey, Key endKey){
+    typedef typename pma_t::tree_t tree_t;
+    EpochGuard guard;
+    int64_t sum_key = 0, sum_value = 0;
+    Key from = startKey;   //Keys below from are summed
+    while(true){
+        leaf_t *leaf;
+        uint64_t leafVersion;
+        route(from, leaf, leafVersion);
+        int segPos = pma.tree->findInLeaf(leaf, from);
+        bool first = true;
+        while(true){
+            int targetSegment = leaf->segNo[segPos];
+            uint64_t version = readBegin(targetSegment);
+            if(!tree_t::unchanged(leaf->version, leafVersion)) break;
+            int64_t segment_key = 0, segment_value = 0;
+            bool ends;
+            if(first) ends = pma.sumSegmentFrom(targetSegment, from, endKey, segment_key, segment_value);
+            else ends = pma.sumSegment(targetSegment, 0, endKey, segment_key, segment_value);
+            const typename pma_t::segment &seg = pma.header[targetSegment];
+            bool empty = seg.cardinality == 0;
+            Key last = *(pma.key_chunks[targetSegment] + seg.lastElementPos);
+            if(!readValid(targetSegment, version)) continue;
+            sum_key += segment_key;
+            sum_value += segment_value;
+            if(ends || (!empty && last == numeric_limits<Key>::max())) return {sum_key, sum_value};
+            if(!empty && last >= from) from = last + 1;
+            first = false;
+            if(++segPos == leaf->childCount){
+                leaf_t *next = leaf->nextLeaf;
+                if(next == NULL) return {sum_key, sum_value};
+                uint64_t nextVersion = tree_t::stableVersion(next->version);
+                if(!tree_t::unchanged(leaf->version, leafVersion)) break;
+                leaf = next;
+                leafVersion = nextVersion;
+                segPos = 0;
+            }
+        }
+    }
+}
+
+//Segment key routes to, and its leaf with the version the route was read at
+PMA_TEMPLATE
+int ConcurrentPMA<PMA_ARGS>::route(Key key, leaf_t *&leaf, uint64_t &leafVersion){
+    while(true){
+        leaf = pma.tree->descendOptimistic(key, leafVersion);
+        int targetSegment = leaf->segNo[pma.tree->findInLeaf(leaf, key)];
+        if(pma.tree->unchanged(leaf->version, leafVersion)) return targetSegment;
+    }
+}
+
+//Make the version odd. Readers of the segment retry until unlockSegment makes it even again
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::lockSegment(int targetSegment){
+    uint64_t *version = &latches[targetSegment].version;
+    while(true){
+        uint64_t seen = __atomic_load_n(version, __ATOMIC_RELAXED);
+        if(!(seen & 1) && __atomic_compare_exchange_n(version, &seen, seen + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        this_thread::yield();
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::unlockSegment(int targetSegment){
+    __atomic_fetch_add(&latches[targetSegment].version, 1, __ATOMIC_RELEASE);
+}
+
+//Even version of the segment to validate a read against, once no writer holds it
+PMA_TEMPLATE
+uint64_t ConcurrentPMA<PMA_ARGS>::readBegin(int targetSegment){
+    while(true){
+        uint64_t version = __atomic_load_n(&latches[targetSegment].version, __ATOMIC_ACQUIRE);
+        if(!(version & 1)) return version;
+        this_thread::yield();
+    }
+}
+
+//True if no writer held the segment since readBegin returned version
+PMA_TEMPLATE
+bool ConcurrentPMA<PMA_ARGS>::readValid(int targetSegment, uint64_t version){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&latches[targetSegment].version, __ATOMIC_RELAXED) == version;
+}
+
+//Move the global epoch on and free the retired tree nodes unlinked before the oldest epoch a thread still holds
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::reclaim(){
+    uint64_t oldest = __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&overflowCalls, __ATOMIC_SEQ_CST) > 0) return;
+    for(EpochSlot &slot : epochSlots){
+        uint64_t epoch = __atomic_load_n(&slot.epoch, __ATOMIC_SEQ_CST);
+        if(epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    pma.tree->reclaim(oldest);
+}
+
+//Latch the segments of a leaf the calling writer holds the writer latch of
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::latchSegments(leaf_t *leaf, vector<int> &held){
+    for(int j = 0; j < leaf->childCount; j++){
+        lockSegment(leaf->segNo[j]);
+        held.push_back(leaf->segNo[j]);
+    }
+}
+
+//Latch the segments of the neighbour latchPath latched beside leaf. A leaf merge or borrow moves them, and a segment
+//left alone in its leaf merges with them
+PMA_TEMPLATE
+void ConcurrentPMA<PMA_ARGS>::latchNeighbourSegments(leaf_t *leaf, vector<int> &held){
+    typedef typename pma_t::tree_t::node node_t;
+    node_t *parent = leaf->parent;
+    int neighbour = leaf->slot > 0 ? leaf->slot - 1 : leaf->slot + 1;
+    if(neighbour < parent->ptrCount) latchSegments((leaf_t *)parent->child_ptr[neighbour], held);
+}
+
+//A call queued on a shard. reply is NULL for the calls that return once queued
+PMA_TEMPLATE
+struct ShardedPMA<PMA_ARGS>::Request{
+    enum Kind : u_char { Insert, Upsert, Remove, Get, Sum, Barrier, Split, Migrate, Transfer, Stop };
+    Kind kind = Barrier;
+    int shard = 0;          //Shard taking over the keys of a Migrate, shard handing them over in a Transfer
+    Key key = Key(), endKey = Key();
+    value_t value = value_t();
+    int64_t count = 0;      //Pairs a Split gives away
+    Reply *reply = NULL;
+    Batch *batch = NULL;    //Pairs of a Transfer
+};
+
+//Answer to a call, filled in by the worker before it sets done
+PMA_TEMPLATE
+struct ShardedPMA<PMA_ARGS>::Reply{
+    atomic<bool> done{false};
+    bool found = false;
+    Key key = Key();
+    value_t value = value_t();
+    int64_t sum_key = 0, sum_value = 0;
+};
+
+//Sorted pairs a shard hands over to its neighbour
+PMA_TEMPLATE
+struct ShardedPMA<PMA_ARGS>::Batch{
+    vector<Key> keys;
+    vector<value_t> values;
+};
+
+/*
+    A PMA with the worker that owns it, pinned to a core. Producers claim a cell of the ring by its sequence number and
+    publish the request by advancing the sequence, the worker takes the cells in order and hands them back a lap ahead.
+    Requests from other workers go through a mailbox instead, taken before the next cell, so a worker never waits on a
+    full ring. A worker finding both empty for a while sleeps until a request wakes it.
+    low and high bound the keys the PMA holds. A call for a key outside them was routed by bounds that have moved since:
+    it goes on to the shard now owning the key, or waits here until the pairs of a moving boundary arrive
+ */
+PMA_TEMPLATE
+class ShardedPMA<PMA_ARGS>::Shard{
+public:
+    pma_t *pma;
+    atomic<int64_t> pairs{0};   //Pairs in the PMA, written by the worker only
+
+    Shard(ShardedPMA *owner, int index, Key low, Key high, int64_t totalInsert) : pma(new pma_t(totalInsert)), owner(owner), index(index), low(low), high(high){
+        for(uint64_t i = 0; i < Shard_queue; i++) cells[i].sequence.store(i, memory_order_relaxed);
+        worker = thread(&Shard::work, this);
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % max(1u, thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(worker.native_handle(), sizeof(cpus), &cpus);
+#endif
+    }
+    ~Shard(){
+        delete pma;
+    }
+    //Run the calls queued so far and end the worker
+    void stop(){
+        submit({Request::Stop});
+        worker.join();
+    }
+    void submit(const Request &request){
+        uint64_t pos = tail.load(memory_order_relaxed);
+        Cell *cell;
+        while(true){
+            cell = &cells[pos % Shard_queue];
+            int64_t lag = (int64_t)(cell->sequence.load(memory_order_acquire) - pos);
+            //Acquire and release chain the claims, so a call claimed after a Migrate also sees the bounds it moved
+            if(lag == 0 && tail.compare_exchange_weak(pos, pos + 1, memory_order_acq_rel, memory_order_relaxed)) break;
+            if(lag < 0) this_thread::yield();   //Ring full until the worker takes the cell
+            if(lag != 0) pos = tail.load(memory_order_relaxed);
+        }
+        cell->request = request;
+        cell->sequence.store(pos + 1, memory_order_release);
+        wakeUp();
+    }
+    void post(const Request &request){
+        {
+            lock_guard<mutex> lock(mailLatch);
+            mail.push_back(request);
+            hasMail.store(true, memory_order_relaxed);
+        }
+        wakeUp();
+    }
+
+private:
+    static constexpr int idleRounds = 64;   //Empty polls before the worker sleeps
+    struct alignas(64) Cell{
+        atomic<uint64_t> sequence;
+        Request request;
+    };
+    Cell cells[Shard_queue];
+    alignas(64) atomic<uint64_t> tail{0};   //Next cell to claim
+    alignas(64) uint64_t head = 0;          //Next cell to take, worker only
+    atomic<bool> sleeping{false};
+    mutex m;
+    condition_variable wake;
+    thread worker;
+    ShardedPMA *owner;
+    int index;
+    atomic<bool> hasMail{false};
+    mutex mailLatch;
+    vector<Request> mail;
+    vector<Request> deferred;   //Calls for keys on their way here, worker only
+    Key low, high;              //Keys held, worker only
+
+    void wakeUp(){
+        //Pairs with the fence of a worker going to sleep: either it sees the request or this sees it sleeping
+        atomic_thread_fence(memory_order_seq_cst);
+        if(UNLIKELY(sleeping.load(memory_order_relaxed))){
+            lock_guard<mutex> lock(m);
+            sleeping.store(false, memory_order_relaxed);
+            wake.notify_one();
+        }
+    }
+    bool ready(){
+        return cells[head % Shard_queue].sequence.load(memory_order_acquire) == head + 1 || hasMail.load(memory_order_relaxed);
+    }
+    void work(){
+        int idle = 0;
+        vector<Request> taken;
+        while(true){
+            if(UNLIKELY(hasMail.load(memory_order_acquire))){
+                {
+                    lock_guard<mutex> lock(mailLatch);
+                    taken.swap(mail);
+                    hasMail.store(false, memory_order_relaxed);
+                }
+                for(const Request &request : taken) apply(request);
+                taken.clear();
+            }
+            if(!ready()){
+                if(++idle < idleRounds){
+                    this_thread::yield();
+                    continue;
+                }
+                idle = 0;
+                unique_lock<mutex> lock(m);
+                sleeping.store(true, memory_order_relaxed);
+                atomic_thread_fence(memory_order_seq_cst);
+                if(!ready()) wake.wait(lock, [this]{ return !sleeping.load(memory_order_relaxed); });
+                sleeping.store(false, memory_order_relaxed);
+                continue;
+            }
+            if(cells[head % Shard_queue].sequence.load(memory_order_acquire) != head + 1) continue;
+            idle = 0;
+            Cell &cell = cells[head % Shard_queue];
+            Request request = cell.request;
+            cell.sequence.store(head + Shard_queue, memory_order_release);
+            head++;
+            if(request.kind == Request::Stop) return;
+            apply(request);
+        }
+    }
+    //Whether a call for the keys in [first, last] has to wait for pairs this shard is about to take over
+    bool incoming(Key first, Key last){
+        const vector<Key> &route = *owner->route();
+        Key routeLow = index == 0 ? numeric_limits<Key>::min() : route[index - 1];
+        Key routeHigh = index == (int)route.size() ? numeric_limits<Key>::max() : route[index] - 1;
+        first = max(first, routeLow);
+        last = min(last, routeHigh);
+        return first <= last && (first < low || last > high);
+    }
+    void apply(const Request &request){
+        Reply *reply = request.reply;
+        if(request.kind <= Request::Get && (request.key < low || request.key > high)){
+            if(incoming(request.key, request.key)) deferred.push_back(request);
+            else owner->shards[owner->shardOf(request.key)]->post(request);
+            return;
+        }
+        if(request.kind == Request::Insert || request.kind == Request::Upsert){
+            bool inserted = request.kind == Request::Insert ? pma->insert(request.key, request.value) : pma->upsert(request.key, request.value);
+            if(inserted) grown();
+        }
+        else if(request.kind == Request::Remove){
+            if(pma->remove(request.key)) pairs.store(pairs.load(memory_order_relaxed) - 1, memory_order_relaxed);
+        }
+        else if(request.kind == Request::Get){
+            optional<value_t> value = pma->get(request.key);
+            reply->found = value.has_value();
+            if(value) reply->value = *value;
+        }
+        else if(request.kind == Request::Sum){
+            if(incoming(request.key, request.endKey)){
+                deferred.push_back(request);
+                return;
+            }
+            //Keys given away since the call was routed are left out, the caller asks again under the new bounds
+            Key first = max(request.key, low), last = min(request.endKey, high);
+            if(first <= last) tie(reply->sum_key, reply->sum_value) = pma->range_sum(first, last);
+        }
+        else if(request.kind == Request::Split){
+            //The key starting the run of count pairs at the end facing the neighbour
+            int64_t total = pairs.load(memory_order_relaxed);
+            reply->found = request.count > 0 && request.count < total;
+            if(reply->found) reply->key = pma->select(request.shard > index ? total - request.count : request.count).key();
+        }
+        else if(request.kind == Request::Migrate) migrate(request.shard, request.key);
+        else if(request.kind == Request::Transfer) receive(request);
+        if(reply) reply->done.store(true, memory_order_release);
+    }
+    void grown(){
+        int64_t count = pairs.load(memory_order_relaxed) + 1;
+        pairs.store(count, memory_order_relaxed);
+        if(UNLIKELY(count % Shard_check == 0)) owner->checkSkew(count);
+    }
+    //Hand the keys from split on (to the next shard) or below split (to the previous one) to shard to
+    void migrate(int to, Key split){
+        Batch *batch = new Batch();
+        typename pma_t::Cursor cursor = to > index ? pma->seek(split) : pma->begin();
+        for( ; cursor.valid() && (to > index || cursor.key() < split); cursor.next()){
+            batch->keys.push_back(cursor.key());
+            batch->values.push_back(cursor.value());
+        }
+        if(!batch->keys.empty()) pma->range_remove(batch->keys.front(), batch->keys.back());
+        pairs.store(pairs.load(memory_order_relaxed) - batch->keys.size(), memory_order_relaxed);
+        if(to > index) high = split - 1;
+        else low = split;
+        owner->shards[to]->post({Request::Transfer, index, split, split, value_t(), 0, NULL, batch});
+    }
+    //Take over the pairs a neighbour handed over, then the calls that waited for them
+    void receive(const Request &request){
+        Batch *batch = request.batch;
+        pma->insert_batch(batch->keys.data(), batch->values.data(), batch->keys.size());
+        pairs.store(pairs.load(memory_order_relaxed) + batch->keys.size(), memory_order_relaxed);
+        delete batch;
+        if(request.shard > index) high = request.key - 1;
+        else low = request.key;
+        vector<Request> waiting;
+        waiting.swap(deferred);
+        for(const Request &call : waiting) apply(call);
+        __atomic_store_n(&owner->migrating, false, __ATOMIC_RELEASE);
+    }
+};
+
+//Shards splitting [low, high] evenly, the first and last also take the keys below and above it
+PMA_TEMPLATE
+ShardedPMA<PMA_ARGS>::ShardedPMA(int shardCount, Key low, Key high, int64_t totalInsert){
+    shardCount = max(1, shardCount);
+    shardCapacity = totalInsert / shardCount + 1;
+    vector<Key> *even = new vector<Key>();
+    for(int s = 1; s < shardCount; s++) even->push_back((Key)(low + ((__int128)high - low) * s / shardCount));
+    bounds = even;
+    for(int s = 0; s < shardCount; s++){
+        Key first = s == 0 ? numeric_limits<Key>::min() : (*even)[s - 1];
+        Key last = s == shardCount - 1 ? numeric_limits<Key>::max() : (*even)[s] - 1;
+        shards.push_back(new Shard(this, s, first, last, shardCapacity));
+    }
+}
+
+PMA_TEMPLATE
+ShardedPMA<PMA_ARGS>::~ShardedPMA(){
+    //A running worker may still pass a call on to another shard, so every worker ends before any shard goes
+    drain();
+    for(Shard *shard : shards) shard->stop();
+    for(Shard *shard : shards) delete shard;
+    delete bounds;
+    for(const vector<Key> *route : oldBounds) delete route;
+}
+
+PMA_TEMPLATE
+typename ShardedPMA<PMA_ARGS>::pma_t & ShardedPMA<PMA_ARGS>::shard(int s){
+    return *shards[s]->pma;
+}
+
+PMA_TEMPLATE
+const vector<Key> * ShardedPMA<PMA_ARGS>::route(){
+    return __atomic_load_n(&bounds, __ATOMIC_ACQUIRE);
+}
+
+PMA_TEMPLATE
+int ShardedPMA<PMA_ARGS>::shardOf(const vector<Key> &route, Key key){
+    return (int)(upper_bound(route.begin(), route.end(), key) - route.begin());
+}
+
+PMA_TEMPLATE
+int ShardedPMA<PMA_ARGS>::shardOf(Key key){
+    return shardOf(*route(), key);
+}
+
+/*
+    Queue a call that returns at once. Should the bounds move while it is queued, it may have gone to the shard giving
+    its key away, which passes it on. Waiting for that shard and then for the owner of the key applies it before any
+    later call of this thread
+ */
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::send(const Request &request){
+    if(UNLIKELY(__atomic_load_n(&skewed, __ATOMIC_RELAXED))) rebalance();
+    const vector<Key> *seen = route();
+    int s = shardOf(*seen, request.key);
+    shards[s]->submit(request);
+    while(UNLIKELY(route() != seen)){
+        seen = route();
+        Reply first, second;
+        shards[s]->submit({Request::Barrier, 0, Key(), Key(), value_t(), 0, &first});
+        wait(first);
+        s = shardOf(*seen, request.key);
+        shards[s]->submit({Request::Barrier, 0, Key(), Key(), value_t(), 0, &second});
+        wait(second);
+    }
+}
+
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::insert(Key key, value_t value){
+    send({Request::Insert, 0, key, key, value});
+}
+
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::upsert(Key key, value_t value){
+    send({Request::Upsert, 0, key, key, value});
+}
+
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::remove(Key key){
+    send({Request::Remove, 0, key, key, value_t()});
+}
+
+PMA_TEMPLATE
+bool ShardedPMA<PMA_ARGS>::lookup(Key key){
+    return get(key).has_value();
+}
+
+//A shard that gave the key away passes the call on, and the owner answers it
+PMA_TEMPLATE
+optional<typename ShardedPMA<PMA_ARGS>::value_t> ShardedPMA<PMA_ARGS>::get(Key key){
+    Reply reply;
+    shards[shardOf(key)]->submit({Request::Get, 0, key, key, value_t(), 0, &reply});
+    wait(reply);
+    if(!reply.found) return nullopt;
+    return reply.value;
+}
+
+//Sums of the shards the range overlaps, which all work on it at once. Asks again if a boundary moved meanwhile
+PMA_TEMPLATE
+tuple<int64_t, int64_t> ShardedPMA<PMA_ARGS>::range_sum(Key startKey, Key endKey){
+    int64_t sum_key = 0, sum_value = 0;
+    if(UNLIKELY(startKey > endKey)) return {sum_key, sum_value};
+    while(true){
+        const vector<Key> *seen = route();
+        int first = shardOf(*seen, startKey), last = shardOf(*seen, endKey);
+        vector<Reply> replies(last - first + 1);
+        for(int s = first; s <= last; s++){
+            Key from = s == first ? startKey : (*seen)[s - 1];
+            Key to = s == last ? endKey : (*seen)[s] - 1;
+            shards[s]->submit({Request::Sum, 0, from, to, value_t(), 0, &replies[s - first]});
+        }
+        sum_key = sum_value = 0;
+        for(Reply &reply : replies){
+            wait(reply);
+            sum_key += reply.sum_key;
+            sum_value += reply.sum_value;
+        }
+        if(LIKELY(route() == seen)) return {sum_key, sum_value};
+    }
+}
+
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::wait(Reply &reply){
+    while(!reply.done.load(memory_order_acquire)) this_thread::yield();
+}
+
+//Waits for every call queued so far. A second round takes what the first passed between shards
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::drain(){
+    for(int round = 0; round < 2; round++){
+        vector<Reply> replies(shards.size());
+        for(size_t s = 0; s < shards.size(); s++) shards[s]->submit({Request::Barrier, 0, Key(), Key(), value_t(), 0, &replies[s]});
+        for(Reply &reply : replies) wait(reply);
+    }
+    while(__atomic_load_n(&migrating, __ATOMIC_ACQUIRE)) this_thread::yield();
+}
+
+//Waits for every shard to drain its queue, then moves boundaries until no shard holds Shard_skew times the mean
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::flush(){
+    drain();
+    for(int moves = 0; moves < 4 * shardCount() && rebalance(); moves++) drain();
+}
+
+//Called by a worker as its shard grows. The next call queued starts moving a boundary
+PMA_TEMPLATE
+void ShardedPMA<PMA_ARGS>::checkSkew(int64_t pairs){
+    int64_t total = 0;
+    for(Shard *shard : shards) total += shard->pairs.load(memory_order_relaxed);
+    if(pairs > Shard_skew * total / shardCount() && !__atomic_load_n(&migrating, __ATOMIC_RELAXED)) __atomic_store_n(&skewed, true, __ATOMIC_RELAXED);
+}
+
+/*
+    Moves one boundary once a shard holds over Shard_skew times the mean number of pairs. Of the neighbouring shards
+    that differ the most, the larger one gives half the difference to the other: it names the key the run starts at,
+    the bounds are replaced, and a Migrate queued behind every call routed by the old bounds hands the run over. Calls
+    routed by the new bounds wait at the receiving shard until the pairs arrive. One boundary moves at a time. Returns
+    whether it started moving one
+ */
+PMA_TEMPLATE
+bool ShardedPMA<PMA_ARGS>::rebalance(){
+    bool idle = false;
+    if(!__atomic_compare_exchange_n(&migrating, &idle, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return false;
+    __atomic_store_n(&skewed, false, __ATOMIC_RELAXED);
+    int count = shardCount(), from = 0, to = 0;
+    int64_t total = 0, largest = 0, difference = 0;
+    vector<int64_t> pairs(count);
+    for(int s = 0; s < count; s++){
+        pairs[s] = shards[s]->pairs.load(memory_order_relaxed);
+        total += pairs[s];
+        largest = max(largest, pairs[s]);
+    }
+    for(int s = 0; s + 1 < count; s++){
+        if(abs(pairs[s] - pairs[s + 1]) > difference){
+            difference = abs(pairs[s] - pairs[s + 1]);
+            from = pairs[s] > pairs[s + 1] ? s : s + 1;
+            to = pairs[s] > pairs[s + 1] ? s + 1 : s;
+        }
+    }
+    Reply split;
+    if(largest > Shard_skew * total / count && difference > 1){
+        shards[from]->submit({Request::Split, to, Key(), Key(), value_t(), difference / 2, &split});
+        wait(split);
+    }
+    if(!split.found){
+        __atomic_store_n(&migrating, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    const vector<Key> *seen = route();
+    vector<Key> *moved = new vector<Key>(*seen);
+    (*moved)[min(from, to)] = split.key;
+    oldBounds.push_back(seen);
+    __atomic_store_n(&bounds, (const vector<Key> *)moved, __ATOMIC_RELEASE);
+    shards[from]->submit({Request::Migrate, to, split.key, split.key, value_t(), 0, NULL});
+    return true;
+}
+
+//Layouts built into the library. Another key and value type or segment geometry needs its own pair of lines here
+template class BPlusTree<int64_t, int64_t>;
+template class PMA<int64_t, int64_t>;
+template class BPlusTree<int32_t, int32_t>;
+template class PMA<int32_t, int32_t>;
+template class BPlusTree<int64_t, void>;
+template class PMA<int64_t, void>;
+template class ConcurrentPMA<int64_t, int64_t>;
+template class ConcurrentPMA<int32_t, int32_t>;
+template class ConcurrentPMA<int64_t, void>;
+template class ShardedPMA<int64_t, int64_t>;
+template class ShardedPMA<int32_t, int32_t>;
+template class ShardedPMA<int64_t, void>;
@@ -4,121 +4,625 @@
 #include <vector>
 #include <tuple>
 #include <array>
+#include <limits>
+#include <type_traits>
+#include <optional>
+#include <mutex>
 
 #include "defines.hpp"
 using namespace std;
 
-class PMA;
+//Template head and arguments shared by the out-of-line members of PMA and BPlusTree
+#define PMA_TEMPLATE template<typename Key, typename Value, int SegmentBytes, int Degree>
+#define PMA_ARGS Key, Value, SegmentBytes, Degree
 
+template<typename Key, typename Value, int SegmentBytes = SEGMENT_SIZE, int Degree = Tree_Degree> class PMA;
+
+//Value of the key-only layout PMA<Key, void>. It is never stored
+struct NoValue{};
+
+/*
+    Value filter of the filtered scans. A value, widened to 64 bits, passes if it lies in [low, high], or if it is one of
+    the members when there are any. The key-only layout tests its keys instead
+ */
+struct ValuePredicate{
+    int64_t low = numeric_limits<int64_t>::min(), high = numeric_limits<int64_t>::max();
+    vector<int64_t> member;   //Empty for a range test. Each member costs a compare per value
+
+    static ValuePredicate between(int64_t low, int64_t high){
+        ValuePredicate p;
+        p.low = low;
+        p.high = high;
+        return p;
+    }
+    static ValuePredicate equal(int64_t v){ return between(v, v); }
+    static ValuePredicate lessEqual(int64_t v){ return between(numeric_limits<int64_t>::min(), v); }
+    static ValuePredicate greaterEqual(int64_t v){ return between(v, numeric_limits<int64_t>::max()); }
+    static ValuePredicate less(int64_t v){ return v == numeric_limits<int64_t>::min() ? between(1, 0) : lessEqual(v - 1); }
+    static ValuePredicate greater(int64_t v){ return v == numeric_limits<int64_t>::max() ? between(1, 0) : greaterEqual(v + 1); }
+    static ValuePredicate in(const int64_t *members, size_t count){
+        ValuePredicate p;
+        p.member.assign(members, members + count);
+        if(count == 0) p.low = 1, p.high = 0;
+        return p;
+    }
+    bool test(int64_t v) const {
+        if(member.empty()) return v >= low && v <= high;
+        for(int64_t m : member) if(v == m) return true;
+        return false;
+    }
+};
+
+//Persistent worker threads of the parallel scans, defined with them in JPMA_BT.cpp
+class WorkerPool;
+
+/*
+    Entries indexed by segment number, kept in pages of PageSize entries that are never moved once allocated. Growing
+    appends pages, so it costs no copy of the entries and references to them stay valid. When the table of pages fills
+    it is replaced by a copy twice as large, and the old tables are kept until the directory goes away for readers that
+    may still have loaded them
+ */
+template<typename T, size_t PageSize>
+class SegmentDirectory{
+    static_assert((PageSize & (PageSize - 1)) == 0, "Entries are found by a shift and a mask");
+public:
+    SegmentDirectory() = default;
+    SegmentDirectory(const SegmentDirectory &) = delete;
+    SegmentDirectory &operator=(const SegmentDirectory &) = delete;
+    ~SegmentDirectory(){
+        for(size_t p = 0; p < pageCount; p++) delete[] table[p];
+        delete[] table;
+        for(T **old : oldTables) delete[] old;
+    }
+    //Any table loaded since the entry was added holds its page, so readers may keep one across calls
+    T &operator[](size_t i){ return __atomic_load_n(&table, __ATOMIC_ACQUIRE)[i / PageSize][i % PageSize]; }
+    const T &operator[](size_t i) const { return __atomic_load_n(&table, __ATOMIC_ACQUIRE)[i / PageSize][i % PageSize]; }
+    size_t size() const { return count; }
+    //Grow to n entries, value-initializing the new ones. Never shrinks
+    void resize(size_t n){
+        while(pageCount * PageSize < n) addPage();
+        if(n > count) count = n;
+    }
+    void push_back(const T &entry){
+        resize(count + 1);
+        (*this)[count - 1] = entry;
+    }
+private:
+    T **table = NULL;
+    size_t pageCount = 0, tableCapacity = 0, count = 0;
+    vector<T **> oldTables;
+
+    void addPage(){
+        if(pageCount == tableCapacity){
+            size_t capacity = tableCapacity == 0 ? 16 : tableCapacity * 2;
+            T **grown = new T*[capacity];
+            for(size_t p = 0; p < pageCount; p++) grown[p] = table[p];
+            if(table != NULL) oldTables.push_back(table);
+            __atomic_store_n(&table, grown, __ATOMIC_RELEASE);
+            tableCapacity = capacity;
+        }
+        table[pageCount++] = new T[PageSize]();
+    }
+};
+
+/*
+    B+ tree over the segments of a PMA<Key, Value, SegmentBytes, Degree>. Leaves hold up to Degree segment numbers and
+    nodes up to Degree children, routed by Key separators
+ */
+template<typename Key, typename Value, int SegmentBytes = SEGMENT_SIZE, int Degree = Tree_Degree>
 class BPlusTree{
+    static_assert(Degree >= 4 && Degree <= 32, "Child search keeps one bit per key of a node in a 32-bit mask");
 public:
+    typedef PMA<PMA_ARGS> pma_t;
+    struct Node;
+
+    //Count, sums and bounds of the pairs under a child of a node, in a segment or in a key range
+    struct Aggregate{
+        int64_t count = 0, keySum = 0, valueSum = 0;
+        Key min = numeric_limits<Key>::max(), max = numeric_limits<Key>::min();
+        void add(const Aggregate &a){
+            count += a.count; keySum += a.keySum; valueSum += a.valueSum;
+            if(a.min < min) min = a.min;
+            if(a.max > max) max = a.max;
+        }
+    };
+
+    //Keys of a leaf or node, padded to whole 32-byte vectors. The last load of childPosition stays in the array
+    static constexpr int keyLanes = sizeof(Key) < 32 ? 32 / sizeof(Key) : 1;
+    static constexpr int keySlots = (Degree - 1 + keyLanes - 1) / keyLanes * keyLanes;
+
+    /*
+        A leaf or node version is odd while a writer changes its keys, children, count or leaf links, and moves on once
+        it is done. Readers descend without locks and start over when a version they passed has moved. Aggregates are not
+        covered, threads sharing the tree do not keep them. A writer that may split or merge leaves and nodes also holds
+        their writer latch for its whole change, which other writers wait on and readers never look at
+     */
     typedef struct Leaf{
-        type_t key[Tree_Degree-1];
-        int segNo[Tree_Degree];
+        uint64_t version = 0;
+        Key key[keySlots];
+        int segNo[Degree];
         short childCount = 0;
+        bool writer = false;
         Leaf *nextLeaf = NULL;
+        Leaf *prevLeaf = NULL;
+        Node *parent = NULL;
+        short slot = 0;        //Index in the children of parent, kept with it
         //Leaf() : childCount(0), nextLeaf(NULL) {}
     }leaf;
 
     //No node should have a combination of child of leaf and node
     typedef struct Node{
-        type_t key[Tree_Degree-1];
-        Node *child_ptr[Tree_Degree];
+        uint64_t version = 0;
+        Key key[keySlots];
+        Node *child_ptr[Degree];
+        Aggregate agg[Degree]; //Pairs under each child
         bool nodeLeaf = false; //Last non-leaf node has value true
         short ptrCount = 0;
+        bool writer = false;
+        Node *parent = NULL;   //NULL for root
+        short slot = 0;        //Index in the children of parent, kept with it
         //Node() : ptrCount(0), nodeLeaf(false){}
     }node;
     node *root;
     double *minLevel, *maxLevel;
     int totalLevel;
+    uint64_t descentCount = 0, nodeVisitCount = 0; //Root to leaf walks and nodes touched by them
+    bool shared = false;               //Threads share the tree: unlinked nodes wait for reclaim and writers descend like readers
+    bool rootWriter = false;           //Writer latch of the root pointer
+    vector<pair<uint64_t, node *>> retiredNodes;    //With the epoch they were unlinked in
+    vector<pair<uint64_t, leaf *>> retiredLeaves;
+    mutex retireLatch;
+    bool keepAggregates = true;        //Off while threads share the tree, changes then only mark the aggregates stale
+    bool staleAggregates = false;      //Rebuilt by the next call reading them
     //int maxElementInSegment;
 
-    BPlusTree(PMA *obj);
-    leaf* findLeaf(type_t search_key);
-    int findInLeaf(leaf *leaf, int SKey);
-    leaf* findLeftSiblingLeaf(void *p, int key);
-    inline int searchSegment(type_t search_key);
-    void insertInTree(int chunkNo, type_t search_key, PMA *obj);
-    void insert_in_parent(void *left, type_t search_key, void *right, type_t key_for_leaf);
-    void rebalanceOnDelete(leaf *p, type_t key);
-    void rebalanceOnDelete(node *n, type_t key);
-    node * findParent(node *root, void *n, type_t key_parent);
+    BPlusTree(pma_t *obj);
+    leaf* findLeaf(Key search_key);
+    leaf* descendOptimistic(Key search_key, uint64_t &leafVersion);
+    static inline uint64_t stableVersion(const uint64_t &version);
+    static inline bool unchanged(const uint64_t &version, uint64_t seen);
+    static inline void lockVersion(uint64_t &version);
+    static inline void unlockVersion(uint64_t &version);
+    leaf* latchPath(Key search_key, bool removing, vector<bool *> &held);
+    static inline void latch(bool &writer);
+    static void unlatchAll(vector<bool *> &held);
+    int findInLeaf(leaf *leaf, Key SKey);
+    optional<Key> segmentBound(leaf *l, int pos);
+    leaf* findLeftSiblingLeaf(leaf *p);
+    inline int searchSegment(Key search_key);
+    void insertInTree(int chunkNo, Key search_key, pma_t *obj);
+    void buildFromSegments(const vector<int> &segments, pma_t *obj);
+    void insert_in_parent(leaf *left, Key search_key, leaf *right, pma_t *obj);
+    void insert_in_parent(node *left, Key search_key, node *right, pma_t *obj);
+    void insertInNode(node *N, void *left, Key search_key, void *right, pma_t *obj);
+    leaf* rebalanceOnDelete(leaf *p, Key key, pma_t *obj);
+    void rebalanceOnDelete(node *n, Key key, pma_t *obj);
+    inline void setParent(node *parent, int from, int to);
+
+    //Aggregates of the children of nodes
+    Aggregate leafAggregate(leaf *l, pma_t *obj);
+    Aggregate nodeAggregate(node *n);
+    inline Aggregate childAggregate(void *child, bool isLeaf, pma_t *obj);
+    void refreshNode(node *n, pma_t *obj);
+    void refreshUp(node *n);
+    void refreshLeaf(leaf *l, pma_t *obj);
+    void propagate(leaf *l, Key key, int64_t value, int sign, pma_t *obj);
+    void propagateValue(leaf *l, int64_t delta);
+    inline void markStale();
+    void freshAggregates(pma_t *obj);
+    void rebuildAggregates(node *n, pma_t *obj);
 
     void calculateThreshold(int elements);
     void listSegments(vector<int> &segments, node *parent);
-    type_t findCardinality(BPlusTree::leaf *l, PMA *obj);
-    type_t findCardinality(BPlusTree::node *n, PMA *obj);
+    int64_t findCardinality(leaf *l, pma_t *obj);
+    int64_t findCardinality(node *n, pma_t *obj);
 
     leaf* leftmostLeaf(node *root);
     leaf* rightmostLeaf(node *root);
     void deleteNode(node *parent);
-    void deleteLeaf(leaf *l, type_t SKey);
-    void printAllElements(PMA *obj);
+    void deleteLeaf(leaf *l);
+    void retire(node *n);
+    void retire(leaf *l);
+    void reclaim(uint64_t before = numeric_limits<uint64_t>::max());
+    size_t retiredCount();
+    void printAllElements(pma_t *obj);
     void printTree(vector<Node *> nodes, int level);
     void printTree(vector<Leaf *> nodes, int level);
     void showTreeStat();
 };
 
+/*
+    Packed memory array of Key-Value pairs. Keys and values live in separate arrays of SegmentBytes / sizeof(Key) slots
+    per segment, so narrower keys fit more elements in a segment and in each cache line the scans touch.
+    With a void Value the PMA is a set of keys: no value chunk is allocated and rebalancing moves the keys alone
+ */
+template<typename Key, typename Value, int SegmentBytes, int Degree>
 class PMA{
+    static_assert(is_integral<Key>::value && (is_integral<Value>::value || is_void<Value>::value), "Gaps, sums and masked scans need integer keys and values");
+    static_assert(SegmentBytes % (sizeof(Key) * JacobsonIndexSize) == 0, "A segment holds whole bitmap blocks");
+    static_assert(CHUNK_SIZE % SegmentBytes == 0, "A chunk holds whole segments");
 public:
-    vector<type_t *> key_chunks;
-    vector<type_t *> value_chunks;
-    vector<type_t> smallest;
-    vector<type_t> lastElementPos;
-    vector<int> cardinality;
+    typedef BPlusTree<PMA_ARGS> tree_t;
+    typedef typename tree_t::leaf leaf_t;
+    typedef typename tree_t::Aggregate aggregate_t;
+    static constexpr bool isSet = is_void<Value>::value;
+    typedef typename conditional<isSet, NoValue, Value>::type value_t;
+    typedef pair<Key, value_t> pair_t;
+    static constexpr size_t valueChunkSize = CHUNK_SIZE / sizeof(Key) * sizeof(value_t); //Value chunk matching a key chunk
+    static constexpr size_t segmentsInChunk = CHUNK_SIZE / SegmentBytes;                   //Segments of a directory page
+    struct alignas(64) SegmentLatch{ uint64_t version = 0; };                               //Odd while a writer holds the segment
+
+    //Metadata of a segment. All of it shares the segment's first cache line on the insert and lookup paths
+    typedef struct alignas(64) SegmentHeader{
+        u_short bitmap[SegmentBytes/sizeof(Key)/JacobsonIndexSize] = {};    //Occupancy of the slots
+        Key smallest = 0;                                                   //Smallest key in the segment
+        int cardinality = 0;                                                //Number of elements in the segment
+        int buffered = 0;                                                   //Inserts held back in its write buffer
+        int64_t lastElementPos = 0;                                         //Position of last element in the segment
+        int64_t keySum = 0, valueSum = 0;                                   //Sums of the keys and values in the segment
+    }segment;
+
+    SegmentDirectory<Key *, segmentsInChunk> key_chunks;
+    SegmentDirectory<value_t *, segmentsInChunk> value_chunks;   //Empty for a set
+    SegmentDirectory<segment, segmentsInChunk> header;           //Segment headers, indexed by segment number. They never move
     int totalSegments;
     int elementsInSegment;
+#if Bitmap_engine == 1
     u_char NonZeroEntries[JacobsonIndexCount][JacobsonIndexSize+1];
-    vector<vector<u_short>> bitmap;
-    BPlusTree *tree;
-    type_t lastValidPos;             //Last accessible slot in each segment
+#endif
+    tree_t *tree;
+    int64_t lastValidPos;             //Last accessible slot in each segment
     int freeSegmentCount;
-    type_t blocksInSegment;
-    vector<type_t *> cleanSegments;
+    int64_t blocksInSegment;
+    vector<void *> cleanSegments;   //Key and value chunks, alternating. Key chunks only for a set
     vector<int> freeSegID;
     int segCount;
-    int redisInsCount = 0, redisUpCount = 0;
+    WorkerPool *pool = NULL;        //Workers of range_sum_parallel, NULL to scan on the calling thread
+    int redisInsCount = 0, redisUpCount = 0, redisWindowCount = 0;   //Counted atomically, restructurings of a ConcurrentPMA run at once
+    mutex *allocationLatch = NULL;  //Held around taking and recycling segments when ConcurrentPMA shares the PMA
+    SegmentDirectory<SegmentLatch, segmentsInChunk> *segmentLatches = NULL;   //Of a ConcurrentPMA, grown with the headers
+
+    //Pending inserts of a segment in key order, each of a key absent from its slots. The header counts them in buffered,
+    //the tree aggregates count them already and the rest of the header once merged
+    struct WriteBuffer{
+        Key keys[Write_buffer];
+        value_t values[Write_buffer];
+        bool listed = false;   //In dirtySegments
+        uint64_t filter[8] = {};   //Bits of the keys in the segment or its inserts. Removes leave them, a layout resets them
+    };
+    SegmentDirectory<WriteBuffer, segmentsInChunk> buffers;   //Sized once the write buffer is turned on
+    vector<int> dirtySegments;                                 //Segments given messages since the last mergeBuffers
+    bool writeBuffer = false;
 
-    PMA(type_t totalInsert);
+    PMA(int64_t totalInsert);
     ~PMA();
 
     //Library functions
-    bool insert(type_t key, type_t value);
-    bool remove(type_t key);
-    bool lookup(type_t key);
-    tuple<type_t, type_t> range_sum(type_t startKey, type_t endKey);
-    type_t range_sum2(type_t startKey, type_t endKey);
+    bool insert(Key key, value_t value);
+    size_t insert_batch(const Key *keys, const value_t *values, size_t n);
+    size_t bulk_load(const Key *keys, const value_t *values, size_t n, double density);
+    bool remove(Key key);
+    size_t range_remove(Key startKey, Key endKey);
+    bool lookup(Key key);
+    optional<value_t> get(Key key);
+    bool update(Key key, value_t value);
+    bool upsert(Key key, value_t value);
+    tuple<int64_t, int64_t> range_sum(Key startKey, Key endKey);
+    tuple<int64_t, int64_t> range_sum_scan(Key startKey, Key endKey);
+    tuple<int64_t, int64_t> range_sum_parallel(Key startKey, Key endKey);
+    void setThreads(int threads);
+    void setWriteBuffer(bool enabled);
+    int64_t range_sum2(Key startKey, Key endKey);
+    aggregate_t range_aggregate(Key startKey, Key endKey);
+    aggregate_t range_sum_where(Key startKey, Key endKey, const ValuePredicate &predicate);
+
+    /*
+        Forward cursor over the pairs in key order. Keys and values are read in place while it steps through the
+        occupancy bitmap of a block, the segments of a leaf and the leaf chain. Any insert or remove invalidates it
+     */
+    class Cursor{
+    public:
+        Cursor(PMA *pma) : pma(pma) {}
+        bool valid() const { return position >= 0; }
+        Key key() const { return keys[position]; }
+        value_t value() const {
+            if constexpr(isSet) return value_t();
+            else return values[position];
+        }
+        //Steps within the current block inline, settle moves on to the next blocks and segments
+        void next(){
+            bits &= bits - 1;
+            if(LIKELY(bits)) position = position - position % JacobsonIndexSize + __builtin_ctz(bits);
+            else settle(position - position % JacobsonIndexSize + JacobsonIndexSize);
+        }
+    private:
+        friend class PMA;
+        PMA *pma;
+        leaf_t *leaf = NULL;
+        int segPos = 0;               //Position of the current segment in its leaf
+        int targetSegment = 0;
+        const Key *keys = NULL;       //Key and value slots of the current segment
+        const value_t *values = NULL;
+        u_int bits = 0;               //Occupied slots of the current block from the cursor on
+        int64_t position = -1;        //Slot of the current pair, -1 past the last pair
+        void settle(int64_t from);
+    };
+    Cursor seek(Key key);
+    Cursor begin();
+
+    //Backward cursor over the pairs in descending key order, the mirror of Cursor. next steps to the previous pair
+    class ReverseCursor{
+    public:
+        ReverseCursor(PMA *pma) : pma(pma) {}
+        bool valid() const { return position >= 0; }
+        Key key() const { return keys[position]; }
+        value_t value() const {
+            if constexpr(isSet) return value_t();
+            else return values[position];
+        }
+        void next(){
+            bits &= ~(1u << (position % JacobsonIndexSize));
+            if(LIKELY(bits)) position = position - position % JacobsonIndexSize + 31 - __builtin_clz(bits);
+            else settle(position - position % JacobsonIndexSize - 1);
+        }
+    private:
+        friend class PMA;
+        PMA *pma;
+        leaf_t *leaf = NULL;
+        int segPos = 0;
+        int targetSegment = 0;
+        const Key *keys = NULL;
+        const value_t *values = NULL;
+        u_int bits = 0;               //Occupied slots of the current block up to the cursor
+        int64_t position = -1;        //Slot of the current pair, -1 before the first pair
+        void settle(int64_t from);
+    };
+    ReverseCursor rseek(Key key);
+    ReverseCursor rbegin();
+    optional<pair_t> lower_bound(Key key);
+    optional<pair_t> upper_bound(Key key);
+    optional<pair_t> successor(Key key);
+    optional<pair_t> predecessor(Key key);
+    tuple<int64_t, int64_t> range_sum_desc(Key startKey, Key endKey, int64_t limit);
+    int64_t rank(Key key);
+    Cursor select(int64_t k);
+    int64_t range_count(Key startKey, Key endKey);
+    template<typename F> void scan_blocks(Key startKey, Key endKey, F consume);
+
+    //Key-only calls of the set layout
+    template<bool Set = isSet> typename enable_if<Set, bool>::type insert(Key key){ return insert(key, value_t()); }
+    template<bool Set = isSet> typename enable_if<Set, size_t>::type insert_batch(const Key *keys, size_t n){ return insert_batch(keys, NULL, n); }
+    template<bool Set = isSet> typename enable_if<Set, size_t>::type bulk_load(const Key *keys, size_t n, double density){ return bulk_load(keys, NULL, n, density); }
 
     //Support functions
-    inline int searchSegment(type_t key);
-    //tuple<type_t *, type_t *> getSegment();
+    inline int searchSegment(Key key);
+    bool insertOrAssign(Key key, value_t value, bool assign);
+    bool placeInSegment(leaf_t *leaf, int targetSegment, Key key, value_t value, bool assign);
+    bool takeFromSegment(leaf_t *leaf, int targetSegment, Key key);
+    int64_t findKey(Key key, int targetSegment);
+    inline int64_t locate(Key key, leaf_t *&leaf, int &targetSegment);
+    void assignAt(leaf_t *leaf, int targetSegment, int64_t position, value_t value);
+    int bufferInsert(leaf_t *leaf, int targetSegment, Key key, value_t value, bool assign);
+    inline int messagePosition(int targetSegment, Key key);
+    inline int pendingMessage(int targetSegment, Key key);
+    void addMessage(int targetSegment, int i, Key key, value_t value);
+    void dropMessage(int targetSegment, int i);
+    inline void settleBuffer(int targetSegment);
+    void mergeBuffer(int targetSegment);
+    void relayBuffer(int targetSegment, const Key *carriedKeys, const value_t *carriedValues, int head, int carried, int insert);
+    void mergeLeaf(leaf_t *leaf);
+    static inline uint64_t filterMask(Key key, int &word);
+    inline bool mayHold(int targetSegment, Key key);
+    inline void addToFilter(int targetSegment, Key key);
+    void resetFilter(int targetSegment);
+    void resetFilter(int targetSegment, const Key *keys, int64_t count);
+    void mergeBuffers();
+    //tuple<int64_t *, int64_t *> getSegment();
     int getSegment();
     void preCalculateJacobson();
-    void insertInPosition(type_t position, int targetSegment, type_t key, type_t value);
-    bool backSearchInsert(type_t position, type_t key, type_t value, int targetSegment, int count);
-    bool insertForward(type_t position, type_t key, type_t value, int targetSegment, int count); //Extra
-    bool insertBackward(type_t position, type_t key, type_t value, int targetSegment, int count); //Extra
-    bool insertAfterLast(type_t position, type_t key, type_t value, int targetSegment, type_t foundKey);
+    inline int blockCount(u_short block);
+    inline int blockFirst(u_short block);
+    inline int blockLast(u_short block);
+    inline int blockSelect(u_short block, int k);
+    inline u_char * blockSlots(u_short block, u_char *slots);
+    inline uint64_t bitmapWord(int targetSegment, int64_t word);
+    inline value_t valueAt(int targetSegment, int64_t position);
+    inline void setValue(int targetSegment, int64_t position, value_t value);
+    static inline const value_t * valuesFrom(const value_t *values, int64_t offset);
+    static inline int64_t summand(value_t value);
+    static inline int64_t keyGap(Key smaller, Key larger);
+    int64_t nextOccupied(int targetSegment, int64_t position);
+    int64_t prevOccupied(int targetSegment, int64_t position);
+    int64_t nextVacant(int targetSegment, int64_t position);
+    int64_t prevVacant(int targetSegment, int64_t position);
+    void insertInPosition(int64_t position, int targetSegment, Key key, value_t value);
+    void fillSegment(int targetSegment, const Key *keys, const value_t *values, int64_t count);
+    bool backSearchInsert(int64_t position, Key key, value_t value, int targetSegment, int count);
+    bool insertForward(int64_t position, Key key, value_t value, int targetSegment, int count); //Extra
+    bool insertBackward(int64_t position, Key key, value_t value, int targetSegment, int count); //Extra
+    bool insertAfterLast(int64_t position, Key key, value_t value, int targetSegment, Key foundKey);
     void deleteSegment(int targetSegment);
-    type_t findLocation(type_t key, int targetSegment);
-    type_t findLocation1(type_t key, int targetSegment);
-    type_t findLocation2(type_t key, int targetSegment);
-    void redistributeInsert(int segment, type_t Skey);
+    int64_t findLocation(Key key, int targetSegment);
+    int64_t findLocation1(Key key, int targetSegment);
+    int64_t findLocation2(Key key, int targetSegment);
+    void redistributeInsert(int segment, Key Skey);
     int redistributeWithDividing(int targetSegment);
-    int mergeTwoSegments(int startSeg, int endSeg, int totalElements);
-    void mergeMultipleSegments(BPlusTree::leaf *p, int startLoc, int endLoc, type_t totalElements, bool isAllElements);
-    void redistributeTwotoTwo(BPlusTree::leaf *p, int startSeg, int endSeg, type_t totalElements);
-    void redistributeNToM(BPlusTree::leaf *p, int start, int end, type_t totalElements);
-    void redistributeRemove(int targetSegment);
-    inline void swapElements(type_t targetSegment, type_t position, type_t adjust);
+    void gatherSegments(leaf_t *p, int start, int end, vector<Key> &keys, vector<value_t> &values);
+    void mergeMultipleSegments(leaf_t *p, int startLoc, int endLoc, int64_t totalElements);
+    void redistributeNToM(leaf_t *p, int start, int end, int64_t totalElements);
+    void spreadSegments(leaf_t *p, int start, int end, const Key *keys, const value_t *values, int64_t count);
+    void redistributeRemove(leaf_t *p, int targetSegment, bool rebalanceLeaf = true);
+    tuple<int64_t, int64_t> scanLeaves(leaf_t *leaf, Key startKey, Key endKey);
+    bool sumSegmentDesc(int targetSegment, int64_t position, Key startKey, int64_t &remaining, int64_t &sum_key, int64_t &sum_value);
+    bool takeBlockDesc(int targetSegment, int64_t blockNo, u_int bits, Key startKey, int64_t &remaining, int64_t &sum_key, int64_t &sum_value);
+    bool sumSegmentFrom(int targetSegment, Key startKey, Key endKey, int64_t &sum_key, int64_t &sum_value);
+    bool sumSegment(int targetSegment, int64_t fromBlock, Key endKey, int64_t &sum_key, int64_t &sum_value);
+    void sumBlocks(int targetSegment, int64_t fromBlock, int64_t toBlock, int64_t &sum_key, int64_t &sum_value);
+    inline void prefetchSegment(int targetSegment);
+    void filterBlocks(int targetSegment, int64_t fromBlock, int64_t toBlock, u_int firstMask, u_int lastMask, const ValuePredicate &predicate, aggregate_t &total);
+    aggregate_t segmentAggregate(int targetSegment);
+    aggregate_t segmentPrefix(int targetSegment, int64_t position);
+    aggregate_t prefixAggregate(Key bound, aggregate_t &after);
+    int64_t countUpTo(Key bound);
+    int64_t lastAtMost(int targetSegment, Key bound);
+    int64_t occupiedUpTo(int targetSegment, int64_t position);
+    void account(leaf_t *leaf, int targetSegment, Key key, value_t value, int sign);
+    void recountSegment(int targetSegment);
+    inline void swapElements(int64_t targetSegment, int64_t position, int64_t adjust);
 
     //Testing functions
     void printStat();
     void printAllElements();
     void printSegElements(int targetSegment);
-    type_t findSegmentElements(int segno);
+    int64_t findSegmentElements(int segno);
 
     void checkElementWise(vector<int> usedSegment, vector<int>newSegments);
 };
 
+/*
+    Hands the pairs in [startKey, endKey] to consume(keys, values, occupancyMask, count) in place, up to 64 slots of a
+    segment per call. Bit j of the mask is set for the slots j < count holding a pair in the range, so keys[j] and
+    values[j] can be loaded whole and masked. values is NULL for a set. Defined here as it is instantiated per consumer
+ */
+template<typename Key, typename Value, int SegmentBytes, int Degree>
+template<typename F>
+void PMA<PMA_ARGS>::scan_blocks(Key startKey, Key endKey, F consume){
+    mergeBuffers();
+    leaf_t *leaf = tree->findLeaf(startKey);
+    int segPos = tree->findInLeaf(leaf, startKey);
+    int64_t from = findLocation(startKey, leaf->segNo[segPos]) / 64 * 64;
+    bool trimStart = true;
+    while(true){
+        int targetSegment = leaf->segNo[segPos];
+        const segment &seg = header[targetSegment];
+        const Key *keys = key_chunks[targetSegment];
+        const value_t *values = isSet ? NULL : value_chunks[targetSegment];
+        int64_t end = seg.cardinality > 0 ? seg.lastElementPos + 1 : 0;
+        for(int64_t base = from; base < end; base += 64){
+            int count = min((int64_t)64, elementsInSegment - base);
+            uint64_t mask = 0;
+            for(int b = 0; b < count / JacobsonIndexSize; b++) mask |= (uint64_t)seg.bitmap[base / JacobsonIndexSize + b] << (b * JacobsonIndexSize);
+            if(mask == 0) continue;
+            //Keys before startKey only show up until the first key of the range
+            if(UNLIKELY(trimStart)){
+                while(mask && keys[base + __builtin_ctzll(mask)] < startKey) mask &= mask - 1;
+                if(mask == 0) continue;
+                trimStart = false;
+            }
+            bool last = keys[base + 63 - __builtin_clzll(mask)] > endKey;
+            if(UNLIKELY(last)){
+                while(mask && keys[base + 63 - __builtin_clzll(mask)] > endKey) mask &= ~(1ULL << (63 - __builtin_clzll(mask)));
+            }
+            if(mask) consume(keys + base, isSet ? NULL : values + base, mask, count);
+            if(UNLIKELY(last)) return;
+        }
+        if(++segPos == leaf->childCount){
+            leaf = leaf->nextLeaf;
+            segPos = 0;
+            if(leaf == NULL) return;
+        }
+        from = 0;
+    }
+}
+
+/*
+    PMA shared by threads. Each segment has a version latch, odd while a writer holds it. Readers descend the tree with
+    optimistic lock coupling and read a segment between two loads of its version, starting over if a writer got in
+    between. Writers that stay in one segment hold its latch alone. Inserts that would overflow a segment, removes that
+    would drain one, and the rebalancing they set off latch the tree nodes they may change from the root down, letting
+    go of those above a node no change gets past, so restructurings of disjoint subtrees run at once. They hold the
+    latches of the segments of their leaf and the versions of the tree nodes they change, and take segments from the
+    pool under a latch of its own. The segment directory grows under the other threads as its entries never move. Tree
+    nodes unlinked by a restructuring are freed by epochs, which every call announces in a slot of its thread only. Up
+    to Epoch_slots threads get a slot, the calls of any further thread count in a shared one that holds back freeing
+    until none of them runs. The tree aggregates are not kept meanwhile: direct calls needing them rebuild them once
+    the threads are done
+ */
+template<typename Key, typename Value, int SegmentBytes = SEGMENT_SIZE, int Degree = Tree_Degree>
+class ConcurrentPMA{
+public:
+    typedef PMA<PMA_ARGS> pma_t;
+    typedef typename pma_t::value_t value_t;
+    typedef typename pma_t::leaf_t leaf_t;
+
+    pma_t pma;   //Direct calls only while no other thread uses the ConcurrentPMA
+
+    ConcurrentPMA(int64_t totalInsert);
+    ~ConcurrentPMA();
+    bool insert(Key key, value_t value);
+    bool upsert(Key key, value_t value);
+    bool remove(Key key);
+    bool lookup(Key key);
+    optional<value_t> get(Key key);
+    bool update(Key key, value_t value);
+    tuple<int64_t, int64_t> range_sum(Key startKey, Key endKey);
+    template<bool Set = pma_t::isSet> typename enable_if<Set, bool>::type insert(Key key){ return insert(key, value_t()); }
+
+private:
+    static constexpr size_t retireLimit = 256;   //Retired tree nodes and leaves kept before they are freed
+    mutex allocation;
+    SegmentDirectory<typename pma_t::SegmentLatch, pma_t::segmentsInChunk> latches;   //Indexed by segment number
+
+    bool insertOrAssign(Key key, value_t value, bool assign);
+    inline int route(Key key, leaf_t *&leaf, uint64_t &leafVersion);
+    inline void lockSegment(int targetSegment);
+    inline void unlockSegment(int targetSegment);
+    inline uint64_t readBegin(int targetSegment);
+    inline bool readValid(int targetSegment, uint64_t version);
+    void reclaim();
+    void latchSegments(leaf_t *leaf, vector<int> &held);
+    void latchNeighbourSegments(leaf_t *leaf, vector<int> &held);
+    void rebalanceLeaf(Key key);
+};
+
+/*
+    PMAs each owning a range of keys, one per worker thread. A call goes to the shard owning its key through a bounded
+    lock-free queue that only the worker of the shard drains, so no shard is ever touched by two threads. insert,
+    upsert and remove return once queued. lookup, get and range_sum wait for their answer, which reflects the calls the
+    same thread queued before them. range_sum asks every shard the range overlaps at once. A shard growing past
+    Shard_skew times the mean number of pairs has the next call move one boundary, handing a key range to a neighbour
+    through the workers while calls go on. flush waits for all calls queued so far and moves boundaries until no shard
+    is that large. Nothing else may be called during flush
+ */
+template<typename Key, typename Value, int SegmentBytes = SEGMENT_SIZE, int Degree = Tree_Degree>
+class ShardedPMA{
+public:
+    typedef PMA<PMA_ARGS> pma_t;
+    typedef typename pma_t::value_t value_t;
+
+    ShardedPMA(int shardCount, Key low, Key high, int64_t totalInsert);
+    ~ShardedPMA();
+    void insert(Key key, value_t value);
+    void upsert(Key key, value_t value);
+    void remove(Key key);
+    bool lookup(Key key);
+    optional<value_t> get(Key key);
+    tuple<int64_t, int64_t> range_sum(Key startKey, Key endKey);
+    void flush();
+    int shardCount() const { return (int)shards.size(); }
+    pma_t & shard(int s);   //Direct calls only between a flush and the next queued call
+    template<bool Set = pma_t::isSet> typename enable_if<Set, void>::type insert(Key key){ insert(key, value_t()); }
+
+private:
+    struct Request;
+    struct Reply;
+    struct Batch;
+    class Shard;
+    vector<Shard *> shards;
+    const vector<Key> *bounds;           //Smallest key of each shard but the first, which takes every key below bounds[0]
+    vector<const vector<Key> *> oldBounds;   //Replaced bounds, kept for calls that may still route by them
+    bool migrating = false;              //A boundary is moving, from the Split to the hand-over of its pairs
+    bool skewed = false;                 //A worker found its shard over Shard_skew times the mean
+    int64_t shardCapacity;               //Expected elements of a shard, sizing its PMA
+
+    inline const vector<Key> * route();
+    inline int shardOf(const vector<Key> &route, Key key);
+    inline int shardOf(Key key);
+    void send(const Request &request);
+    void wait(Reply &reply);
+    void drain();
+    void checkSkew(int64_t pairs);
+    bool rebalance();
+};
+
 #endif
\ No newline at end of file
@@ -7,11 +7,46 @@
 
 #include "JPMA_BT.hpp"
 #include <time.h>
+#include <unistd.h>
+#include <thread>
+#include <algorithm>
 
 #define InsertSize 10737418
 
+//Key and value types of the benchmarked PMA, void values for a set. Must be one of the layouts instantiated at the end
+//of JPMA_BT.cpp
+#ifndef Benchmark_key
+#define Benchmark_key int64_t
+#endif
+#ifndef Benchmark_value
+#define Benchmark_value int64_t
+#endif
+
 using namespace std;
 
+typedef PMA<Benchmark_key, Benchmark_value> BenchmarkPMA;
+typedef BenchmarkPMA::value_t BenchmarkValue;
+const size_t valueBytes = BenchmarkPMA::isSet ? 0 : sizeof(BenchmarkValue);
+
+//Value inserted with a key, ten times the key. A set stores none
+template<typename Value = BenchmarkValue>
+static inline Value benchmarkValue(Benchmark_key key){
+    if constexpr(is_same<Value, NoValue>::value) return Value();
+    else return key * 10;
+}
+
+//Range sums of keys and values hold the same ratio. A set only sums keys
+static inline bool sumsMatch(int64_t sum_key, int64_t sum_value){
+    return BenchmarkPMA::isSet || sum_key*10 == sum_value;
+}
+
+//A value as it adds into a range sum. A set adds nothing
+template<typename Value>
+static inline int64_t summand(Value value){
+    if constexpr(is_same<Value, NoValue>::value) return 0;
+    else return value;
+}
+
 void printArguments(){
     cout<<"USAGE: ./benchmark [options]"<<endl;
     cout<<"Options:"<<endl;
@@ -20,9 +55,114 @@ void printArguments(){
     cout<<"    -r [double]  length of range for sacnning expressed as percentage of inserted keys (0 < r <= 1)"<<endl;
     cout<<"    -rr[int]     number of repeating for range scan queries "<<endl;
     cout<<"    -s [int]     number of key-value pairs to search"<<endl;
+    cout<<"    -q [int]     number of rank, select and range_count queries"<<endl;
+    cout<<"    -t [int]     number of threads of the parallel range scans (1 by default)"<<endl;
+    cout<<"    -c           count B+ tree descents and visited nodes per insert"<<endl;
+    cout<<"    -l [double]  bulk load the inserted keys in order into a fresh PMA at the given density (0 < l <= 1)"<<endl;
+    cout<<"    -b           sweep insert_batch over batch sizes of 1K to 1M on fresh PMAs"<<endl;
+    cout<<"    -u [int]     number of churn cycles deleting and reinserting the -d keys (half of the keys by default)"<<endl;
+    cout<<"    -m [int]     number of mixed get/insert/remove/update operations on a ConcurrentPMA, on 1 to -t threads"<<endl;
+    cout<<"    -w           turn on the write buffer of the benchmarked PMA"<<endl;
+    cout<<"    -p [int]     ingest the inserted keys into a ShardedPMA, on 1 to the given number of shards"<<endl;
     cout<<endl;
 }
 
+//Resident set size of the process in bytes
+size_t residentMemory(){
+    size_t pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if(statm == NULL) return 0;
+    if(fscanf(statm, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+//Full scan of the key range, reported as elements per second
+void churnScan(BenchmarkPMA &pma, int64_t totalInsert, int64_t elements, const char *phase){
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    start = chrono::high_resolution_clock::now();
+    int64_t sum_key, sum_value;
+    tie(sum_key, sum_value) = pma.range_sum_scan(0, totalInsert + 1);
+    stop = chrono::high_resolution_clock::now();
+    if(!sumsMatch(sum_key, sum_value)){
+        cout<<"Error in range scan!"<<endl;
+        exit(0);
+    }
+    int64_t scanDelay = max((int64_t)1, (int64_t)chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+    cout<<"    "<<phase<<": "<<elements<<" elements, "<<pma.totalSegments<<" segments, scan "<<(double)elements / scanDelay<<" M elements/s, resident "<<residentMemory() / (1024 * 1024)<<" MB"<<endl;
+}
+
+/*
+    Mixed workload on a ConcurrentPMA holding keys 1..totalInsert: 50% get, 20% insert, 20% remove and 10% update of
+    random keys in [1, 2*totalInsert]. Thread t only writes keys congruent to t, so the final count is known
+ */
+void mixedWorkload(int64_t totalInsert, int64_t operations, int threads){
+    typedef ConcurrentPMA<Benchmark_key, Benchmark_value> BenchmarkConcurrentPMA;
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    for(int t = 1; t <= threads; t = t < threads && t * 2 > threads ? threads : t * 2){
+        BenchmarkConcurrentPMA pma(totalInsert);
+        for(int64_t key = 1; key <= totalInsert; key++) pma.insert(key, benchmarkValue(key));
+        vector<int64_t> added(t, 0);
+        vector<thread> workers;
+        int64_t span = 2 * totalInsert / t;
+        start = chrono::high_resolution_clock::now();
+        for(int w = 0; w < t; w++){
+            workers.emplace_back([&, w](){
+                mt19937_64 rng(w + 1);
+                for(int64_t i = w; i < operations; i += t){
+                    uint64_t r = rng();
+                    Benchmark_key key = 1 + w + (Benchmark_key)((r >> 8) % span) * t;
+                    int kind = r % 10;
+                    if(kind < 5) pma.get(key);
+                    else if(kind < 7) added[w] += pma.insert(key, benchmarkValue(key));
+                    else if(kind < 9) added[w] -= pma.remove(key);
+                    else pma.update(key, benchmarkValue(key));
+                }
+            });
+        }
+        for(thread &worker : workers) worker.join();
+        stop = chrono::high_resolution_clock::now();
+        int64_t expected = totalInsert;
+        for(int64_t a : added) expected += a;
+        int64_t sum_key, sum_value;
+        tie(sum_key, sum_value) = pma.range_sum(0, 2 * totalInsert + t + 1);
+        if(pma.pma.range_count(0, 2 * totalInsert + t + 1) != expected || !sumsMatch(sum_key, sum_value)){
+            cout<<"Error in mixed workload!"<<endl;
+            exit(0);
+        }
+        int64_t mixedDelay = max((int64_t)1, (int64_t)chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+        cout<<"Mixed workload of "<<operations<<" operations on "<<t<<" threads in "<<mixedDelay<<" microSeconds ("<<(double)operations / mixedDelay<<" M ops/s)."<<endl;
+    }
+}
+
+/*
+    Ingest of the keys 1..totalInsert in random order into a ShardedPMA over that range, on 1 to shards shards. The
+    time covers queueing the inserts and the flush that waits for them
+ */
+void shardedIngest(int64_t totalInsert, int shards){
+    typedef ShardedPMA<Benchmark_key, Benchmark_value> BenchmarkShardedPMA;
+    chrono::time_point<std::chrono::high_resolution_clock> start, stop;
+    vector<Benchmark_key> keys(totalInsert);
+    for(int64_t i = 0; i < totalInsert; i++) keys[i] = i + 1;
+    shuffle(keys.begin(), keys.end(), mt19937_64(1));
+    for(int s = 1; s <= shards; s = s < shards && s * 2 > shards ? shards : s * 2){
+        BenchmarkShardedPMA pma(s, 1, totalInsert, totalInsert);
+        start = chrono::high_resolution_clock::now();
+        for(Benchmark_key key : keys) pma.insert(key, benchmarkValue(key));
+        pma.flush();
+        stop = chrono::high_resolution_clock::now();
+        int64_t sum_key, sum_value, segments = 0;
+        tie(sum_key, sum_value) = pma.range_sum(0, totalInsert + 1);
+        if(sum_key != totalInsert * (totalInsert + 1) / 2 || !sumsMatch(sum_key, sum_value)){
+            cout<<"Error in sharded ingest!"<<endl;
+            exit(0);
+        }
+        for(int i = 0; i < s; i++) segments += pma.shard(i).totalSegments;
+        int64_t ingestDelay = max((int64_t)1, (int64_t)chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+        cout<<"Sharded ingest of "<<totalInsert<<" elements on "<<s<<" shards in "<<ingestDelay<<" microSeconds ("<<(double)totalInsert / ingestDelay<<" M inserts/s), "<<segments<<" segments."<<endl;
+    }
+}
+
 int main(int argc, char **argv){
     //Redirect cout to file out.txt
     //std::ofstream out("out.txt");
@@ -35,14 +175,23 @@ int main(int argc, char **argv){
         return 1;
     }
 
-    type_t totalInsert = 0;
-    type_t totalDelete = 0;
+    int64_t totalInsert = 0;
+    int64_t totalDelete = 0;
     double rangeRatio = -1;
-    type_t rangeLength = 0;
-    type_t rangeIteration = 0;
-    type_t totalSearch = 0;
+    int64_t rangeLength = 0;
+    int64_t rangeIteration = 0;
+    int64_t totalSearch = 0;
+    int64_t totalRankQuery = 0;
+    int threads = 1;
+    bool countDescent = false;
+    bool writeBuffer = false;
+    bool batchSweep = false;
+    double loadDensity = -1;
+    int64_t churnCycles = 0;
+    int64_t mixedOperations = 0;
+    int shardCount = 0;
 
-    for (type_t i = 1; i<argc; i++) {
+    for (int64_t i = 1; i<argc; i++) {
         if(strcmp(argv[i], "-i") == 0) {
             totalInsert = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-d") == 0) {
@@ -53,6 +202,24 @@ int main(int argc, char **argv){
             rangeIteration = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-s") == 0) {
             totalSearch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            totalRankQuery = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            countDescent = true;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            writeBuffer = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batchSweep = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            loadDensity = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            churnCycles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mixedOperations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            shardCount = atoi(argv[++i]);
         } else {
             printArguments();
             return 1;
@@ -63,14 +230,17 @@ int main(int argc, char **argv){
         totalInsert = InsertSize;
     }
     if(rangeRatio>0){
-        rangeLength = (type_t)(totalInsert * rangeRatio);
+        rangeLength = (int64_t)(totalInsert * rangeRatio);
     }
     if(rangeIteration > 0 && rangeLength<0) {
         cout<<"Range Iteration without specifying range length is ambigous"<<endl;
         exit(1);
     }
 
-    PMA pma(totalInsert);
+    BenchmarkPMA pma(totalInsert);
+    pma.setThreads(threads);
+    pma.setWriteBuffer(writeBuffer);
+    cout<<"Bitmap engine: "<<(Bitmap_engine == 1 ? "Jacobson table" : "bit instructions")<<", "<<sizeof(Benchmark_key) * 8<<"-bit keys, "<<valueBytes * 8<<"-bit values"<<endl;
 
     if(totalInsert < rangeLength) {
         cout<<"Range length greater than total elements"<<endl;
@@ -81,10 +251,10 @@ int main(int argc, char **argv){
         exit(1);
     }
 
-    int64_t *data;
+    Benchmark_key *data;
     if(Insert_type == 1){
         int insertCount = 128, inserted = 0;
-        type_t insertDelay = 0;
+        int64_t insertDelay = 0;
         while(inserted+insertCount <= totalInsert){
             int64_t *data;
             data =  (int64_t *)malloc((insertCount+1) * sizeof(int64_t));
@@ -105,7 +275,7 @@ int main(int argc, char **argv){
 
             start = chrono::high_resolution_clock::now();
             for(int i = 0; i<insertCount; i++){
-                pma.insert(data[i], data[i] * 10);
+                pma.insert(data[i], benchmarkValue(data[i]));
             }
             stop = chrono::high_resolution_clock::now();
             int64_t delay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
@@ -122,11 +292,12 @@ int main(int argc, char **argv){
     }
     else{
         //int64_t *data;
-        data = (int64_t *)malloc((totalInsert+1) * sizeof(int64_t));
+        data = (Benchmark_key *)malloc((totalInsert+1) * sizeof(Benchmark_key));
         for(int i=0; i<totalInsert; i++) data[i] = i+1;
         srand(time(NULL));
         for(int i = 0; i<totalInsert; i++){
-            int64_t source, dest, buffer;
+            int64_t source, dest;
+            Benchmark_key buffer;
             source = rand() % totalInsert;
             dest = rand() % totalInsert;
             buffer = data[source];
@@ -135,20 +306,77 @@ int main(int argc, char **argv){
         }
         start = chrono::high_resolution_clock::now();
         for(int i = 0; i<totalInsert; i++){
-            if(!pma.insert(data[i], data[i] * 10))
+            if(!pma.insert(data[i], benchmarkValue(data[i])))
                 cout<<"Could not insert: "<<data[i]<<endl;
         }
         stop = chrono::high_resolution_clock::now();
-        type_t insertDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        int64_t insertDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
         cout<<"Inserted "<<totalInsert<<" elements in "<<insertDelay<<" microSeconds."<<endl;
         pma.printStat();
+        if(countDescent){
+            cout<<"Tree descents: "<<pma.tree->descentCount<<" ("<<(double)pma.tree->descentCount/totalInsert<<" per insert), ";
+            cout<<"nodes visited: "<<pma.tree->nodeVisitCount<<" ("<<(double)pma.tree->nodeVisitCount/totalInsert<<" per insert)"<<endl;
+        }
     }
     
+    //Batch insertion of the same keys into fresh PMAs
+    if(batchSweep){
+        BenchmarkValue *values = (BenchmarkValue *)malloc((totalInsert+1) * sizeof(BenchmarkValue));
+        for(int64_t i = 0; i<totalInsert; i++) values[i] = benchmarkValue(data[i]);
+        for(int64_t batchSize = 1000; batchSize <= 1000000; batchSize *= 10){
+            if(batchSize > totalInsert) break;
+            BenchmarkPMA batchPma(totalInsert);
+            start = chrono::high_resolution_clock::now();
+            for(int64_t i = 0; i<totalInsert; i += batchSize){
+                batchPma.insert_batch(data + i, values + i, min(batchSize, totalInsert - i));
+            }
+            stop = chrono::high_resolution_clock::now();
+            int64_t batchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+            cout<<"Batch inserted "<<totalInsert<<" elements in batches of "<<batchSize<<" in "<<batchDelay<<" microSeconds, "<<batchPma.totalSegments<<" segments."<<endl;
+        }
+        //A batch reaching the largest key, which the last segment takes without a bound
+        BenchmarkPMA edgePma(totalInsert);
+        edgePma.insert_batch(data, values, totalInsert);
+        Benchmark_key edgeKeys[2] = {(Benchmark_key)(totalInsert + 1), numeric_limits<Benchmark_key>::max()};
+        BenchmarkValue edgeValues[2] = {benchmarkValue(edgeKeys[0]), benchmarkValue(edgeKeys[0])};
+        size_t edgeInserted = edgePma.insert_batch(edgeKeys, edgeValues, 2);
+        if(edgeInserted != 2 || !edgePma.lookup(edgeKeys[1])) cout<<"Batch up to the largest key inserted "<<edgeInserted<<" of 2 pairs"<<endl;
+        else cout<<"Batch up to the largest key inserted."<<endl;
+        free(values);
+    }
+
+    //Bulk load of the sorted keys into a fresh PMA, against a plain copy of the same pairs
+    if(loadDensity > 0){
+        Benchmark_key *keys = (Benchmark_key *)malloc((totalInsert+1) * sizeof(Benchmark_key));
+        BenchmarkValue *values = (BenchmarkValue *)malloc((totalInsert+1) * sizeof(BenchmarkValue));
+        for(int64_t i = 0; i<totalInsert; i++){
+            keys[i] = i+1;
+            values[i] = benchmarkValue(keys[i]);
+        }
+        BenchmarkPMA loadPma(totalInsert);
+        start = chrono::high_resolution_clock::now();
+        loadPma.bulk_load(keys, values, totalInsert, loadDensity);
+        stop = chrono::high_resolution_clock::now();
+        int64_t loadDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+
+        char *copy = (char *)malloc((totalInsert+1) * (sizeof(Benchmark_key) + valueBytes));
+        start = chrono::high_resolution_clock::now();
+        memcpy(copy, keys, totalInsert * sizeof(Benchmark_key));
+        memcpy(copy + totalInsert * sizeof(Benchmark_key), values, totalInsert * valueBytes);
+        stop = chrono::high_resolution_clock::now();
+        int64_t copyDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Bulk loaded "<<totalInsert<<" elements at density "<<loadDensity<<" in "<<loadDelay<<" microSeconds (memcpy "<<copyDelay<<" microSeconds)."<<endl;
+        loadPma.printStat();
+        free(copy);
+        free(keys);
+        free(values);
+    }
+
     //Searching in the PMA
     if(totalSearch>0){
         int notFound = 0;
         start = chrono::high_resolution_clock::now();
-        for(type_t i=0; i<totalSearch; i++){
+        for(int64_t i=0; i<totalSearch; i++){
             if(!pma.lookup(data[i])){
                 notFound++;
                 cout<<"Could not get key: "<<data[i]<<endl;
@@ -158,16 +386,77 @@ int main(int argc, char **argv){
         stop = chrono::high_resolution_clock::now();
         int64_t searchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
         cout<<"Searched "<<totalSearch<<" elements in "<<searchDelay<<" microSeconds."<<endl;
+
+        //Values of the same keys, bumped in place as a counter and set back through upsert
+        auto bump = [](auto value, int64_t by){
+            if constexpr(BenchmarkPMA::isSet) return value;
+            else return (decltype(value))(value + by);
+        };
+        int64_t wrong = 0;
+        start = chrono::high_resolution_clock::now();
+        for(int64_t i=0; i<totalSearch; i++){
+            auto value = pma.get(data[i]);
+            if(!value || !sumsMatch(data[i], summand(*value)) || !pma.update(data[i], bump(*value, 1))) wrong++;
+        }
+        stop = chrono::high_resolution_clock::now();
+        searchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Read and updated "<<totalSearch<<" values in place in "<<searchDelay<<" microSeconds."<<endl;
+        start = chrono::high_resolution_clock::now();
+        for(int64_t i=0; i<totalSearch; i++){
+            if(pma.upsert(data[i], bump(*pma.get(data[i]), -1))) wrong++;
+        }
+        stop = chrono::high_resolution_clock::now();
+        searchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Read and upserted "<<totalSearch<<" values in "<<searchDelay<<" microSeconds."<<endl;
+        if(wrong > 0){
+            cout<<"Error in get, update or upsert: "<<wrong<<" failures"<<endl;
+            exit(0);
+        }
+
+        //Neighbours of the same keys, which are dense
+        int64_t mismatch = 0;
+        start = chrono::high_resolution_clock::now();
+        for(int64_t i=0; i<totalSearch; i++){
+            auto next = pma.successor(data[i]);
+            auto prev = pma.predecessor(data[i]);
+            if(next.has_value() != (data[i] < totalInsert) || (next && next->first != data[i] + 1)) mismatch++;
+            if(prev.has_value() != (data[i] > 1) || (prev && prev->first != data[i] - 1)) mismatch++;
+        }
+        stop = chrono::high_resolution_clock::now();
+        searchDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Found successors and predecessors of "<<totalSearch<<" elements in "<<searchDelay<<" microSeconds."<<endl;
+        if(mismatch > 0){
+            cout<<"Error in successor or predecessor: "<<mismatch<<" mismatches"<<endl;
+            exit(0);
+        }
+    }
+
+    //Order statistics. The rank of a key selects the key back, and the keys are dense so a range of them counts its length
+    if(totalRankQuery>0){
+        int64_t mismatch = 0;
+        start = chrono::high_resolution_clock::now();
+        for(int64_t i=0; i<totalRankQuery; i++){
+            Benchmark_key key = data[i % totalInsert];
+            BenchmarkPMA::Cursor cursor = pma.select(pma.rank(key));
+            if(!cursor.valid() || cursor.key() != key) mismatch++;
+            if(pma.range_count(key, key + 999) != min((int64_t)1000, totalInsert - key + 1)) mismatch++;
+        }
+        stop = chrono::high_resolution_clock::now();
+        cout<<"Ran "<<totalRankQuery<<" rank, select and range_count queries in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+        if(mismatch > 0){
+            cout<<"Error in order statistics: "<<mismatch<<" mismatches"<<endl;
+            exit(0);
+        }
     }
     
     //Range Scan in the PMA
     if(rangeLength>0){
         start = chrono::high_resolution_clock::now();
         for(int i=0; i<rangeIteration; i++){
-            type_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
-            type_t sum_key, sum_value;
-            tie(sum_key, sum_value) = pma.range_sum(startRange, startRange+rangeLength);
-            if(sum_key*10 != sum_value){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key, sum_value;
+            tie(sum_key, sum_value) = pma.range_sum_scan(startRange, startRange+rangeLength);
+            if(!sumsMatch(sum_key, sum_value)){
                 cout<<"Error in range scan!"<<endl;
                 exit(0);
             }
@@ -175,12 +464,169 @@ int main(int argc, char **argv){
         stop = chrono::high_resolution_clock::now();
         int64_t scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
         cout<<"Scanned elements with range "<<rangeLength<<" total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Same ranges summed from the aggregates of the tree
+        start = chrono::high_resolution_clock::now();
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key, sum_value;
+            tie(sum_key, sum_value) = pma.range_sum(startRange, startRange+rangeLength);
+            if(!sumsMatch(sum_key, sum_value)){
+                cout<<"Error in range sum!"<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Summed ranges of "<<rangeLength<<" elements from aggregates "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Same scans a pair at a time through a cursor
+        start = chrono::high_resolution_clock::now();
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key = 0, sum_value = 0;
+            for(BenchmarkPMA::Cursor cursor = pma.seek(startRange); cursor.valid() && cursor.key() <= startRange+rangeLength; cursor.next()){
+                sum_key += cursor.key();
+                sum_value += summand(cursor.value());
+            }
+            if(!sumsMatch(sum_key, sum_value)){
+                cout<<"Error in cursor scan!"<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Cursor scanned elements with range "<<rangeLength<<" total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Same scans handed over up to 64 slots at a time
+        start = chrono::high_resolution_clock::now();
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key = 0, sum_value = 0;
+            pma.scan_blocks(startRange, startRange+rangeLength, [&](const Benchmark_key *keys, const auto *values, uint64_t mask, int count){
+                for(int j = 0; j < count; j++){
+                    int64_t occupied = -(int64_t)((mask >> j) & 1);
+                    sum_key += keys[j] & occupied;
+                    if constexpr(!BenchmarkPMA::isSet) sum_value += values[j] & occupied;
+                }
+            });
+            if(!sumsMatch(sum_key, sum_value)){
+                cout<<"Error in block scan!"<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Block scanned elements with range "<<rangeLength<<" total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Same ranges scanned backward from their end
+        start = chrono::high_resolution_clock::now();
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key, sum_value;
+            tie(sum_key, sum_value) = pma.range_sum_desc(startRange, startRange+rangeLength, -1);
+            if(!sumsMatch(sum_key, sum_value)){
+                cout<<"Error in descending range scan!"<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Scanned elements backward with range "<<rangeLength<<" total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Last 100 pairs of the same ranges, checked against a reverse cursor
+        start = chrono::high_resolution_clock::now();
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            int64_t sum_key, sum_value, cursor_key = 0, taken = 0;
+            tie(sum_key, sum_value) = pma.range_sum_desc(startRange, startRange+rangeLength, 100);
+            for(BenchmarkPMA::ReverseCursor cursor = pma.rseek(startRange+rangeLength); cursor.valid() && cursor.key() >= startRange && taken < 100; cursor.next(), taken++) cursor_key += cursor.key();
+            if(!sumsMatch(sum_key, sum_value) || sum_key != cursor_key){
+                cout<<"Error in top 100 of range!"<<endl;
+                exit(0);
+            }
+        }
+        stop = chrono::high_resolution_clock::now();
+        scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+        cout<<"Summed the last 100 elements of range "<<rangeLength<<" total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+
+        //Same ranges keeping the upper half of the values, filtered in the scan and behind a cursor. A set filters its keys
+        int64_t valueScale = BenchmarkPMA::isSet ? 1 : 10, filterDelay = 0, cursorDelay = 0;
+        for(int i=0; i<rangeIteration; i++){
+            int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+            ValuePredicate predicate = ValuePredicate::greater((startRange + rangeLength / 2) * valueScale);
+            start = chrono::high_resolution_clock::now();
+            BenchmarkPMA::aggregate_t filtered = pma.range_sum_where(startRange, startRange+rangeLength, predicate);
+            stop = chrono::high_resolution_clock::now();
+            filterDelay += chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+
+            start = chrono::high_resolution_clock::now();
+            int64_t count = 0, sum_key = 0, sum_value = 0;
+            for(BenchmarkPMA::Cursor cursor = pma.seek(startRange); cursor.valid() && cursor.key() <= startRange+rangeLength; cursor.next()){
+                if(!predicate.test(BenchmarkPMA::isSet ? (int64_t)cursor.key() : summand(cursor.value()))) continue;
+                count++;
+                sum_key += cursor.key();
+                sum_value += summand(cursor.value());
+            }
+            stop = chrono::high_resolution_clock::now();
+            cursorDelay += chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+            if(!sumsMatch(filtered.keySum, filtered.valueSum) || filtered.count != count || filtered.keySum != sum_key || filtered.valueSum != sum_value){
+                cout<<"Error in filtered scan!"<<endl;
+                exit(0);
+            }
+        }
+        cout<<"Filtered scans of range "<<rangeLength<<" total "<<rangeIteration<<" times in "<<filterDelay<<" microSeconds, behind a cursor in "<<cursorDelay<<" microSeconds."<<endl;
+
+        //Same scans split across the worker threads
+        if(threads > 1){
+            start = chrono::high_resolution_clock::now();
+            for(int i=0; i<rangeIteration; i++){
+                int64_t startRange = totalInsert == rangeLength? 0 : rand()%(totalInsert - rangeLength);
+                int64_t sum_key, sum_value;
+                tie(sum_key, sum_value) = pma.range_sum_parallel(startRange, startRange+rangeLength);
+                if(!sumsMatch(sum_key, sum_value)){
+                    cout<<"Error in parallel range scan!"<<endl;
+                    exit(0);
+                }
+            }
+            stop = chrono::high_resolution_clock::now();
+            scanDelay = chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+            cout<<"Scanned elements with range "<<rangeLength<<" on "<<threads<<" threads total "<<rangeIteration<<" times in " <<scanDelay<<" microSeconds."<<endl;
+        }
     }
     
+    //Insert/delete cycles over the same keys, tracking scan throughput and memory after each phase
+    if(churnCycles > 0){
+        int64_t churnSize = totalDelete > 0 ? totalDelete : totalInsert / 2;
+        for(int64_t cycle = 0; cycle < churnCycles; cycle++){
+            for(int64_t i = 0; i<churnSize; i++){
+                int64_t swapWith = i + rand() % (totalInsert - i);
+                Benchmark_key buffer = data[i];
+                data[i] = data[swapWith];
+                data[swapWith] = buffer;
+            }
+            cout<<"Churn cycle "<<cycle+1<<endl;
+            start = chrono::high_resolution_clock::now();
+            for(int64_t i = 0; i<churnSize; i++) pma.remove(data[i]);
+            stop = chrono::high_resolution_clock::now();
+            cout<<"    Deleted "<<churnSize<<" elements in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+            churnScan(pma, totalInsert, totalInsert - churnSize, "after delete");
+
+            start = chrono::high_resolution_clock::now();
+            for(int64_t i = 0; i<churnSize; i++) pma.insert(data[i], benchmarkValue(data[i]));
+            stop = chrono::high_resolution_clock::now();
+            cout<<"    Inserted "<<churnSize<<" elements in "<<chrono::duration_cast<std::chrono::microseconds>(stop - start).count()<<" microSeconds."<<endl;
+            churnScan(pma, totalInsert, totalInsert, "after insert");
+        }
+    }
+
+    if(mixedOperations > 0) mixedWorkload(totalInsert, mixedOperations, threads);
+    if(shardCount > 0) shardedIngest(totalInsert, shardCount);
+
     //records = (int64_t *)malloc(totalDelete * sizeof(int64_t));
     if(totalDelete > 0){
         start = chrono::high_resolution_clock::now();
-        for(type_t i=0; i<totalDelete; i++){
+        for(int64_t i=0; i<totalDelete; i++){
             //records[i] = numbers(rng);
             //cin>>records[i];
             pma.remove(data[i]);
@@ -6,11 +6,10 @@
 //#define CHUNK_SIZE 262144
 //#define SEGMENT_SIZE 16384//1024//16384//32768
 
+//Default segment size in bytes of keys and B+ tree degree. PMA and BPlusTree take them as template parameters
 #define SEGMENT_SIZE 1024
 //#define TOTAL_SEGMENTS 65536
 
-#define type_t int64_t
-
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
 
@@ -27,6 +26,18 @@
 
 #define Tree_Degree 16
 
+//Key search inside B+ tree nodes and leaves: 0 for scalar, 1 for SSE4.2, 2 for AVX2
+//Defaults to the widest instruction set the compiler is targeting
+#ifndef Search_type
+#if defined(__AVX2__)
+#define Search_type 2
+#elif defined(__SSE4_2__)
+#define Search_type 1
+#else
+#define Search_type 0
+#endif
+#endif
+
 //Follows 0 <= rho(l) <= rho(h) <= tou(h) <= tou(l) <= 1
 #define RHO_L 0.20
 #define RHO_H 0.50
@@ -37,6 +48,24 @@
 #define Insert_type 2
 #endif
 
+//Rebalance of an overflowing segment: 1 to always split it, 2 to spread a window of neighbouring segments first
+#ifndef Rebalance_type
+#define Rebalance_type 2
+#endif
+
+//Requests a ShardedPMA queues per shard, a power of two, how many times the mean number of pairs a shard may reach
+//before one of its boundaries moves, and the pairs a shard adds between two checks of its size against the others
+#define Shard_queue 4096
+#define Shard_skew 2.0
+#define Shard_check 4096
+
+//Threads with a slot of their own to announce their epoch in ConcurrentPMA calls. Calls of further threads share one,
+//and retired tree nodes are not freed while any of those runs
+#define Epoch_slots 256
+
+//Inserts a segment holds back once the write buffer of a PMA is turned on
+#define Write_buffer 16
+
 #ifdef __ia64__
 #define ADDR (void *)(0x8000000000000000UL)
 #define FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED)
@@ -50,4 +79,9 @@
 #define JacobsonIndexCount 65536
 #define MaxGap 3
 
+//Bitmap engine: 1 for the Jacobson lookup table, 2 for popcnt/tzcnt/pdep on 64-bit words
+#ifndef Bitmap_engine
+#define Bitmap_engine 2
+#endif
+
 #endif
\ No newline at end of file